@@ -1,29 +1,11 @@
 #include "crc32.h"
 
-#include "util.h"
+#if CRC32_VARIANT != CRC32_NIBBLE && CRC32_VARIANT != CRC32_BYTE && \
+    CRC32_VARIANT != CRC32_SLICE4 && CRC32_VARIANT != CRC32_SLICE8
+#error "Unsupported CRC32_VARIANT, see crc32.h"
+#endif
 
-#define CRC32_POLY 0xedb88320
-
-static uint32_t crc32_table[256];
-
-void crc32_populate_table(void) __attribute__((constructor));
-void crc32_populate_table(void) {
-	unsigned int byt, bit;
-
-	for (byt = 0; byt < ARRAY_SIZE(crc32_table); byt++) {
-		uint32_t crc = byt;
-
-		for (bit = 0; bit < 8; bit++) {
-			if (crc & 1) {
-				crc >>= 1;
-				crc ^= CRC32_POLY;
-			} else {
-				crc >>= 1;
-			}
-		}
-		crc32_table[byt] = crc;
-	}
-}
+#include "crc32_table.h"
 
 uint32_t crc32_init() {
 	return 0xFFFFFFFFUL;
@@ -32,10 +14,34 @@ uint32_t crc32_init() {
 uint32_t crc32_update(uint32_t crc, const void *data, unsigned int len) {
 	const uint8_t *data8 = data;
 
+#if CRC32_VARIANT > CRC32_BYTE
+	while (len >= CRC32_VARIANT) {
+		uint32_t word = crc ^ ((uint32_t)data8[0] | (uint32_t)data8[1] << 8 |
+		                       (uint32_t)data8[2] << 16 | (uint32_t)data8[3] << 24);
+
+		crc = crc32_table[CRC32_VARIANT - 1][word & 0xff] ^
+		      crc32_table[CRC32_VARIANT - 2][(word >> 8) & 0xff] ^
+		      crc32_table[CRC32_VARIANT - 3][(word >> 16) & 0xff] ^
+		      crc32_table[CRC32_VARIANT - 4][word >> 24];
+		/* Bytes past the first word do not mix with the previous CRC */
+		for (unsigned int i = 4; i < CRC32_VARIANT; i++) {
+			crc ^= crc32_table[CRC32_VARIANT - 1 - i][data8[i]];
+		}
+		data8 += CRC32_VARIANT;
+		len -= CRC32_VARIANT;
+	}
+#endif
+
 	while (len--) {
+#if CRC32_VARIANT == CRC32_NIBBLE
+		crc ^= *data8++;
+		crc = (crc >> 4) ^ crc32_table[crc & 0x0f];
+		crc = (crc >> 4) ^ crc32_table[crc & 0x0f];
+#else
 		unsigned int idx = (crc ^ *data8++) & 0xff;
 
-		crc = (crc >> 8) ^ crc32_table[idx];
+		crc = (crc >> 8) ^ crc32_table[0][idx];
+#endif
 	}
 
 	return crc;
@@ -2,6 +2,23 @@
 
 #include <stdint.h>
 
+/*
+ * Lookup table layout, trades speed for RAM. The tables are constant but
+ * still part of the loader image, see crc32_table.h:
+ *   CRC32_NIBBLE: two lookups per byte in 16 entries, 64 bytes
+ *   CRC32_BYTE: one lookup per byte, 1 KiB
+ *   CRC32_SLICE4, CRC32_SLICE8: 4 or 8 bytes per iteration, 4 or 8 KiB
+ * The value is the number of 256 entry tables.
+ */
+#define CRC32_NIBBLE	0
+#define CRC32_BYTE	1
+#define CRC32_SLICE4	4
+#define CRC32_SLICE8	8
+
+#ifndef CRC32_VARIANT
+#define CRC32_VARIANT	CRC32_BYTE
+#endif
+
 uint32_t crc32_init(void);
 uint32_t crc32_update(uint32_t crc, const void *data, unsigned int len);
 uint32_t crc32_final(uint32_t crc);
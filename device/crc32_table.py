@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+"""Writes crc32_table.h, the lookup tables of every CRC32_VARIANT in crc32.h"""
+import sys
+
+CRC32_POLY = 0xedb88320
+# Tables of slice-by-8, byte and slice-by-4 use the first 1 and 4 of them
+MAX_SLICES = 8
+
+def crc32_bits(crc, bits):
+	for _ in range(bits):
+		crc = (crc >> 1) ^ (CRC32_POLY if crc & 1 else 0)
+	return crc
+
+def format_table(values, indent):
+	lines = [ ]
+	for offset in range(0, len(values), 8):
+		lines.append(indent + ", ".join(f"0x{value:08x}" for value in values[offset:offset + 8]) + ",")
+	return lines
+
+def main():
+	nibble = [ crc32_bits(n, 4) for n in range(16) ]
+	# Row k is the CRC of a byte followed by k zero bytes
+	slices = [ [ crc32_bits(n, 8) for n in range(256) ] ]
+	for k in range(1, MAX_SLICES):
+		slices.append([ (crc >> 8) ^ slices[0][crc & 0xff] for crc in slices[k - 1] ])
+
+	lines = [
+		"/* Generated by crc32_table.py, do not edit */",
+		"#pragma once",
+		"",
+		"#include <stdint.h>",
+		"",
+		"#include \"crc32.h\"",
+		"",
+		"#if CRC32_VARIANT == CRC32_NIBBLE",
+		"static const uint32_t crc32_table[16] = {",
+	]
+	lines += format_table(nibble, "\t")
+	lines += [
+		"};",
+		"#else",
+		"static const uint32_t crc32_table[CRC32_VARIANT][256] = {",
+	]
+	for (k, row) in enumerate(slices):
+		if k in (1, 4):
+			lines.append(f"#if CRC32_VARIANT > {k}")
+		lines.append("\t{")
+		lines += format_table(row, "\t\t")
+		lines.append("\t},")
+		if k in (3, 7):
+			lines.append("#endif")
+	lines += [
+		"};",
+		"#endif",
+	]
+
+	out = sys.argv[1] if len(sys.argv) > 1 else "crc32_table.h"
+	with open(out, "w") as f:
+		f.write("\n".join(lines) + "\n")
+
+if __name__ == "__main__":
+	main()
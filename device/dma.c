@@ -1,8 +1,108 @@
 #include "dma.h"
 
+typedef struct dma_channel {
+	dma_dir_t dir;
+	unsigned int len;
+	dma_callback_t done;
+} dma_channel_t;
+
+static dma_channel_t dma_channels[DMA_NUM_CHANNELS];
+
 void dma_disable_irq_rerouting() {
 	DMA0_CTRL_REG &= ~DMAX_CTRL_REG_DINT_MODE;
 	DMA1_CTRL_REG &= ~DMAX_CTRL_REG_DINT_MODE;
 	DMA2_CTRL_REG &= ~DMAX_CTRL_REG_DINT_MODE;
 	DMA3_CTRL_REG &= ~DMAX_CTRL_REG_DINT_MODE;
 }
+
+static void dma_set_a(unsigned int channel, const volatile void *ptr) {
+	DMAX_A_STARTL_REG(channel) = (uint16_t)(uintptr_t)ptr;
+	DMAX_A_STARTH_REG(channel) = (uint16_t)((uintptr_t)ptr >> 16);
+}
+
+static void dma_set_b(unsigned int channel, const volatile void *ptr) {
+	DMAX_B_STARTL_REG(channel) = (uint16_t)(uintptr_t)ptr;
+	DMAX_B_STARTH_REG(channel) = (uint16_t)((uintptr_t)ptr >> 16);
+}
+
+static void dma_set_len(unsigned int channel, unsigned int len) {
+	dma_channels[channel].len = len;
+	/* Interrupt once the last unit has been transferred */
+	DMAX_INT_REG(channel) = len;
+	DMAX_LEN_REG(channel) = len;
+}
+
+void dma_setup(unsigned int channel, const dma_xfer_desc_t *desc) {
+	dma_channel_t *chan = &dma_channels[channel];
+	unsigned int ctrl = desc->prio | desc->width;
+
+	switch (desc->dir) {
+	case DMA_MEM_TO_PERIPH:
+		ctrl |= DMAX_CTRL_REG_AINC | DMAX_CTRL_REG_DREQ_MODE;
+		break;
+	case DMA_PERIPH_TO_MEM:
+		ctrl |= DMAX_CTRL_REG_BINC | DMAX_CTRL_REG_DREQ_MODE;
+		break;
+	case DMA_MEM_TO_MEM:
+		/* Runs as soon as it is switched on */
+		ctrl |= DMAX_CTRL_REG_AINC | DMAX_CTRL_REG_BINC;
+		break;
+	}
+	if (desc->circular) {
+		ctrl |= DMAX_CTRL_REG_CIRCULAR;
+	}
+	if (desc->done && desc->dir != DMA_MEM_TO_MEM) {
+		ctrl |= DMAX_CTRL_REG_DINT_MODE;
+	}
+
+	DMAX_CTRL_REG(channel) = ctrl;
+	chan->dir = desc->dir;
+	chan->done = desc->done;
+	dma_set_a(channel, desc->src);
+	dma_set_b(channel, desc->dst);
+	dma_set_len(channel, desc->len);
+}
+
+void dma_start(unsigned int channel) {
+	DMAX_CTRL_REG(channel) |= DMAX_CTRL_REG_DMA_ON;
+}
+
+void dma_stop(unsigned int channel) {
+	DMAX_CTRL_REG(channel) &= ~DMAX_CTRL_REG_DMA_ON;
+}
+
+void dma_restart(unsigned int channel, const volatile void *mem, unsigned int len) {
+	dma_stop(channel);
+	if (dma_channels[channel].dir == DMA_MEM_TO_PERIPH) {
+		dma_set_a(channel, mem);
+	} else {
+		dma_set_b(channel, mem);
+	}
+	dma_set_len(channel, len);
+	dma_start(channel);
+}
+
+void dma_xfer(unsigned int channel, const dma_xfer_desc_t *desc) {
+	dma_setup(channel, desc);
+	dma_start(channel);
+}
+
+unsigned int dma_progress(unsigned int channel) {
+	return DMAX_IDX_REG(channel);
+}
+
+bool dma_done(unsigned int channel) {
+	return !(DMAX_CTRL_REG(channel) & DMAX_CTRL_REG_DMA_ON) ||
+	       DMAX_IDX_REG(channel) >= dma_channels[channel].len;
+}
+
+/*
+ * The interrupt line is shared with the peripheral, callbacks check for
+ * themselves whether the transfer progressed.
+ */
+void dma_irq(unsigned int channel) {
+	dma_callback_t done = dma_channels[channel].done;
+	if (done) {
+		done(channel);
+	}
+}
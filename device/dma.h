@@ -1,14 +1,16 @@
 #pragma once
 
-#include "util.h"
+#include <stdbool.h>
 
+#include "util.h"
 
 #define DMA_SPI_RX		0
 #define DMA_SPI_TX		1
 #define DMA_UART_RX		2
 #define DMA_UART_TX		3
+#define DMA_NUM_CHANNELS	4
 
-#define DMAX_BASE(i)		(0xFF4400UL + (unsigned long)i * 0x10UL)
+#define DMAX_BASE(i)		(0xFF4400UL + (unsigned long)(i) * 0x10UL)
 #define DMAX_A_STARTL_REG(i)	MMIO16(DMAX_BASE(i) + 0x00UL)
 #define DMAX_A_STARTH_REG(i)	MMIO16(DMAX_BASE(i) + 0x02UL)
 #define DMAX_B_STARTL_REG(i)	MMIO16(DMAX_BASE(i) + 0x04UL)
@@ -48,5 +50,51 @@
 #define DMA2_CTRL_REG		MMIO16(0xFF442C)
 #define DMA3_CTRL_REG		MMIO16(0xFF443C)
 
+typedef enum {
+	DMA_MEM_TO_PERIPH,
+	DMA_PERIPH_TO_MEM,
+	DMA_MEM_TO_MEM
+} dma_dir_t;
+
+/* Called from the interrupt of the peripheral the channel is routed to, see dma_irq() */
+typedef void (*dma_callback_t)(unsigned int channel);
+
+typedef struct dma_xfer_desc {
+	dma_dir_t dir;
+	/* The peripheral side is a data register and never incremented */
+	const volatile void *src;
+	volatile void *dst;
+	/* In units of width, at most 0xFFFF */
+	unsigned int len;
+	/* DMAX_CTRL_REG_BW_* */
+	unsigned int width;
+	/* DMAX_CTRL_REG_DMA_PRIO_* */
+	unsigned int prio;
+	/* Start over at the beginning of the buffer after len units */
+	bool circular;
+	/*
+	 * Routes the completion interrupt to the peripheral (DINT_MODE), whose
+	 * handler calls dma_irq(). Memory to memory transfers have no peripheral
+	 * interrupt, poll dma_done() for those.
+	 */
+	dma_callback_t done;
+} dma_xfer_desc_t;
+
+/* Start addresses are 32 bit, which only matters for the stack of the host build */
+static inline bool dma_addressable(const volatile void *ptr) {
+	return (uintptr_t)ptr == (uint32_t)(uintptr_t)ptr;
+}
+
 void dma_disable_irq_rerouting(void);
+/* Program a channel, a running transfer on it is stopped */
+void dma_setup(unsigned int channel, const dma_xfer_desc_t *desc);
+void dma_start(unsigned int channel);
+void dma_stop(unsigned int channel);
+/* Start another transfer with the setup of the last one, but a different memory buffer */
+void dma_restart(unsigned int channel, const volatile void *mem, unsigned int len);
+void dma_xfer(unsigned int channel, const dma_xfer_desc_t *desc);
+/* Units transferred so far, wraps to 0 in circular mode */
+unsigned int dma_progress(unsigned int channel);
+bool dma_done(unsigned int channel);
+void dma_irq(unsigned int channel);
 
@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pty.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "dma.h"
+#include "irq.h"
+#include "host/mmio_host.h"
+#include "host/spi_flash_host.h"
+
+#define FLASH_SIZE_DEFAULT	0x800000UL
+
+/* Keeps the pty across a loader reset, see host_reset() */
+#define PTY_FD_ENV		"LOADER_HOST_PTY_FD"
+
+static char **host_argv;
+static bool restart_on_reset = false;
+
+static void host_reset(void) {
+	if (restart_on_reset) {
+		execv("/proc/self/exe", host_argv);
+	}
+	_exit(0);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-f flash.bin] [-s size] [-l link] [-r]\n", prog);
+	fprintf(stderr, "  -f  Flash image, modified in place by erase/program\n");
+	fprintf(stderr, "  -s  Flash size in bytes, default 0x%lx\n", FLASH_SIZE_DEFAULT);
+	fprintf(stderr, "  -l  Create a symlink to the pty at this path\n");
+	fprintf(stderr, "  -r  Restart the loader instead of exiting on reset\n");
+}
+
+static uint8_t *open_flash(const char *path, uint32_t size) {
+	if (!path) {
+		uint8_t *flash = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (flash == MAP_FAILED) {
+			perror("Failed to allocate flash");
+			exit(1);
+		}
+		memset(flash, 0xFF, size);
+		return flash;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror("Failed to open flash image");
+		exit(1);
+	}
+	struct stat st;
+	fstat(fd, &st);
+	if (st.st_size < size && ftruncate(fd, size)) {
+		perror("Failed to resize flash image");
+		exit(1);
+	}
+	uint8_t *flash = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (flash == MAP_FAILED) {
+		perror("Failed to map flash image");
+		exit(1);
+	}
+	/* A new or short image reads as erased flash */
+	if (st.st_size < size) {
+		memset(&flash[st.st_size], 0xFF, size - st.st_size);
+	}
+	close(fd);
+	return flash;
+}
+
+static int open_uart(const char *link) {
+	const char *inherited = getenv(PTY_FD_ENV);
+	if (inherited) {
+		return atoi(inherited);
+	}
+
+	int master, slave;
+	if (openpty(&master, &slave, NULL, NULL, NULL)) {
+		perror("Failed to open pty");
+		exit(1);
+	}
+	struct termios tio;
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+	/* The slave stays open so the master does not see EIO while no host is connected */
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+	const char *name = ttyname(slave);
+	fprintf(stderr, "Loader running on %s\n", name);
+	if (link) {
+		unlink(link);
+		if (symlink(name, link)) {
+			perror("Failed to create pty symlink");
+		}
+	}
+
+	char fd_str[16];
+	snprintf(fd_str, sizeof(fd_str), "%d", master);
+	setenv(PTY_FD_ENV, fd_str, 1);
+	return master;
+}
+
+int main(int argc, char **argv) {
+	const char *flash_path = NULL;
+	const char *link = NULL;
+	uint32_t flash_size = FLASH_SIZE_DEFAULT;
+	int opt;
+
+	host_argv = argv;
+	while ((opt = getopt(argc, argv, "f:s:l:rh")) != -1) {
+		switch (opt) {
+		case 'f':
+			flash_path = optarg;
+			break;
+		case 's':
+			flash_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			link = optarg;
+			break;
+		case 'r':
+			restart_on_reset = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	spi_flash_host_init(open_flash(flash_path, flash_size), flash_size);
+	mmio_host_init(open_uart(link), host_reset);
+
+	/* Same as c_entry() */
+	dma_disable_irq_rerouting();
+	enable_interrupts();
+
+	return loader_main();
+}
@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+
+#include "mmio_host.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chipid.h"
+#include "dma.h"
+#include "irq.h"
+#include "qspi.h"
+#include "system.h"
+#include "timer.h"
+#include "uart.h"
+#include "spi_flash_host.h"
+
+/* The peripheral model itself accesses the register window directly */
+#undef MMIO8
+#undef MMIO16
+#undef MMIO32
+#define MMIO8(addr) (*((volatile uint8_t*)(addr)))
+#define MMIO16(addr) (*((volatile uint16_t*)(addr)))
+#define MMIO32(addr) (*((volatile uint32_t*)(addr)))
+
+#define REG_ADDR(reg_)	((uintptr_t)&(reg_))
+
+/* Never written by firmware, tells a TX write from taking the register address for DMA */
+#define UART_RX_TX_SENTINEL	0x5A5A
+
+/* Empty RX polls before the main loop is throttled instead of spinning on the pty */
+#define UART_RX_IDLE_POLLS	1000
+#define UART_RX_IDLE_NS		10000L
+
+#define RESET_CHECK_US		10000
+
+extern vector_table_t vector_table;
+
+unsigned int mmio_host_psr = 0;
+
+static int uart_fd = -1;
+static void (*reset_cb)(void);
+
+static bool access_pending = false;
+static uintptr_t pending_addr;
+static unsigned int pending_width;
+static uint32_t pending_old_value;
+
+static unsigned int qspi_bus_width = 1;
+static bool uart_ti_int_pending = false;
+static bool in_isr = false;
+static unsigned int uart_rx_idle_polls = 0;
+/* Timer periods are counted from the wall clock, see host_timer_elapsed() */
+typedef struct host_timer {
+	bool running;
+	struct timespec last;
+	unsigned long pending;
+} host_timer_t;
+
+static host_timer_t tim0;
+static host_timer_t tim1;
+/* Reads of TIMER0_RELOAD_M_REG return the counter, the reload value is kept here */
+static uint16_t tim0_reload_m;
+
+uintptr_t mmio_host_irq_pc = 0;
+
+static void prepare_access(uintptr_t addr, unsigned int width);
+
+static uint32_t reg_read(uintptr_t addr, unsigned int width) {
+	switch (width) {
+	case sizeof(uint8_t):
+		return MMIO8(addr);
+	case sizeof(uint16_t):
+		return MMIO16(addr);
+	default:
+		return MMIO32(addr);
+	}
+}
+
+static uint32_t dma_address(uint16_t low, uint16_t high) {
+	return (uint32_t)low | (uint32_t)high << 16;
+}
+
+static void uart_write_all(const uint8_t *data, size_t len) {
+	while (len) {
+		ssize_t written = write(uart_fd, data, len);
+		if (written < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				struct pollfd pfd = { .fd = uart_fd, .events = POLLOUT };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			perror("UART write failed");
+			exit(1);
+		}
+		data += written;
+		len -= written;
+	}
+}
+
+/* Transfers complete instantly, bandwidth is limited by the pty only */
+static void uart_tx_dma(void) {
+	unsigned int ch = DMA_UART_TX;
+	const uint8_t *src = (const uint8_t *)(uintptr_t)dma_address(DMAX_A_STARTL_REG(ch), DMAX_A_STARTH_REG(ch));
+	unsigned int len = DMAX_LEN_REG(ch);
+
+	uart_write_all(src, len);
+	DMAX_IDX_REG(ch) = len;
+	DMAX_CTRL_REG(ch) &= ~DMAX_CTRL_REG_DMA_ON;
+	UART_CTRL_REG |= UART_CTRL_REG_TI;
+	if (DMAX_CTRL_REG(ch) & DMAX_CTRL_REG_DINT_MODE) {
+		uart_ti_int_pending = true;
+	}
+}
+
+/* RX DMA wrap interrupts are not modelled, the loader polls IDX */
+static void uart_rx_dma(void) {
+	unsigned int ch = DMA_UART_RX;
+	if (!(DMAX_CTRL_REG(ch) & DMAX_CTRL_REG_DMA_ON)) {
+		return;
+	}
+
+	uint8_t *dst = (uint8_t *)(uintptr_t)dma_address(DMAX_B_STARTL_REG(ch), DMAX_B_STARTH_REG(ch));
+	unsigned int len = DMAX_LEN_REG(ch);
+	unsigned int idx = DMAX_IDX_REG(ch);
+	ssize_t rx_len = read(uart_fd, &dst[idx], len - idx);
+	if (rx_len > 0) {
+		idx += rx_len;
+		if (idx >= len) {
+			if (DMAX_CTRL_REG(ch) & DMAX_CTRL_REG_CIRCULAR) {
+				idx = 0;
+			} else {
+				DMAX_CTRL_REG(ch) &= ~DMAX_CTRL_REG_DMA_ON;
+			}
+		}
+		DMAX_IDX_REG(ch) = idx;
+		uart_rx_idle_polls = 0;
+	} else if (++uart_rx_idle_polls > UART_RX_IDLE_POLLS) {
+		struct pollfd pfd = { .fd = uart_fd, .events = POLLIN };
+		struct timespec timeout = { .tv_sec = 0, .tv_nsec = UART_RX_IDLE_NS };
+		ppoll(&pfd, 1, &timeout, NULL);
+	}
+}
+
+/* Memory to memory transfers (no DREQ_MODE) complete instantly as well */
+static void mem_dma(unsigned int ch) {
+	const uint8_t *src = (const uint8_t *)(uintptr_t)dma_address(DMAX_A_STARTL_REG(ch), DMAX_A_STARTH_REG(ch));
+	uint8_t *dst = (uint8_t *)(uintptr_t)dma_address(DMAX_B_STARTL_REG(ch), DMAX_B_STARTH_REG(ch));
+	unsigned int width = 1U << ((DMAX_CTRL_REG(ch) & DMAX_CTRL_REG_BW_MASK) >> 1);
+	unsigned int len = DMAX_LEN_REG(ch);
+
+	memmove(dst, src, (size_t)len * width);
+	DMAX_IDX_REG(ch) = len;
+	DMAX_CTRL_REG(ch) &= ~DMAX_CTRL_REG_DMA_ON;
+}
+
+static void qspi_ctrl_write(uint32_t ctrl) {
+	if (ctrl & QSPIC_CTRL_REG_DISABLE_BUS) {
+		spi_flash_host_select(false);
+	}
+	if (ctrl & QSPIC_CTRL_REG_ENABLE_BUS) {
+		spi_flash_host_select(true);
+	}
+	if (ctrl & QSPIC_CTRL_REG_SIO_EN) {
+		qspi_bus_width = 1;
+	}
+	if (ctrl & QSPIC_CTRL_REG_DIO_EN) {
+		qspi_bus_width = 2;
+	}
+	if (ctrl & QSPIC_CTRL_REG_QIO_EN) {
+		qspi_bus_width = 4;
+	}
+}
+
+/* Bytes are shifted out LSB first, see qspi_tx() */
+static void qspi_write_data(uint32_t datum, unsigned int width) {
+	for (unsigned int i = 0; i < width; i++) {
+		spi_flash_host_write((datum >> (i * 8)) & 0xff, qspi_bus_width);
+	}
+}
+
+static void qspi_read_data(unsigned int width) {
+	uint32_t datum = 0;
+	for (unsigned int i = 0; i < width; i++) {
+		datum |= (uint32_t)spi_flash_host_read(qspi_bus_width) << (i * 8);
+	}
+	QSPIC_RECVDATA_REG = datum;
+}
+
+static bool in_register_window(uint32_t addr) {
+	return addr >= MMIO_HOST_BASE && addr < MMIO_HOST_BASE + MMIO_HOST_SIZE;
+}
+
+/* Register reads by the channel have the side effects of firmware reads */
+static uint32_t dma_read_unit(uint32_t addr, unsigned int width) {
+	uint32_t datum = 0;
+	if (in_register_window(addr)) {
+		prepare_access(addr, width);
+		return reg_read(addr, width);
+	}
+	memcpy(&datum, (const void *)(uintptr_t)addr, width);
+	return datum;
+}
+
+static void dma_write_unit(uint32_t addr, uint32_t datum, unsigned int width) {
+	if (!in_register_window(addr)) {
+		memcpy((void *)(uintptr_t)addr, &datum, width);
+	} else if (addr == REG_ADDR(QSPIC_WRITEDATA32_REG)) {
+		qspi_write_data(datum, width);
+	} else {
+		fprintf(stderr, "DMA write to register 0x%06lx not modelled\n", (unsigned long)addr);
+		abort();
+	}
+}
+
+/*
+ * DREQ paced transfers run back to back, the modelled peripherals are never
+ * busy. Each unit moves from the A address to the B address the channel was
+ * given, a read of QSPIC_READDATA only starts a bus cycle like on the chip.
+ */
+static void dreq_dma(unsigned int ch) {
+	uint32_t src = dma_address(DMAX_A_STARTL_REG(ch), DMAX_A_STARTH_REG(ch));
+	uint32_t dst = dma_address(DMAX_B_STARTL_REG(ch), DMAX_B_STARTH_REG(ch));
+	unsigned int width = 1U << ((DMAX_CTRL_REG(ch) & DMAX_CTRL_REG_BW_MASK) >> 1);
+	unsigned int len = DMAX_LEN_REG(ch);
+
+	for (unsigned int i = 0; i < len; i++) {
+		dma_write_unit(dst, dma_read_unit(src, width), width);
+		if (DMAX_CTRL_REG(ch) & DMAX_CTRL_REG_AINC) {
+			src += width;
+		}
+		if (DMAX_CTRL_REG(ch) & DMAX_CTRL_REG_BINC) {
+			dst += width;
+		}
+	}
+	DMAX_IDX_REG(ch) = len;
+	DMAX_CTRL_REG(ch) &= ~DMAX_CTRL_REG_DMA_ON;
+}
+
+static void dma_ctrl_write(unsigned int ch, uint32_t value, uint32_t old_value) {
+	if (!(value & DMAX_CTRL_REG_DMA_ON) || (old_value & DMAX_CTRL_REG_DMA_ON)) {
+		return;
+	}
+	if (ch == DMA_UART_TX) {
+		uart_tx_dma();
+	} else if (ch == DMA_UART_RX) {
+		DMAX_IDX_REG(DMA_UART_RX) = 0;
+	} else if (value & DMAX_CTRL_REG_DREQ_MODE) {
+		dreq_dma(ch);
+	} else {
+		mem_dma(ch);
+	}
+}
+
+static void check_reset(void) {
+	if (DEBUG_REG & DEBUG_REG_SW_RESET) {
+		reset_cb();
+	}
+}
+
+/* Write side effects of the previous access */
+static void commit_access(void) {
+	if (!access_pending) {
+		return;
+	}
+	access_pending = false;
+
+	uintptr_t addr = pending_addr;
+	uint32_t value = reg_read(addr, pending_width);
+	uint32_t old_value = pending_old_value;
+
+	if (addr == REG_ADDR(QSPIC_CTRL_REG)) {
+		qspi_ctrl_write(value);
+	} else if (addr == REG_ADDR(QSPIC_WRITEDATA32_REG)) {
+		qspi_write_data(value, pending_width);
+	} else if (addr == REG_ADDR(UART_RX_TX_REG)) {
+		if (value != UART_RX_TX_SENTINEL) {
+			uint8_t byt = value;
+			uart_write_all(&byt, sizeof(byt));
+			UART_CTRL_REG |= UART_CTRL_REG_TI;
+		}
+	} else if (addr == REG_ADDR(UART_CLEAR_TX_INT_REG)) {
+		UART_CTRL_REG &= ~UART_CTRL_REG_TI;
+	} else if (addr == REG_ADDR(UART_CLEAR_RX_INT_REG)) {
+		UART_CTRL_REG &= ~UART_CTRL_REG_RI;
+	} else if (addr == REG_ADDR(RESET_INT_PENDING_REG)) {
+		if (value & RESET_INT_PENDING_REG_UART_TI_INT_PEND) {
+			uart_ti_int_pending = false;
+		}
+	} else if (addr >= REG_ADDR(DMAX_CTRL_REG(0)) && addr <= REG_ADDR(DMAX_CTRL_REG(DMA_NUM_CHANNELS - 1)) &&
+		   (addr - REG_ADDR(DMAX_CTRL_REG(0))) % (DMAX_BASE(1) - DMAX_BASE(0)) == 0) {
+		dma_ctrl_write((addr - REG_ADDR(DMAX_CTRL_REG(0))) / (DMAX_BASE(1) - DMAX_BASE(0)), value, old_value);
+	} else if (addr == REG_ADDR(DEBUG_REG)) {
+		check_reset();
+	} else if (addr == REG_ADDR(TIMER0_RELOAD_M_REG) && value != old_value) {
+		tim0_reload_m = value;
+	}
+}
+
+/* Periods since the last call, at most a second worth is caught up on. Unlike the hardware, periods elapsed with interrupts disabled are not lost */
+static unsigned long host_timer_elapsed(host_timer_t *timer, bool enabled, unsigned long clocks) {
+	if (!enabled) {
+		timer->running = false;
+		return 0;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!timer->running) {
+		timer->running = true;
+		timer->last = now;
+		return 0;
+	}
+
+	long long period_ns = (long long)clocks * 1000000000LL / TIMER_CLK_HZ;
+	long long elapsed_ns = (long long)(now.tv_sec - timer->last.tv_sec) * 1000000000LL + (now.tv_nsec - timer->last.tv_nsec);
+	unsigned long periods = elapsed_ns / period_ns;
+	if (!periods) {
+		return 0;
+	}
+
+	long long advance_ns = (long long)periods * period_ns;
+	timer->last.tv_sec += advance_ns / 1000000000LL;
+	timer->last.tv_nsec += advance_ns % 1000000000LL;
+	if (timer->last.tv_nsec >= 1000000000L) {
+		timer->last.tv_sec++;
+		timer->last.tv_nsec -= 1000000000L;
+	}
+	if (periods > TIMER_CLK_HZ / clocks) {
+		periods = TIMER_CLK_HZ / clocks;
+	}
+	return periods;
+}
+
+/* RELOAD_M + 1 clocks followed by RELOAD_N + 1 clocks */
+static unsigned long timer_period_clocks(uint16_t reload_m, uint16_t reload_n) {
+	return (unsigned long)reload_m + 1 + (unsigned long)reload_n + 1;
+}
+
+static bool tim0_int_enabled(void) {
+	return INT2_PRIORITY_REG & INT2_PRIORITY_REG_TIM0_INT_PRIO_MASK;
+}
+
+static bool tim1_int_enabled(void) {
+	return INT3_PRIORITY_REG & INT3_PRIORITY_REG_TIM1_INT_PRIO_MASK;
+}
+
+static bool uart_ti_int_enabled(void) {
+	return INT2_PRIORITY_REG & INT2_PRIORITY_REG_UART_TI_INT_PRIO_MASK;
+}
+
+/* Interrupts are taken between two register accesses */
+static void run_isr(funcp_t isr) {
+	irq_state_t psr = mmio_host_psr;
+	in_isr = true;
+	mmio_host_psr &= ~PSR_E;
+	isr();
+	commit_access();
+	mmio_host_psr = psr;
+	in_isr = false;
+}
+
+static void deliver_interrupts(void) {
+	if (in_isr) {
+		return;
+	}
+
+	tim0.pending += host_timer_elapsed(&tim0, TIMER_CTRL_REG & TIMER_CTRL_REG_TIM0_CTRL,
+					   timer_period_clocks(tim0_reload_m, TIMER0_RELOAD_N_REG));
+	tim1.pending += host_timer_elapsed(&tim1, TIMER_CTRL_REG & TIMER_CTRL_REG_TIM1_CTRL,
+					   timer_period_clocks(TIMER1_RELOAD_M_REG, TIMER1_RELOAD_N_REG));
+	while ((mmio_host_psr & PSR_E) && uart_ti_int_pending && uart_ti_int_enabled()) {
+		uart_ti_int_pending = false;
+		run_isr(vector_table.uart_ti_int);
+	}
+	while ((mmio_host_psr & PSR_E) && tim0.pending && tim0_int_enabled()) {
+		tim0.pending--;
+		run_isr(vector_table.tim0_int);
+	}
+	while ((mmio_host_psr & PSR_E) && tim1.pending && tim1_int_enabled()) {
+		tim1.pending--;
+		run_isr(vector_table.tim1_int);
+	}
+}
+
+/* M phase counter, the single clock N phase of timer_init() is not told apart */
+static uint16_t tim0_count(void) {
+	if (!tim0.running) {
+		return tim0_reload_m;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long elapsed_ns = (long long)(now.tv_sec - tim0.last.tv_sec) * 1000000000LL + (now.tv_nsec - tim0.last.tv_nsec);
+	long long elapsed = elapsed_ns * (long long)TIMER_CLK_HZ / 1000000000LL;
+	return elapsed >= tim0_reload_m ? 0 : tim0_reload_m - elapsed;
+}
+
+/* Read side effects of the current access */
+static void prepare_access(uintptr_t addr, unsigned int width) {
+	if (addr == REG_ADDR(QSPIC_READDATA32_REG)) {
+		qspi_read_data(width);
+	} else if (addr == REG_ADDR(QSPIC_STATUS_REG)) {
+		QSPIC_STATUS_REG = 0;
+	} else if (addr == REG_ADDR(DMAX_IDX_REG(DMA_UART_RX))) {
+		uart_rx_dma();
+	} else if (addr == REG_ADDR(UART_RX_TX_REG)) {
+		UART_RX_TX_REG = UART_RX_TX_SENTINEL;
+	} else if (addr == REG_ADDR(TIMER0_RELOAD_M_REG)) {
+		TIMER0_RELOAD_M_REG = tim0_count();
+	} else if (addr == REG_ADDR(SET_INT_PENDING_REG)) {
+		SET_INT_PENDING_REG = tim0.pending ? RESET_INT_PENDING_REG_TIM0_INT_PEND : 0;
+	}
+}
+
+volatile void *mmio_host_access(uintptr_t addr, unsigned int width) {
+	if (addr < MMIO_HOST_BASE || addr + width > MMIO_HOST_BASE + MMIO_HOST_SIZE) {
+		fprintf(stderr, "MMIO access to 0x%06lx outside of register window\n", (unsigned long)addr);
+		abort();
+	}
+
+	commit_access();
+	if (!in_isr) {
+		mmio_host_irq_pc = (uintptr_t)__builtin_return_address(0);
+	}
+	deliver_interrupts();
+	prepare_access(addr, width);
+
+	access_pending = true;
+	pending_addr = addr;
+	pending_width = width;
+	pending_old_value = reg_read(addr, width);
+	return (volatile void *)addr;
+}
+
+/* The loader spins after requesting a reset, catch that asynchronously */
+static void reset_timer(int sig) {
+	(void)sig;
+	check_reset();
+}
+
+void mmio_host_init(int fd, void (*reset)(void)) {
+	void *window = mmap((void *)MMIO_HOST_BASE, MMIO_HOST_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (window != (void *)MMIO_HOST_BASE) {
+		perror("Failed to map register window");
+		exit(1);
+	}
+
+	uart_fd = fd;
+	reset_cb = reset;
+
+	CHIP_ID1_REG = '4';
+	CHIP_ID2_REG = '4';
+	CHIP_ID3_REG = '1';
+	CHIP_MEM_SIZE_REG = 0x00;
+	CHIP_REVISION_REG = 0x11;
+	/* Polled by qspi_init() */
+	QSPIC_UNKNOWN_REG3 = (1 << 3);
+	UART_CTRL_REG = UART_CTRL_REG_TI;
+
+	struct sigaction action = { .sa_handler = reset_timer, .sa_flags = SA_RESTART };
+	sigaction(SIGALRM, &action, NULL);
+	struct itimerval interval = {
+		.it_interval = { .tv_sec = 0, .tv_usec = RESET_CHECK_US },
+		.it_value = { .tv_sec = 0, .tv_usec = RESET_CHECK_US },
+	};
+	setitimer(ITIMER_REAL, &interval, NULL);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Peripheral register window, mapped at its SC14441 address */
+#define MMIO_HOST_BASE		0xFF0000UL
+#define MMIO_HOST_SIZE		0x10000UL
+
+/* PSR of the simulated CPU, only the E bit is used */
+extern unsigned int mmio_host_psr;
+
+/*
+ * Firmware code of the MMIO access interrupts are delivered at, the closest
+ * there is to the interrupted PC. See profile.c
+ */
+extern uintptr_t mmio_host_irq_pc;
+
+/* Firmware main(), renamed when building test.c for the host */
+int loader_main(void);
+
+/*
+ * Every MMIO8/16/32 access goes through here. Side effects of writes are
+ * applied on the next access, reads are prepared before the access happens.
+ */
+volatile void *mmio_host_access(uintptr_t addr, unsigned int width);
+void mmio_host_init(int uart_fd, void (*reset)(void));
@@ -0,0 +1,276 @@
+#include "spi_flash_host.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "util.h"
+
+/* Behaves like a Winbond W25Q64 */
+#define SPI_FLASH_JEDEC_ID		0xEF4017UL
+#define SPI_FLASH_PAGE_SIZE		256
+
+#define SPI_FLASH_STATUS_WIP		(1 << 0)
+#define SPI_FLASH_STATUS_WEL		(1 << 1)
+
+/* Number of status register polls a program/erase operation stays busy for */
+#define SPI_FLASH_BUSY_PAGE_PROGRAM	2
+#define SPI_FLASH_BUSY_ERASE		16
+
+typedef enum spi_flash_op {
+	SPI_FLASH_OP_READ,
+	SPI_FLASH_OP_SFDP,
+	SPI_FLASH_OP_RDID,
+	SPI_FLASH_OP_RDSR,
+	SPI_FLASH_OP_WREN,
+	SPI_FLASH_OP_WRDI,
+	SPI_FLASH_OP_PROGRAM,
+	SPI_FLASH_OP_ERASE
+} spi_flash_op_t;
+
+typedef struct spi_flash_opcode {
+	uint8_t opcode;
+	spi_flash_op_t op;
+	/* Bus width of the 3 address bytes, 0 if the command has no address */
+	uint8_t addr_width;
+	/* Mode + wait clocks between address and data */
+	uint8_t dummy_clocks;
+	uint8_t data_width;
+	uint32_t erase_size;
+} spi_flash_opcode_t;
+
+static const spi_flash_opcode_t spi_flash_opcodes[] = {
+	{ .opcode = 0x03, .op = SPI_FLASH_OP_READ, .addr_width = 1, .dummy_clocks = 0, .data_width = 1 },
+	{ .opcode = 0x0B, .op = SPI_FLASH_OP_READ, .addr_width = 1, .dummy_clocks = 8, .data_width = 1 },
+	{ .opcode = 0x3B, .op = SPI_FLASH_OP_READ, .addr_width = 1, .dummy_clocks = 8, .data_width = 2 },
+	{ .opcode = 0x6B, .op = SPI_FLASH_OP_READ, .addr_width = 1, .dummy_clocks = 8, .data_width = 4 },
+	{ .opcode = 0xBB, .op = SPI_FLASH_OP_READ, .addr_width = 2, .dummy_clocks = 4, .data_width = 2 },
+	{ .opcode = 0xEB, .op = SPI_FLASH_OP_READ, .addr_width = 4, .dummy_clocks = 6, .data_width = 4 },
+	{ .opcode = 0x5A, .op = SPI_FLASH_OP_SFDP, .addr_width = 1, .dummy_clocks = 8, .data_width = 1 },
+	{ .opcode = 0x9F, .op = SPI_FLASH_OP_RDID, .data_width = 1 },
+	{ .opcode = 0x05, .op = SPI_FLASH_OP_RDSR, .data_width = 1 },
+	{ .opcode = 0x06, .op = SPI_FLASH_OP_WREN },
+	{ .opcode = 0x04, .op = SPI_FLASH_OP_WRDI },
+	{ .opcode = 0x02, .op = SPI_FLASH_OP_PROGRAM, .addr_width = 1, .data_width = 1 },
+	{ .opcode = 0x20, .op = SPI_FLASH_OP_ERASE, .addr_width = 1, .erase_size = 0x1000 },
+	{ .opcode = 0x52, .op = SPI_FLASH_OP_ERASE, .addr_width = 1, .erase_size = 0x8000 },
+	{ .opcode = 0xD8, .op = SPI_FLASH_OP_ERASE, .addr_width = 1, .erase_size = 0x10000 },
+};
+
+/* SFDP header, one parameter header pointing to a JESD216B BFPT at 0x80 */
+#define SPI_FLASH_SFDP_BFPT	0x80
+static uint8_t spi_flash_sfdp[SPI_FLASH_SFDP_BFPT + 64];
+
+static const uint8_t spi_flash_bfpt[64] = {
+	/* 4KiB erase, 3 byte address, 1-1-2, 1-2-2, 1-4-4 and 1-1-4 fast read */
+	0xE5, 0x20, 0x71, 0xFF,
+	/* Density, filled in by spi_flash_host_init */
+	0xFF, 0xFF, 0xFF, 0xFF,
+	/* 1-4-4: 4 wait + 2 mode clocks, 1-1-4: 8 wait clocks */
+	0x44, 0xEB, 0x08, 0x6B,
+	/* 1-1-2: 8 wait clocks, 1-2-2: 4 mode clocks */
+	0x08, 0x3B, 0x80, 0xBB,
+	/* No 2-2-2/4-4-4 */
+	0xEE, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF,
+	/* Erase types 4KiB, 32KiB, 64KiB */
+	0x0C, 0x20, 0x0F, 0x52,
+	0x10, 0xD8, 0x00, 0xFF,
+	/* Typical erase times 48ms, 128ms, 144ms, max = 4 x typical */
+	0x21, 0x3A, 0xA1, 0x00,
+};
+
+static struct {
+	uint8_t *data;
+	uint32_t size;
+	uint8_t status;
+	unsigned int busy_polls;
+
+	/* Per chip select state */
+	bool selected;
+	bool ignore;
+	bool bad_timing;
+	bool data_phase;
+	const spi_flash_opcode_t *opcode;
+	unsigned int addr_bytes;
+	uint32_t address;
+	unsigned int clocks;
+	unsigned int data_bytes;
+	uint8_t page[SPI_FLASH_PAGE_SIZE];
+} flash;
+
+void spi_flash_host_init(uint8_t *data, uint32_t size) {
+	flash.data = data;
+	flash.size = size;
+
+	memset(spi_flash_sfdp, 0xFF, sizeof(spi_flash_sfdp));
+	memcpy(spi_flash_sfdp, "SFDP", 4);
+	spi_flash_sfdp[4] = 0x06;
+	spi_flash_sfdp[5] = 0x01;
+	spi_flash_sfdp[6] = 0x00;
+	const uint8_t parameter_header[] = { 0x00, 0x06, 0x01, sizeof(spi_flash_bfpt) / 4, SPI_FLASH_SFDP_BFPT, 0x00, 0x00, 0xFF };
+	memcpy(&spi_flash_sfdp[8], parameter_header, sizeof(parameter_header));
+	memcpy(&spi_flash_sfdp[SPI_FLASH_SFDP_BFPT], spi_flash_bfpt, sizeof(spi_flash_bfpt));
+
+	uint32_t density = size * 8 - 1;
+	for (unsigned int i = 0; i < 4; i++) {
+		spi_flash_sfdp[SPI_FLASH_SFDP_BFPT + 4 + i] = (density >> (i * 8)) & 0xff;
+	}
+}
+
+static const spi_flash_opcode_t *spi_flash_find_opcode(uint8_t opcode) {
+	for (unsigned int i = 0; i < ARRAY_SIZE(spi_flash_opcodes); i++) {
+		if (spi_flash_opcodes[i].opcode == opcode) {
+			return &spi_flash_opcodes[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void spi_flash_start_busy(unsigned int polls) {
+	flash.status |= SPI_FLASH_STATUS_WIP;
+	flash.busy_polls = polls;
+}
+
+static void spi_flash_execute(void) {
+	const spi_flash_opcode_t *opcode = flash.opcode;
+
+	if (flash.ignore || !opcode) {
+		return;
+	}
+
+	switch (opcode->op) {
+	case SPI_FLASH_OP_WREN:
+		flash.status |= SPI_FLASH_STATUS_WEL;
+		break;
+	case SPI_FLASH_OP_WRDI:
+		flash.status &= ~SPI_FLASH_STATUS_WEL;
+		break;
+	case SPI_FLASH_OP_PROGRAM:
+		if (flash.status & SPI_FLASH_STATUS_WEL && flash.addr_bytes == 3 && flash.data_bytes) {
+			uint32_t page = (flash.address % flash.size) & ~(SPI_FLASH_PAGE_SIZE - 1UL);
+			for (unsigned int i = 0; i < SPI_FLASH_PAGE_SIZE; i++) {
+				flash.data[page + i] &= flash.page[i];
+			}
+			spi_flash_start_busy(SPI_FLASH_BUSY_PAGE_PROGRAM);
+		}
+		break;
+	case SPI_FLASH_OP_ERASE:
+		if (flash.status & SPI_FLASH_STATUS_WEL && flash.addr_bytes == 3) {
+			uint32_t start = (flash.address % flash.size) & ~(opcode->erase_size - 1);
+			memset(&flash.data[start], 0xFF, opcode->erase_size);
+			spi_flash_start_busy(SPI_FLASH_BUSY_ERASE);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void spi_flash_host_select(bool selected) {
+	if (flash.selected && !selected) {
+		spi_flash_execute();
+	}
+
+	if (selected && !flash.selected) {
+		flash.ignore = false;
+		flash.bad_timing = false;
+		flash.data_phase = false;
+		flash.opcode = NULL;
+		flash.addr_bytes = 0;
+		flash.address = 0;
+		flash.clocks = 0;
+		flash.data_bytes = 0;
+		memset(flash.page, 0xFF, sizeof(flash.page));
+	}
+	flash.selected = selected;
+}
+
+void spi_flash_host_write(uint8_t byt, unsigned int bus_width) {
+	if (!flash.selected || flash.ignore) {
+		return;
+	}
+
+	if (!flash.opcode) {
+		flash.opcode = spi_flash_find_opcode(byt);
+		/* Everything but RDSR is ignored while a program/erase is in progress */
+		if (bus_width != 1 || !flash.opcode ||
+		    ((flash.status & SPI_FLASH_STATUS_WIP) && flash.opcode->op != SPI_FLASH_OP_RDSR)) {
+			flash.ignore = true;
+		}
+		return;
+	}
+
+	const spi_flash_opcode_t *opcode = flash.opcode;
+	if (opcode->addr_width && flash.addr_bytes < 3) {
+		if (bus_width != opcode->addr_width) {
+			flash.bad_timing = true;
+		}
+		flash.address = (flash.address << 8) | byt;
+		flash.addr_bytes++;
+		return;
+	}
+
+	if (opcode->op == SPI_FLASH_OP_PROGRAM) {
+		/* Data past the end of the page wraps around to its start */
+		unsigned int offset = (flash.address + flash.data_bytes) % SPI_FLASH_PAGE_SIZE;
+		flash.page[offset] &= byt;
+		flash.data_bytes++;
+		return;
+	}
+
+	/* Mode bits and wait states */
+	flash.clocks += 8 / bus_width;
+}
+
+static uint8_t spi_flash_read_status(void) {
+	uint8_t status = flash.status;
+	if (flash.busy_polls && !--flash.busy_polls) {
+		flash.status &= ~(SPI_FLASH_STATUS_WIP | SPI_FLASH_STATUS_WEL);
+	}
+
+	return status;
+}
+
+uint8_t spi_flash_host_read(unsigned int bus_width) {
+	const spi_flash_opcode_t *opcode = flash.opcode;
+
+	if (!flash.selected || flash.ignore || !opcode) {
+		return 0xFF;
+	}
+
+	if (!flash.data_phase) {
+		flash.data_phase = true;
+		if (opcode->addr_width && flash.addr_bytes < 3) {
+			flash.bad_timing = true;
+		}
+		if (flash.clocks != opcode->dummy_clocks) {
+			flash.bad_timing = true;
+		}
+	}
+	if (bus_width != opcode->data_width) {
+		flash.bad_timing = true;
+	}
+	/* Wrong bus width or number of dummy clocks, the host samples garbage */
+	if (flash.bad_timing) {
+		return 0x00;
+	}
+
+	uint32_t offset = flash.data_bytes++;
+	switch (opcode->op) {
+	case SPI_FLASH_OP_READ:
+		return flash.data[(flash.address + offset) % flash.size];
+	case SPI_FLASH_OP_SFDP:
+		if (flash.address + offset < sizeof(spi_flash_sfdp)) {
+			return spi_flash_sfdp[flash.address + offset];
+		}
+		return 0xFF;
+	case SPI_FLASH_OP_RDID:
+		return (SPI_FLASH_JEDEC_ID >> ((2 - offset % 3) * 8)) & 0xff;
+	case SPI_FLASH_OP_RDSR:
+		return spi_flash_read_status();
+	default:
+		return 0xFF;
+	}
+}
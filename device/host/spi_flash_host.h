@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* SPI NOR flash behind the simulated QSPIC, bus width is 1, 2 or 4 */
+void spi_flash_host_init(uint8_t *data, uint32_t size);
+void spi_flash_host_select(bool selected);
+void spi_flash_host_write(uint8_t byt, unsigned int bus_width);
+uint8_t spi_flash_host_read(unsigned int bus_width);
@@ -1,17 +1,25 @@
+#pragma once
+
 #include "util.h"
 
 #define SET_INT_PENDING_REG				MMIO16(0xFF5400)
 #define RESET_INT_PENDING_REG				MMIO16(0xFF5402)
+#define RESET_INT_PENDING_REG_TIM1_INT_PEND		(1 << 8)
+#define RESET_INT_PENDING_REG_TIM0_INT_PEND		(1 << 7)
 #define RESET_INT_PENDING_REG_UART_TI_INT_PEND		(1 << 5)
 #define RESET_INT_PENDING_REG_UART_RI_INT_PEND		(1 << 4)
 #define INT0_PRIORITY_REG				MMIO16(0xFF5404)
 #define INT1_PRIORITY_REG				MMIO16(0xFF5406)
 #define INT2_PRIORITY_REG				MMIO16(0xFF5408)
+#define INT2_PRIORITY_REG_TIM0_INT_PRIO_MASK		(7 << 12)
+#define INT2_PRIORITY_REG_TIM0_INT_PRIO_SHIFT		12
 #define INT2_PRIORITY_REG_UART_TI_INT_PRIO_MASK		(7 << 4)
 #define INT2_PRIORITY_REG_UART_TI_INT_PRIO_SHIFT	4
 #define INT2_PRIORITY_REG_UART_RI_INT_PRIO_MASK		(7 << 0)
 #define INT2_PRIORITY_REG_UART_RI_INT_PRIO_SHIFT	0
 #define INT3_PRIORITY_REG				MMIO16(0xFF540A)
+#define INT3_PRIORITY_REG_TIM1_INT_PRIO_MASK		(7 << 0)
+#define INT3_PRIORITY_REG_TIM1_INT_PRIO_SHIFT		0
 
 typedef struct vector_table {
 	funcp_t reserved00;
@@ -47,10 +55,41 @@ typedef struct vector_table {
 	funcp_t reserved30;
 } vector_table_t;
 
+/* Local interrupt enable flag in PSR */
+#define PSR_E	(1 << 9)
+
+typedef unsigned int irq_state_t;
+
 static inline void disable_interrupts(void) {
+#ifdef LOADER_HOST
+	mmio_host_psr &= ~PSR_E;
+#else
 	asm volatile("di");
+#endif
 }
 
 static inline void enable_interrupts(void) {
-	asm volatile("di");
+#ifdef LOADER_HOST
+	mmio_host_psr |= PSR_E;
+#else
+	asm volatile("ei");
+#endif
+}
+
+/* Disable interrupts, safe to use from code that may already run with interrupts disabled */
+static inline irq_state_t irq_save(void) {
+	irq_state_t psr;
+#ifdef LOADER_HOST
+	psr = mmio_host_psr;
+#else
+	asm volatile("spr psr, %0" : "=r" (psr));
+#endif
+	disable_interrupts();
+	return psr;
+}
+
+static inline void irq_restore(irq_state_t psr) {
+	if (psr & PSR_E) {
+		enable_interrupts();
+	}
 }
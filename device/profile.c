@@ -0,0 +1,103 @@
+#include "profile.h"
+
+#include <string.h>
+
+#include "irq.h"
+#include "timer.h"
+
+#define PROFILE_MAGIC	0x50524F46UL
+
+#ifdef LOADER_HOST
+/* The peripheral model provides the address of the MMIO access the interrupt was taken at */
+#include "host/mmio_host.h"
+
+extern const uint8_t __executable_start[];
+extern const uint8_t etext[];
+
+#define PROFILE_TEXT_START	((uintptr_t)__executable_start)
+#define PROFILE_TEXT_END	((uintptr_t)etext)
+#define PROFILE_IRQ_PC()	((uint32_t)mmio_host_irq_pc)
+#else
+extern uint8_t _stext;
+extern uint8_t _etext;
+
+/* Exception frame PC, stored by the TIM1 vector in vectors.s */
+volatile uint32_t profile_irq_pc;
+
+#define PROFILE_TEXT_START	((uintptr_t)&_stext)
+#define PROFILE_TEXT_END	((uintptr_t)&_etext)
+/* The frame holds a word address, see vector_table_fixup */
+#define PROFILE_IRQ_PC()	(profile_irq_pc << 1)
+#endif
+
+static profile_t profile __attribute__((section(".noinit")));
+static bool profile_on = false;
+
+static uint8_t profile_bucket_shift(void) {
+	uint8_t shift = 0;
+	while (((PROFILE_TEXT_END - PROFILE_TEXT_START) >> shift) >= PROFILE_BUCKETS) {
+		shift++;
+	}
+	return shift;
+}
+
+void profile_clear(void) {
+	irq_state_t irq = irq_save();
+	memset(&profile, 0, sizeof(profile));
+	profile.magic = PROFILE_MAGIC;
+	profile.text_start = PROFILE_TEXT_START;
+	profile.bucket_shift = profile_bucket_shift();
+	irq_restore(irq);
+}
+
+void profile_init(void) {
+	if (profile.magic != PROFILE_MAGIC || profile.text_start != PROFILE_TEXT_START ||
+	    profile.bucket_shift != profile_bucket_shift()) {
+		profile_clear();
+	}
+}
+
+void profile_start(void) {
+	TIMER_CTRL_REG &= ~(TIMER_CTRL_REG_TIM1_CTRL | TIMER_CTRL_REG_CLK_CTRL1);
+	TIMER1_RELOAD_M_REG = PROFILE_SAMPLE_CLKS / 2 - 1;
+	TIMER1_RELOAD_N_REG = PROFILE_SAMPLE_CLKS / 2 - 1;
+	RESET_INT_PENDING_REG = RESET_INT_PENDING_REG_TIM1_INT_PEND;
+	INT3_PRIORITY_REG &= ~INT3_PRIORITY_REG_TIM1_INT_PRIO_MASK;
+	INT3_PRIORITY_REG |= (1 << INT3_PRIORITY_REG_TIM1_INT_PRIO_SHIFT);
+	profile_on = true;
+	TIMER_CTRL_REG |= TIMER_CTRL_REG_TIM1_CTRL;
+}
+
+void profile_stop(void) {
+	TIMER_CTRL_REG &= ~TIMER_CTRL_REG_TIM1_CTRL;
+	INT3_PRIORITY_REG &= ~INT3_PRIORITY_REG_TIM1_INT_PRIO_MASK;
+	profile_on = false;
+}
+
+bool profile_running(void) {
+	return profile_on;
+}
+
+const profile_t *profile_get(void) {
+	return &profile;
+}
+
+void profile_tim1_int(void) {
+	uint32_t pc = PROFILE_IRQ_PC();
+	RESET_INT_PENDING_REG = RESET_INT_PENDING_REG_TIM1_INT_PEND;
+
+	profile.samples++;
+	if (pc < PROFILE_TEXT_START || pc >= PROFILE_TEXT_END) {
+		profile.outside++;
+		return;
+	}
+
+	uint16_t *bucket = &profile.buckets[(pc - PROFILE_TEXT_START) >> profile.bucket_shift];
+	if (*bucket == UINT16_MAX) {
+		for (unsigned int i = 0; i < PROFILE_BUCKETS; i++) {
+			profile.buckets[i] /= 2;
+		}
+		profile.count_shift++;
+	}
+	(*bucket)++;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Statistical profiler: TIM1 samples the interrupted PC into a histogram of
+ * the loader's code. Buckets are as small as PROFILE_BUCKETS allows.
+ */
+#define PROFILE_BUCKETS		256
+/* Not a multiple of the TIM0 period, so samples do not move in lockstep with it */
+#define PROFILE_SAMPLE_CLKS	1142
+
+typedef struct profile {
+	uint32_t magic;
+	uint32_t text_start;
+	uint32_t samples;
+	/* Samples outside of the loader's code, e.g. in the ROM */
+	uint32_t outside;
+	uint8_t bucket_shift;
+	/* Buckets are halved instead of overflowing, each time this goes up by one */
+	uint8_t count_shift;
+	uint16_t buckets[PROFILE_BUCKETS];
+} profile_t;
+
+/* Keeps a histogram from before a reset if it belongs to the same code */
+void profile_init(void);
+void profile_start(void);
+void profile_stop(void);
+bool profile_running(void);
+void profile_clear(void);
+const profile_t *profile_get(void);
+/* TIM1 interrupt handler, see vector_table */
+void profile_tim1_int(void);
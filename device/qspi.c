@@ -1,6 +1,18 @@
 #include "qspi.h"
 
 #include "clock.h"
+#include "dma.h"
+#include "stats.h"
+
+#if QSPI_TX_DMA
+/* Below this the channel setup costs more than the PIO loop */
+#define QSPI_DMA_MIN_LEN	16
+/* Polls without progress before the QSPIC is assumed not to request DMA */
+#define QSPI_DMA_STALL_POLLS	10000
+
+/* Cleared for good once a transfer stalls, everything then goes through PIO */
+static bool qspi_dma_enabled = true;
+#endif
 
 void qspi_init() {
 	// QSPI clock config
@@ -75,9 +87,60 @@ void qspi_init() {
 
 }
 
+#if QSPI_TX_DMA
+/*
+ * Words go out LSB first, so an aligned buffer is moved as is. Every DMA
+ * write to the data register clocks one unit over the bus, the QSPIC is
+ * expected to request the next one once it is idle again. Reads have no
+ * DMA counterpart, a read of the data register only starts a bus cycle and
+ * the data arrives in QSPIC_RECVDATA_REG later.
+ */
+static size_t qspi_tx_dma(const void *data, size_t len) {
+	if (!qspi_dma_enabled || len < QSPI_DMA_MIN_LEN || ((uintptr_t)data & 3) || !dma_addressable(data)) {
+		return 0;
+	}
+
+	unsigned int words = len / 4;
+	dma_xfer_desc_t desc = {
+		.dir = DMA_MEM_TO_PERIPH,
+		.src = data,
+		.dst = (volatile void *)QSPIC_WRITEDATA_ADDR,
+		.len = words,
+		.width = DMAX_CTRL_REG_BW_WORD,
+		.prio = DMAX_CTRL_REG_DMA_PRIO_HIGH
+	};
+	dma_xfer(DMA_SPI_TX, &desc);
+
+	unsigned int progress = 0;
+	unsigned int stalled = 0;
+	while (!dma_done(DMA_SPI_TX)) {
+		unsigned int now = dma_progress(DMA_SPI_TX);
+		if (now != progress) {
+			progress = now;
+			stalled = 0;
+		} else if (++stalled > QSPI_DMA_STALL_POLLS) {
+			qspi_dma_enabled = false;
+			break;
+		}
+	}
+	dma_stop(DMA_SPI_TX);
+	progress = dma_progress(DMA_SPI_TX);
+	if (progress > words) {
+		progress = words;
+	}
+	QSPIC_WAIT_NOT_BUSY();
+	return (size_t)progress * 4;
+}
+#endif
+
 static void qspi_tx(const qspi_xfer_desc_t *desc) {
 	const uint8_t *data = desc->tx_data;
 	size_t data_len = desc->tx_len;
+#if QSPI_TX_DMA
+	size_t dma_len = qspi_tx_dma(data, data_len);
+	data += dma_len;
+	data_len -= dma_len;
+#endif
 	size_t dummy_len = desc->dummy_cycles_after_tx;
 	switch (desc->mode) {
 	case QSPI_MODE_DIO:
@@ -170,8 +233,8 @@ static void qspi_rx(const qspi_xfer_desc_t *desc) {
 	}
 }
 
-void qspi_write_then_read(const qspi_xfer_desc_t *desc) {
-	switch (desc->mode) {
+static void qspi_set_mode(qspi_mode_t mode) {
+	switch (mode) {
 	case QSPI_MODE_SIO:
 		QSPIC_CTRL_REG = QSPIC_CTRL_REG_SIO_EN;
 		break;
@@ -182,7 +245,11 @@ void qspi_write_then_read(const qspi_xfer_desc_t *desc) {
 		QSPIC_CTRL_REG = QSPIC_CTRL_REG_QIO_EN;
 		break;
 	}
+}
 
+void qspi_write_then_read(const qspi_xfer_desc_t *desc) {
+	uint32_t start = timer_clocks();
+	qspi_set_mode(desc->mode);
 	QSPIC_CTRL_REG = QSPIC_CTRL_REG_ENABLE_BUS;
 	if ((desc->tx_data && desc->tx_len) || desc->dummy_cycles_after_tx) {
 		qspi_tx(desc);
@@ -191,21 +258,12 @@ void qspi_write_then_read(const qspi_xfer_desc_t *desc) {
 		qspi_rx(desc);
 	}
 	QSPIC_CTRL_REG = QSPIC_CTRL_REG_DISABLE_BUS;
+	stats_time_add(STATS_TIME_QSPI, start);
 }
 
 void qspi_scatter_transfer(qspi_mode_t mode, const qpsi_xfer_action_t *actions, unsigned int num_actions) {
-	switch (mode) {
-	case QSPI_MODE_SIO:
-		QSPIC_CTRL_REG = QSPIC_CTRL_REG_SIO_EN;
-		break;
-	case QSPI_MODE_DIO:
-		QSPIC_CTRL_REG = QSPIC_CTRL_REG_DIO_EN;
-		break;
-	case QSPI_MODE_QIO:
-		QSPIC_CTRL_REG = QSPIC_CTRL_REG_QIO_EN;
-		break;
-	}
-
+	uint32_t start = timer_clocks();
+	qspi_set_mode(mode);
 	QSPIC_CTRL_REG = QSPIC_CTRL_REG_ENABLE_BUS;
 	while (num_actions--) {
 		qspi_xfer_desc_t desc = { 0 };
@@ -225,10 +283,15 @@ void qspi_scatter_transfer(qspi_mode_t mode, const qpsi_xfer_action_t *actions,
 			desc.dummy_cycles_after_tx = actions->len;
 			qspi_tx(&desc);
 			break;
+		case QSPI_SET_MODE:
+			/* Mode bits only, bus stays enabled */
+			qspi_set_mode(actions->mode);
+			break;
 		}
 		actions++;
 	}
 	QSPIC_CTRL_REG = QSPIC_CTRL_REG_DISABLE_BUS;
+	stats_time_add(STATS_TIME_QSPI, start);
 }
 
 void qspi_set_write_protect(bool protection_on) {
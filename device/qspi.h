@@ -5,6 +5,11 @@
 
 #include "util.h"
 
+/* Transmit word aligned data through DMA_SPI_TX, off until DREQ of the QSPIC is confirmed on hardware */
+#ifndef QSPI_TX_DMA
+#define QSPI_TX_DMA		0
+#endif
+
 #define QSPIC_CTRL_REG			MMIO32(0xFF0C00)
 #define QSPIC_CTRL_REG_DISABLE_BUS	(1 << 4)
 #define QSPIC_CTRL_REG_ENABLE_BUS	(1 << 3)
@@ -22,12 +27,15 @@
 #define QSPIC_RECVDATA_REG		MMIO32(0xFF0C08)
 #define QSPIC_STATUS_REG		MMIO16(0xFF0C14)
 #define QSPIC_STATUS_REG_BUSY		(1 << 0)
-#define QSPIC_WRITEDATA8_REG		MMIO8(0xFF0C18)
-#define QSPIC_WRITEDATA16_REG		MMIO16(0xFF0C18)
-#define QSPIC_WRITEDATA32_REG		MMIO32(0xFF0C18)
-#define QSPIC_READDATA8_REG		MMIO8(0xFF0C1C)
-#define QSPIC_READDATA16_REG		MMIO16(0xFF0C1C)
-#define QSPIC_READDATA32_REG		MMIO32(0xFF0C1C)
+/* Plain addresses for DMA, taking the address of a data register accesses it on the host build */
+#define QSPIC_WRITEDATA_ADDR		0xFF0C18UL
+#define QSPIC_READDATA_ADDR		0xFF0C1CUL
+#define QSPIC_WRITEDATA8_REG		MMIO8(QSPIC_WRITEDATA_ADDR)
+#define QSPIC_WRITEDATA16_REG		MMIO16(QSPIC_WRITEDATA_ADDR)
+#define QSPIC_WRITEDATA32_REG		MMIO32(QSPIC_WRITEDATA_ADDR)
+#define QSPIC_READDATA8_REG		MMIO8(QSPIC_READDATA_ADDR)
+#define QSPIC_READDATA16_REG		MMIO16(QSPIC_READDATA_ADDR)
+#define QSPIC_READDATA32_REG		MMIO32(QSPIC_READDATA_ADDR)
 #define QSPIC_UNKNOWN_REG1		MMIO16(0xFF4814)
 #define QSPIC_UNKNOWN_REG2		MMIO16(0xFF481C)
 #define QSPIC_UNKNOWN_REG3		MMIO16(0xFF4816)
@@ -54,7 +62,9 @@ typedef struct qspi_xfer_desc {
 typedef enum {
 	QSPI_READ,
 	QSPI_WRITE,
-	QSPI_DUMMY
+	QSPI_DUMMY,
+	/* Switch bus width without deasserting CS, e.g. for 1-1-4/1-4-4 reads */
+	QSPI_SET_MODE
 } qspi_action_t;
 
 typedef struct qspi_xfer_action {
@@ -62,7 +72,9 @@ typedef struct qspi_xfer_action {
 	union {
 		const void *tx_data;
 		void *rx_data;
+		qspi_mode_t mode;
 	};
+	/* For QSPI_DUMMY: number of dummy bytes at current bus width */
 	size_t len;
 } qpsi_xfer_action_t;
 
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+"""
+Prints how the loader uses its RAM, from the symbols of the linked ELF.
+make runs it after linking, see sc14441-uart.ld for the layout.
+"""
+import subprocess
+import sys
+from argparse import ArgumentParser
+
+# Split of RAM from bottom to top, bounded by symbols of sc14441-uart.ld
+REGIONS = [
+	("text + rodata", "__stext", "__etext"),
+	("data", "__data", "__edata"),
+	("bss", "__bss", "__ebss"),
+	("noinit", "__ebss", "end"),
+	("free + stack", "end", "__ustack"),
+	("interrupt stack", "__ustack", "__istack"),
+]
+# ram ORIGIN of stage0.ld, stage 0 receives at most the image below it
+STAGE0_START = 0x13800
+DATA_TYPES = "bBdDrR"
+
+def read_symbols(nm, elf):
+	"""Addresses of all symbols and (name, size, type) of sized data objects"""
+	output = subprocess.run([ nm, "-S", elf ], check=True, capture_output=True, text=True).stdout
+	addresses = { }
+	objects = [ ]
+	for line in output.splitlines():
+		fields = line.split()
+		if len(fields) == 4:
+			(address, size, typ, name) = fields
+			if typ in DATA_TYPES:
+				objects.append((name, int(size, 16), typ))
+		elif len(fields) == 3:
+			(address, typ, name) = fields
+		else:
+			continue
+		addresses[name] = int(address, 16)
+	return (addresses, objects)
+
+def main():
+	parser = ArgumentParser(description="Loader RAM budget report")
+	parser.add_argument("--nm", default="nm", help="nm of the toolchain the loader was built with")
+	parser.add_argument("--top", type=int, default=8, help="Number of largest objects to list")
+	parser.add_argument("elf")
+	args = parser.parse_args()
+
+	(addresses, objects) = read_symbols(args.nm, args.elf)
+	missing = [ symbol for region in REGIONS for symbol in region[1:] if symbol not in addresses ]
+	if missing:
+		print(f"{args.elf} lacks {', '.join(sorted(set(missing)))}, not linked with sc14441-uart.ld?")
+		sys.exit(1)
+
+	ram_size = addresses["__istack"] - addresses["__stext"]
+	print(f"RAM 0x{addresses['__stext']:06x}-0x{addresses['__istack']:06x}, {ram_size} bytes")
+	for (name, start, end) in REGIONS:
+		size = addresses[end] - addresses[start]
+		print(f"  {name:<16} 0x{addresses[start]:06x} {size:6} bytes {size / ram_size * 100:5.1f}%")
+
+	print("Largest objects:")
+	for (name, size, typ) in sorted(objects, key=lambda obj: -obj[1])[:args.top]:
+		print(f"  {name:<28} {size:6} bytes ({typ})")
+
+	image_end = addresses["__edata"]
+	if image_end > STAGE0_START:
+		print(f"Image ends at 0x{image_end:06x}, above stage 0 at 0x{STAGE0_START:06x}, it can only be uploaded through the ROM")
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,103 @@
+#include "rle.h"
+
+#include <string.h>
+
+void rle_encoder_init(rle_encoder_t *enc, rle_emit_t emit) {
+	enc->emit = emit;
+	enc->literal_len = 0;
+	enc->run_len = 0;
+}
+
+static void rle_flush_literal(rle_encoder_t *enc) {
+	if (!enc->literal_len) {
+		return;
+	}
+
+	enc->literal[0] = enc->literal_len - 1;
+	enc->emit(enc->literal, enc->literal_len + 1);
+	enc->literal_len = 0;
+}
+
+static void rle_flush_run(rle_encoder_t *enc) {
+	/* Runs too short to pay for their control byte become literals */
+	if (enc->run_len < RLE_RUN_MIN) {
+		while (enc->run_len) {
+			enc->literal[1 + enc->literal_len++] = enc->run_byte;
+			enc->run_len--;
+			if (enc->literal_len == RLE_LITERAL_MAX) {
+				rle_flush_literal(enc);
+			}
+		}
+		return;
+	}
+
+	rle_flush_literal(enc);
+	if (enc->run_len <= RLE_RUN_SHORT_MAX) {
+		uint8_t run[] = { RLE_CTRL_RUN + enc->run_len - RLE_RUN_MIN, enc->run_byte };
+		enc->emit(run, sizeof(run));
+	} else {
+		uint8_t run[] = { RLE_CTRL_RUN_LONG, enc->run_len & 0xff, (enc->run_len >> 8) & 0xff, enc->run_byte };
+		enc->emit(run, sizeof(run));
+	}
+	enc->run_len = 0;
+}
+
+void rle_encode(rle_encoder_t *enc, const void *data, unsigned int len) {
+	const uint8_t *data8 = data;
+
+	while (len--) {
+		uint8_t byt = *data8++;
+
+		if (enc->run_len && byt == enc->run_byte && enc->run_len < RLE_RUN_MAX) {
+			enc->run_len++;
+			continue;
+		}
+		rle_flush_run(enc);
+		enc->run_byte = byt;
+		enc->run_len = 1;
+	}
+}
+
+void rle_encoder_finish(rle_encoder_t *enc) {
+	rle_flush_run(enc);
+	rle_flush_literal(enc);
+}
+
+bool rle_decode(void *dst, unsigned int dst_len, const void *src, unsigned int src_len, unsigned int *decoded_len) {
+	uint8_t *dst8 = dst;
+	const uint8_t *src8 = src;
+	const uint8_t *src_end = src8 + src_len;
+	unsigned int len = 0;
+
+	while (src8 < src_end) {
+		uint8_t ctrl = *src8++;
+		unsigned int count;
+
+		if (ctrl < RLE_CTRL_RUN) {
+			count = ctrl + 1;
+			if (src_end - src8 < count || dst_len - len < count) {
+				return false;
+			}
+			memcpy(&dst8[len], src8, count);
+			src8 += count;
+		} else {
+			if (ctrl == RLE_CTRL_RUN_LONG) {
+				if (src_end - src8 < 2) {
+					return false;
+				}
+				count = (unsigned int)src8[0] | (unsigned int)src8[1] << 8;
+				src8 += 2;
+			} else {
+				count = ctrl - RLE_CTRL_RUN + RLE_RUN_MIN;
+			}
+			if (src_end - src8 < 1 || dst_len - len < count) {
+				return false;
+			}
+			memset(&dst8[len], *src8++, count);
+		}
+		len += count;
+	}
+
+	*decoded_len = len;
+	return true;
+}
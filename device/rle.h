@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Byte oriented run length encoding. Every chunk starts with a control byte c:
+ *   c <  0x80: c + 1 literal bytes follow
+ *   c <  0xFF: the following byte is repeated c - 0x80 + 3 times
+ *   c == 0xFF: 16 bit little endian count, then the byte to repeat count times
+ */
+#define RLE_CTRL_RUN		0x80
+#define RLE_CTRL_RUN_LONG	0xFF
+
+#define RLE_LITERAL_MAX		128
+#define RLE_RUN_MIN		3
+#define RLE_RUN_SHORT_MAX	(RLE_CTRL_RUN_LONG - 1 - RLE_CTRL_RUN + RLE_RUN_MIN)
+#define RLE_RUN_MAX		0xFFFFU
+
+typedef void (*rle_emit_t)(const void *data, unsigned int len);
+
+typedef struct rle_encoder {
+	rle_emit_t emit;
+	/* Control byte followed by the literal data, emitted in one piece */
+	uint8_t literal[1 + RLE_LITERAL_MAX];
+	unsigned int literal_len;
+	uint8_t run_byte;
+	unsigned int run_len;
+} rle_encoder_t;
+
+void rle_encoder_init(rle_encoder_t *enc, rle_emit_t emit);
+void rle_encode(rle_encoder_t *enc, const void *data, unsigned int len);
+void rle_encoder_finish(rle_encoder_t *enc);
+
+/* False if src is truncated or decodes to more than dst_len bytes */
+bool rle_decode(void *dst, unsigned int dst_len, const void *src, unsigned int src_len, unsigned int *decoded_len);
@@ -0,0 +1,169 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gpio.h"
+#include "rle.h"
+#include "uart.h"
+#include "watchdog.h"
+
+/*
+ * Stage 0 loader. The ROM uploads it at 9600 baud, it then receives the flash
+ * loader at a faster baudrate and starts it. Until the header is acknowledged
+ * everything happens at 9600 baud:
+ *   stage 0 -> host: STAGE0_READY
+ *   host -> stage 0: header, see below, followed by its CRC32
+ *   stage 0 -> host: ACK, then switches to the requested baudrate
+ *   host -> stage 0: loader image, run length encoded if STAGE0_FLAG_RLE is set
+ *   stage 0 -> host: ACK and starts the loader once its CRC32 matches
+ * On any error stage 0 sends NACK and stops, the host then resets the chip
+ * back into the ROM.
+ *
+ * Header, little endian:
+ *   baudrate code (1, UART_CTRL_REG_BAUDRATE_* >> 2), flags (1),
+ *   image length (2), image CRC32 (4)
+ */
+#define STAGE0_READY		0x53
+#define STAGE0_ACK		0x06
+#define STAGE0_NACK		0x15
+
+#define STAGE0_FLAG_RLE		(1 << 0)
+
+#define STAGE0_HEADER_LEN	8
+
+/* Roughly one character time at 9600 baud, lets the ACK leave before the baudrate changes */
+#define STAGE0_TX_DRAIN_LOOPS	2000
+/* Polls for a received character before giving up, well above a character time at 9600 baud */
+#define STAGE0_RX_TIMEOUT_LOOPS	0x100000UL
+
+#define CRC32_POLY		0xedb88320
+
+/* Where the ROM would have put the loader, up to where stage 0 runs from. See stage0.ld */
+extern uint8_t _loader_start;
+extern uint8_t _loader_end;
+
+void stage0_main(void) __attribute__((noreturn));
+void stage0_start_loader(void) __attribute__((noreturn));
+
+static void stage0_putc(uint8_t byt) {
+	UART_RX_TX_REG = byt;
+	while (!(UART_CTRL_REG & UART_CTRL_REG_TI));
+	UART_CLEAR_TX_INT_REG = 1;
+}
+
+/* Without the watchdog being reset it takes the chip back into the ROM */
+static void stage0_fail(void) {
+	stage0_putc(STAGE0_NACK);
+	while (1);
+}
+
+static uint8_t stage0_getc(void) {
+	for (unsigned long timeout = STAGE0_RX_TIMEOUT_LOOPS; !(UART_CTRL_REG & UART_CTRL_REG_RI); timeout--) {
+		if (!timeout) {
+			stage0_fail();
+		}
+		watchdog_reset();
+	}
+	uint8_t byt = UART_RX_TX_REG;
+	UART_CLEAR_RX_INT_REG = 1;
+	return byt;
+}
+
+/* Bitwise, a table would be larger than all of stage 0 */
+static uint32_t stage0_crc32(const uint8_t *data, unsigned int len) {
+	uint32_t crc = 0xFFFFFFFFUL;
+
+	while (len--) {
+		crc ^= *data++;
+		for (unsigned int bit = 0; bit < 8; bit++) {
+			if (crc & 1) {
+				crc = (crc >> 1) ^ CRC32_POLY;
+			} else {
+				crc >>= 1;
+			}
+		}
+	}
+	return ~crc;
+}
+
+/* Same format as rle_decode(), decoded as the data arrives */
+static bool stage0_receive_rle(uint8_t *dst, unsigned int len) {
+	unsigned int pos = 0;
+
+	while (pos < len) {
+		uint8_t ctrl = stage0_getc();
+		unsigned int count;
+
+		if (ctrl < RLE_CTRL_RUN) {
+			count = ctrl + 1;
+			if (count > len - pos) {
+				return false;
+			}
+			while (count--) {
+				dst[pos++] = stage0_getc();
+			}
+			continue;
+		}
+
+		if (ctrl == RLE_CTRL_RUN_LONG) {
+			count = stage0_getc();
+			count |= (unsigned int)stage0_getc() << 8;
+		} else {
+			count = ctrl - RLE_CTRL_RUN + RLE_RUN_MIN;
+		}
+		uint8_t byt = stage0_getc();
+		if (count > len - pos) {
+			return false;
+		}
+		while (count--) {
+			dst[pos++] = byt;
+		}
+	}
+	return true;
+}
+
+void stage0_main(void) {
+	uint8_t *loader = &_loader_start;
+	uint8_t hdr[STAGE0_HEADER_LEN + 4];
+
+	P0_DIR_REG |= 0x03;
+	P0_MODE_REG |= 0x01;
+	UART_CTRL_REG = UART_CTRL_REG_BAUDRATE_9600 | UART_CTRL_REG_UART_TEN | UART_CTRL_REG_UART_REN;
+	stage0_putc(STAGE0_READY);
+
+	for (unsigned int i = 0; i < sizeof(hdr); i++) {
+		hdr[i] = stage0_getc();
+	}
+	uint8_t baudrate_code = hdr[0];
+	uint8_t flags = hdr[1];
+	unsigned int len = (unsigned int)hdr[2] | (unsigned int)hdr[3] << 8;
+	uint32_t crc = (uint32_t)hdr[4] | (uint32_t)hdr[5] << 8 | (uint32_t)hdr[6] << 16 | (uint32_t)hdr[7] << 24;
+	uint32_t hdr_crc = (uint32_t)hdr[8] | (uint32_t)hdr[9] << 8 | (uint32_t)hdr[10] << 16 | (uint32_t)hdr[11] << 24;
+	if (hdr_crc != stage0_crc32(hdr, STAGE0_HEADER_LEN) ||
+	    baudrate_code > (UART_CTRL_REG_BAUDRATE_230400 >> 2) ||
+	    len > (unsigned int)(&_loader_end - &_loader_start)) {
+		stage0_fail();
+	}
+
+	stage0_putc(STAGE0_ACK);
+	for (volatile unsigned int i = 0; i < STAGE0_TX_DRAIN_LOOPS; i++);
+	UART_CTRL_REG = baudrate_code << 2;
+	UART_CTRL_REG |= UART_CTRL_REG_UART_TEN | UART_CTRL_REG_UART_REN;
+
+	if (flags & STAGE0_FLAG_RLE) {
+		if (!stage0_receive_rle(loader, len)) {
+			stage0_fail();
+		}
+	} else {
+		for (unsigned int i = 0; i < len; i++) {
+			loader[i] = stage0_getc();
+		}
+	}
+	if (stage0_crc32(loader, len) != crc) {
+		stage0_fail();
+	}
+
+	stage0_putc(STAGE0_ACK);
+	/* The loader keeps the baudrate, see uart_init() */
+	for (volatile unsigned int i = 0; i < STAGE0_TX_DRAIN_LOOPS; i++);
+	stage0_start_loader();
+}
@@ -0,0 +1,30 @@
+.section .text.entry
+.globl stage0_entry
+stage0_entry:
+	/* No interrupt handlers, the vector table is the one of the ROM */
+	di
+	/* Setup stack, right below the one of the loader */
+	movd $__stage0_stack, (sp)
+	/* Copy ourselves out of the way of the loader, see stage0.ld */
+	movd $__stage0_load, (r1, r0)
+	movd $__stage0_start, (r3, r2)
+	movd $__stage0_end, (r5, r4)
+copy_stage0:
+	loadd 0x0(r1, r0), (r7, r6)
+	stord (r7, r6), 0x0(r3, r2)
+	addd $4, (r1, r0)
+	addd $4, (r3, r2)
+	cmpd (r5, r4), (r3, r2)
+	bne copy_stage0
+	/* Jump targets are word addresses, see vector_table_fixup */
+	movd $_stage0_main, (r1, r0)
+	lshd $-1, (r1, r0)
+	jump (r1, r0)
+
+.section .text
+.align 4
+.globl _stage0_start_loader
+_stage0_start_loader:
+	movd $__loader_start, (r1, r0)
+	lshd $-1, (r1, r0)
+	jump (r1, r0)
@@ -0,0 +1,33 @@
+#include "stats.h"
+
+static uint32_t stats_times[STATS_NUM_TIMES];
+static uint32_t stats_start;
+
+void stats_time_add(stats_time_t what, uint32_t start) {
+	stats_times[what] += timer_clocks() - start;
+}
+
+uint32_t stats_time_get(stats_time_t what) {
+	return stats_times[what];
+}
+
+void stats_cmd_add(stats_cmd_t *cmd, uint32_t start) {
+	uint32_t clocks = timer_clocks() - start;
+
+	cmd->count++;
+	cmd->total_clocks += clocks;
+	if (clocks > cmd->max_clocks) {
+		cmd->max_clocks = clocks;
+	}
+}
+
+void stats_reset(void) {
+	for (unsigned int i = 0; i < STATS_NUM_TIMES; i++) {
+		stats_times[i] = 0;
+	}
+	stats_start = timer_now();
+}
+
+uint32_t stats_uptime(void) {
+	return timer_now() - stats_start;
+}
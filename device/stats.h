@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "timer.h"
+
+/* Time spent waiting on hardware, in timer clocks */
+typedef enum stats_time {
+	STATS_TIME_QSPI,
+	STATS_TIME_UART_TX_STALL,
+	STATS_TIME_FLASH_WIP,
+	STATS_NUM_TIMES
+} stats_time_t;
+
+typedef struct stats_cmd {
+	uint32_t count;
+	uint32_t total_clocks;
+	uint32_t max_clocks;
+} stats_cmd_t;
+
+/* Add the clocks since start, a timer_clocks() value. Totals wrap after about an hour */
+void stats_time_add(stats_time_t what, uint32_t start);
+uint32_t stats_time_get(stats_time_t what);
+void stats_cmd_add(stats_cmd_t *cmd, uint32_t start);
+/* Restarts the uptime as well, per command statistics are owned by the caller */
+void stats_reset(void);
+/* In timer ticks */
+uint32_t stats_uptime(void);
@@ -9,9 +9,13 @@
 #include "dma.h"
 #include "gpio.h"
 #include "irq.h"
+#include "profile.h"
 #include "qspi.h"
+#include "rle.h"
+#include "stats.h"
 #include "system.h"
 #include "uart.h"
+#include "timer.h"
 #include "util.h"
 #include "watchdog.h"
 
@@ -20,6 +24,12 @@
 #define JEDEC_CMD_WREN		0x06
 #define JEDEC_CMD_WRDI		0x04
 #define JEDEC_CMD_RDSR		0x05
+#define JEDEC_CMD_READ		0x03
+#define JEDEC_CMD_FAST_READ_112	0x3B
+#define JEDEC_CMD_FAST_READ_122	0xBB
+#define JEDEC_CMD_FAST_READ_114	0x6B
+#define JEDEC_CMD_FAST_READ_144	0xEB
+#define JEDEC_CMD_SECTOR_ERASE	0x20
 #define JEDEC_RDSR_WIP		(1 << 0)
 #define JEDEC_RDSR_WEL		(1 << 1)
 
@@ -34,6 +44,20 @@
 #define UART_CMD_READ_FLASH	0x06
 #define UART_CMD_CHECKSUM	0x07
 #define UART_CMD_CHIPID		0x08
+#define UART_CMD_READ_FLASH_RLE	0x09
+#define UART_CMD_PROGRAM_PAGE_RLE	0x0A
+#define UART_CMD_BLANK_MAP	0x0B
+#define UART_CMD_WRITE_SECTOR	0x0C
+#define UART_CMD_ERASE		0x0D
+#define UART_CMD_PROGRAM_PAGE_COND	0x0E
+#define UART_CMD_PRBS		0x0F
+#define UART_CMD_READ_STREAM	0x10
+#define UART_CMD_STREAM_ACK	0x11
+#define UART_CMD_STATS		0x12
+#define UART_CMD_PROFILE	0x13
+#define UART_CMD_BENCH		0x14
+#define UART_CMD_CONFIRM_BAUDRATE	0x15
+#define UART_NUM_CMDS		(UART_CMD_CONFIRM_BAUDRATE + 1)
 
 #define RESPONSE_INVALID_CRC	0x00
 #define RESPONSE_CMD_OK		0x01
@@ -47,12 +71,56 @@
 #define RESPONSE_CHECKSUM	0x09
 #define RESPONSE_FLASH_INFO	0x0A
 #define RESPONSE_CHIPID		0x0B
+#define RESPONSE_FLASH_DATA_RLE	0x0C
+#define RESPONSE_BLANK_MAP	0x0D
+#define RESPONSE_PROGRAM_RESULT	0x0E
+#define RESPONSE_PRBS		0x0F
+#define RESPONSE_STREAM_BLOCK	0x10
+#define RESPONSE_STATS		0x11
+#define RESPONSE_PROFILE	0x12
+#define RESPONSE_BENCH		0x13
 
 #define TIMEOUT_HEADER		0x100000
 #define TIMEOUT_CMD		0x1000
 #define TIMEOUT_PARAM		0x10000
-#define TIMEOUT_SECTOR_ERASE	0x4000
-#define TIMEOUT_PAGE_PROGRAM	0x400
+/* 4 KiB erase in ms if SFDP has no max erase time, scaled with erase size for larger blocks */
+#define TIMEOUT_SECTOR_ERASE_MS	1000
+#define TIMEOUT_PAGE_PROGRAM_MS	10
+/* Silence in ms before a stream, or parameters read as they arrive, are given up */
+#define TIMEOUT_STREAM_MS	1000
+/* Timer ticks after the last command before an unconfirmed baudrate change is reverted, 2 s */
+#define TIMEOUT_BAUDRATE_CONFIRM	(2 * TIMER_TICK_HZ)
+
+#define FLASH_PAGE_SIZE		256
+#define WRITE_SECTOR_SIZE	0x1000
+/* Start, length, block size, credits and their CRC */
+#define READ_STREAM_PARAM_LEN	16
+#define READ_STREAM_BLOCK_MAX	0x1000
+/* STREAM_ACK ack value that ends a stream early, nak value for no NAK */
+#define STREAM_ACK_ABORT	0xFFFFFFFFUL
+#define STREAM_NAK_NONE		0xFFFFFFFFUL
+
+/* Payload of RESPONSE_PROGRAM_RESULT */
+#define PROGRAM_RESULT_PROGRAMMED	0x00
+#define PROGRAM_RESULT_UNCHANGED	0x01
+#define PROGRAM_RESULT_NEEDS_ERASE	0x02
+
+/* Address + CRC, then every page followed by its CRC */
+#define WRITE_SECTOR_PARAM_LEN	(4 + 4 + (WRITE_SECTOR_SIZE / FLASH_PAGE_SIZE) * (FLASH_PAGE_SIZE + 4))
+
+/*
+ * Buffer sizes, set from the build, see Makefile. A larger RX ring lets the
+ * host keep more data in flight, PING reports its size.
+ */
+#ifndef UART_RX_BUF_SIZE
+#define UART_RX_BUF_SIZE	1024
+#endif
+#ifndef UART_TX_BUF_SIZE
+#define UART_TX_BUF_SIZE	1024
+#endif
+#ifndef FLASH_READ_BUF_SIZE
+#define FLASH_READ_BUF_SIZE	256
+#endif
 
 typedef enum cmd_state {
 	CMD_STATE_WAIT_HEADER,
@@ -66,20 +134,59 @@ typedef struct cmd_handler cmd_handler_t;
 struct cmd_handler {
 	void (*call)(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len);
 	unsigned int min_param_len;
+	/* Handler consumes parameters and CRC from the RX ring while they arrive, min_param_len is exact */
+	bool stream_params;
 };
 
 typedef struct jedec_nor_flash_sector {
 	uint8_t erase_opcode;
+	/* 0 if the erase type does not exist */
 	uint8_t size_exponent;
+	/* From BFPT DWORD 10, 0 if unknown */
+	uint16_t typ_erase_ms;
+	uint16_t max_erase_ms;
 } jedec_nor_flash_sector_t;
 
+typedef struct jedec_nor_flash_read {
+	uint8_t opcode;
+	qspi_mode_t addr_mode;
+	qspi_mode_t data_mode;
+	/* Mode + wait clocks, expressed in bytes at addr_mode bus width */
+	uint8_t dummy_bytes;
+} jedec_nor_flash_read_t;
+
+/* 1-4-4, 1-1-4, 1-2-2 and 1-1-2, see jedec_fast_reads */
+#define JEDEC_NUM_FAST_READS	4
+
 typedef struct jedec_nor_flash_info {
 	uint32_t size_bytes;
 	uint8_t erase_opcode_4kib;
 	jedec_nor_flash_sector_t erase_sector_types[4];
+	jedec_nor_flash_read_t read;
+	/* Every fast read SFDP advertises, opcode 0 if not supported */
+	jedec_nor_flash_read_t fast_reads[JEDEC_NUM_FAST_READS];
 } jedec_nor_flash_info_t;
 
-static jedec_nor_flash_info_t flash_info_g = { 0 };
+static const jedec_nor_flash_read_t flash_read_legacy = {
+	.opcode = JEDEC_CMD_READ,
+	.addr_mode = QSPI_MODE_SIO,
+	.data_mode = QSPI_MODE_SIO,
+	.dummy_bytes = 0
+};
+
+static jedec_nor_flash_info_t flash_info_g = {
+	/* Every SPI NOR flash supports 4 KiB sector erase, SFDP tells about larger blocks */
+	.erase_opcode_4kib = JEDEC_CMD_SECTOR_ERASE,
+	.erase_sector_types = {
+		{ .erase_opcode = JEDEC_CMD_SECTOR_ERASE, .size_exponent = 12 }
+	},
+	.read = {
+		.opcode = JEDEC_CMD_READ,
+		.addr_mode = QSPI_MODE_SIO,
+		.data_mode = QSPI_MODE_SIO,
+		.dummy_bytes = 0
+	}
+};
 
 static uint32_t read_le32(const void *data) {
 	const uint8_t *data8 = data;
@@ -97,6 +204,161 @@ static void write_le32(void *data, uint32_t val) {
 	data8[3] = (val >> 24) & 0xff;
 }
 
+static uint8_t uart_tx_buf[UART_TX_BUF_SIZE];
+/* Start of data owned by DMA, only advanced once a DMA transfer completed */
+static volatile unsigned int uart_tx_dma_ptr = 0;
+static volatile unsigned int uart_tx_dma_len = 0;
+static volatile unsigned int uart_tx_write_ptr = 0;
+
+/* Includes bytes currently owned by DMA, one byte is kept free to tell full from empty */
+static unsigned int uart_tx_buffered_data(void) {
+	return (uart_tx_write_ptr + sizeof(uart_tx_buf) - uart_tx_dma_ptr) % sizeof(uart_tx_buf);
+}
+
+static unsigned int uart_tx_buffer_space(void) {
+	return sizeof(uart_tx_buf) - 1 - uart_tx_buffered_data();
+}
+
+static void uart_start_tx_dma(const void *ptr, unsigned int len) {
+	uart_tx_dma_len = len;
+	dma_restart(DMA_UART_TX, ptr, len);
+}
+
+/*
+ * Retire a finished DMA transfer and queue the next contiguous chunk of the
+ * ring. Called from the TX interrupt and, with interrupts disabled, from the
+ * waiting loops so transmission also progresses from trap context.
+ */
+static void uart_tx_service(void) {
+	if (uart_tx_dma_len) {
+		if (!dma_done(DMA_UART_TX)) {
+			return;
+		}
+		dma_stop(DMA_UART_TX);
+		uart_tx_dma_ptr = (uart_tx_dma_ptr + uart_tx_dma_len) % sizeof(uart_tx_buf);
+		uart_tx_dma_len = 0;
+	}
+
+	unsigned int dma_ptr = uart_tx_dma_ptr;
+	unsigned int write_ptr = uart_tx_write_ptr;
+	if (dma_ptr != write_ptr) {
+		unsigned int len = write_ptr > dma_ptr ? write_ptr - dma_ptr : sizeof(uart_tx_buf) - dma_ptr;
+		uart_start_tx_dma(&uart_tx_buf[dma_ptr], len);
+	}
+}
+
+static void uart_tx_dma_irq(unsigned int channel) {
+	uart_tx_service();
+}
+
+static void uart_tx_int(void) {
+	RESET_INT_PENDING_REG = RESET_INT_PENDING_REG_UART_TI_INT_PEND;
+	dma_irq(DMA_UART_TX);
+}
+
+static unsigned int uart_tx_buffer_copy(const void *src, unsigned int len) {
+	const uint8_t *src8 = src;
+	unsigned int bytes_to_end_of_buffer = sizeof(uart_tx_buf) - uart_tx_write_ptr;
+	unsigned int bytes_to_copy = len;
+	unsigned int new_tx_write_ptr = uart_tx_write_ptr;
+	if (bytes_to_copy > bytes_to_end_of_buffer) {
+		bytes_to_copy = bytes_to_end_of_buffer;
+	}
+	memcpy(&uart_tx_buf[new_tx_write_ptr], src8, bytes_to_copy);
+	new_tx_write_ptr += bytes_to_copy;
+	new_tx_write_ptr %= sizeof(uart_tx_buf);
+	src8 += bytes_to_copy;
+	if (bytes_to_copy < len) {
+		memcpy(&uart_tx_buf[new_tx_write_ptr], src8, len - bytes_to_copy);
+		new_tx_write_ptr += len - bytes_to_copy;
+		new_tx_write_ptr %= sizeof(uart_tx_buf);
+	}
+
+	return new_tx_write_ptr;
+}
+
+/* Queue data for transmission, blocks only while the ring is full */
+static void uart_tx_write(const void *ptr, unsigned int len) {
+	const uint8_t *ptr8 = ptr;
+	bool stalled = false;
+	uint32_t stall_start = 0;
+	while (len) {
+		irq_state_t irq = irq_save();
+		uart_tx_service();
+		unsigned int bytes_to_copy = uart_tx_buffer_space();
+		irq_restore(irq);
+		if (!bytes_to_copy) {
+			if (!stalled) {
+				stall_start = timer_clocks();
+				stalled = true;
+			}
+			watchdog_reset();
+			continue;
+		}
+		if (stalled) {
+			stats_time_add(STATS_TIME_UART_TX_STALL, stall_start);
+			stalled = false;
+		}
+		if (len < bytes_to_copy) {
+			bytes_to_copy = len;
+		}
+
+		/* Only the producer moves uart_tx_write_ptr, copying is safe without locking */
+		unsigned int tx_write_ptr = uart_tx_buffer_copy(ptr8, bytes_to_copy);
+		irq = irq_save();
+		uart_tx_write_ptr = tx_write_ptr;
+		uart_tx_service();
+		irq_restore(irq);
+
+		ptr8 += bytes_to_copy;
+		len -= bytes_to_copy;
+	}
+}
+
+#define TIMEOUT_TX_SHIFT	0x1000
+
+/* Wait for all queued data to leave the UART shift register */
+static void uart_tx_flush(void) {
+	while (1) {
+		irq_state_t irq = irq_save();
+		uart_tx_service();
+		bool empty = !uart_tx_dma_len && uart_tx_dma_ptr == uart_tx_write_ptr;
+		irq_restore(irq);
+		if (empty) {
+			break;
+		}
+		watchdog_reset();
+	}
+
+	/* TI is set once the last byte has been shifted out, bounded in case nothing was sent */
+	for (unsigned int timeout = TIMEOUT_TX_SHIFT; timeout; timeout--) {
+		if (UART_CTRL_REG & UART_CTRL_REG_TI) {
+			break;
+		}
+		watchdog_reset();
+	}
+	UART_CLEAR_TX_INT_REG = 1;
+}
+
+static void uart_tx_init(void) {
+	const dma_xfer_desc_t tx_desc = {
+		.dir = DMA_MEM_TO_PERIPH,
+		.src = uart_tx_buf,
+		.dst = &UART_RX_TX_REG,
+		.len = 0,
+		.width = DMAX_CTRL_REG_BW_BYTE,
+		.prio = DMAX_CTRL_REG_DMA_PRIO_LOW,
+		.done = uart_tx_dma_irq
+	};
+
+	dma_setup(DMA_UART_TX, &tx_desc);
+	UART_CLEAR_TX_INT_REG = 1;
+
+	/* DMA completion is routed to uart_ti_int via DINT_MODE */
+	INT2_PRIORITY_REG &= ~INT2_PRIORITY_REG_UART_TI_INT_PRIO_MASK;
+	INT2_PRIORITY_REG |= (2 << INT2_PRIORITY_REG_UART_TI_INT_PRIO_SHIFT);
+}
+
 static void send_response_with_payload_(uint8_t response, uint32_t id, uint32_t len) {
 	uint8_t hdr[14];
 	hdr[0] = HEADER_BYTE;
@@ -107,7 +369,7 @@ static void send_response_with_payload_(uint8_t response, uint32_t id, uint32_t
 	crc = crc32_update(crc, hdr, 10);
 	crc = crc32_final(crc);
 	write_le32(&hdr[10], crc);
-	uart_write(hdr, sizeof(hdr));
+	uart_tx_write(hdr, sizeof(hdr));
 }
 
 static void send_response_with_payload(uint8_t response, uint32_t id, const void *data, uint32_t len) {
@@ -117,8 +379,8 @@ static void send_response_with_payload(uint8_t response, uint32_t id, const void
 	crc = crc32_update(crc, data, len);
 	crc = crc32_final(crc);
 	write_le32(crc_buf, crc);
-	uart_write(data, len);
-	uart_write(crc_buf, sizeof(crc_buf));
+	uart_tx_write(data, len);
+	uart_tx_write(crc_buf, sizeof(crc_buf));
 }
 
 static void debug_puts(const char *ptr) {
@@ -199,14 +461,14 @@ static void debug_hexdump(const void *ptr, unsigned int len) {
 			NIBBLE_TO_HEX_CHAR((byt >> 0) & 0xf),
 		};
 		crc = crc32_update(crc, hexdata, sizeof(hexdata));
-		uart_write(hexdata, sizeof(hexdata));
+		uart_tx_write(hexdata, sizeof(hexdata));
 		watchdog_reset();
 
 	}
 	crc = crc32_final(crc);
 	uint8_t crc_buf[4];
 	write_le32(crc_buf, crc);
-	uart_write(crc_buf, sizeof(crc_buf));
+	uart_tx_write(crc_buf, sizeof(crc_buf));
 }
 
 static void print_trap(const char *trap) {
@@ -217,6 +479,7 @@ static void print_trap(const char *trap) {
 
 static void print_trap_reset(const char *trap) {
 	print_trap(trap);
+	uart_tx_flush();
 	system_reset();
 }
 
@@ -253,12 +516,12 @@ static void dbg_trap(void) {
 	print_trap("Debug");
 }
 
-static uint8_t uart_rx_buf[1024];
+static uint8_t uart_rx_buf[UART_RX_BUF_SIZE];
 static unsigned int uart_rx_dma_ptr = 0;
 static unsigned int uart_rx_read_ptr = 0;
 
 static unsigned int uart_rx_buffered_data(void) {
-	unsigned int data_in_transit = DMAX_IDX_REG(DMA_UART_RX);
+	unsigned int data_in_transit = dma_progress(DMA_UART_RX);
 	unsigned int effective_rx_dma_ptr = uart_rx_dma_ptr + data_in_transit;
 	if (effective_rx_dma_ptr >= uart_rx_read_ptr) {
 		return effective_rx_dma_ptr - uart_rx_read_ptr;
@@ -268,7 +531,7 @@ static unsigned int uart_rx_buffered_data(void) {
 }
 
 static bool uart_data_available(void) {
-	unsigned int data_in_transit = DMAX_IDX_REG(DMA_UART_RX);
+	unsigned int data_in_transit = dma_progress(DMA_UART_RX);
 	return (uart_rx_dma_ptr + data_in_transit) != uart_rx_read_ptr;
 }
 
@@ -292,139 +555,72 @@ static void uart_read(void *ptr, unsigned int len) {
 	}
 }
 
-static void *uart_get_read_ptr(void) {
-	return &uart_rx_buf[uart_rx_read_ptr];
-}
-
-static void uart_advance_read_ptr(unsigned int increment) {
-	uart_rx_read_ptr += increment;
-}
-
-static uint8_t uart_tx_buf[1024];
-static unsigned int uart_tx_dma_ptr = 0;
-static unsigned int uart_tx_write_ptr = 0;
-
-static volatile unsigned int num_rx_interrupts = 0;
-bool uart_rx_irq_flag = false;
-static void uart_rx_int(void) {
-	/*
-	UART_RX_TX_REG;
-	UART_CLEAR_RX_INT_REG = 1;
-	RESET_INT_PENDING_REG = RESET_INT_PENDING_REG_UART_RI_INT_PEND;
-	*/
-	num_rx_interrupts++;
-	uart_rx_irq_flag = true;
-}
-
-static unsigned int uart_tx_buffered_data(void) {
-	if (uart_tx_write_ptr > uart_tx_dma_ptr) {
-		return uart_tx_write_ptr - uart_tx_dma_ptr;
-	} else {
-		return sizeof(uart_tx_buf) - uart_tx_dma_ptr + uart_tx_write_ptr;
+/* Copy data at offset from the read pointer without consuming it */
+static void uart_peek(void *ptr, unsigned int offset, unsigned int len) {
+	uint8_t *ptr8 = ptr;
+	unsigned int read_ptr = (uart_rx_read_ptr + offset) % sizeof(uart_rx_buf);
+	while (len--) {
+		*ptr8++ = uart_rx_buf[read_ptr++];
+		read_ptr %= sizeof(uart_rx_buf);
 	}
 }
 
-bool tx_irq_flag = false;
-bool tx_dma_active = false;
-static void uart_start_tx_dma(void) {
-	unsigned int num_bytes = uart_tx_buffered_data();
-	DMAX_A_STARTL_REG(DMA_UART_TX) = (uint16_t)(uintptr_t)&uart_tx_buf[uart_tx_dma_ptr];
-	DMAX_A_STARTH_REG(DMA_UART_TX) = (uint16_t)((uint32_t)&uart_tx_buf[uart_tx_dma_ptr] >> 16);
-	DMAX_INT_REG(DMA_UART_TX) = num_bytes;
-	DMAX_LEN_REG(DMA_UART_TX) = num_bytes;
-	DMAX_CTRL_REG(DMA_UART_TX) |= DMAX_CTRL_REG_DMA_ON;
-	tx_dma_active = true;
-}
-
-static void uart_tx_int(void) {
-	unsigned int xfer_len = DMAX_LEN_REG(DMA_UART_TX);
-	uart_tx_dma_ptr += xfer_len;
-	uart_tx_dma_ptr %= sizeof(uart_tx_buf);
-
-	if (uart_tx_dma_ptr == uart_tx_write_ptr) {
-		DMAX_CTRL_REG(DMA_UART_TX) &= ~DMAX_CTRL_REG_DMA_ON;
-		tx_dma_active = false;
-	} else {
-		uart_start_tx_dma();
+static uint32_t uart_rx_crc32_update(uint32_t crc, unsigned int len) {
+	unsigned int bytes_to_end_of_buffer = sizeof(uart_rx_buf) - uart_rx_read_ptr;
+	if (len > bytes_to_end_of_buffer) {
+		crc = crc32_update(crc, &uart_rx_buf[uart_rx_read_ptr], bytes_to_end_of_buffer);
+		return crc32_update(crc, uart_rx_buf, len - bytes_to_end_of_buffer);
 	}
-	tx_irq_flag = true;
+	return crc32_update(crc, &uart_rx_buf[uart_rx_read_ptr], len);
 }
 
-static unsigned int uart_tx_buffer_space(void) {
-	return sizeof(uart_tx_buf) - uart_tx_buffered_data();
-}
+/* Largest parameter block, PROGRAM_PAGE address + page */
+#define CMD_PARAM_MAX_LEN	(4 + 256)
 
-static unsigned int uart_tx_buffer_copy(const void *src, unsigned int len) {
-	const uint8_t *src8 = src;
-	unsigned int bytes_to_end_of_buffer = sizeof(uart_tx_buf) - uart_tx_write_ptr;
-	unsigned int bytes_to_copy = len;
-	unsigned int new_tx_write_ptr = uart_tx_write_ptr;
-	if (bytes_to_copy > bytes_to_end_of_buffer) {
-		bytes_to_copy = bytes_to_end_of_buffer;
-	}
-	memcpy(&uart_tx_buf[new_tx_write_ptr], src8, bytes_to_copy);
-	new_tx_write_ptr += bytes_to_copy;
-	new_tx_write_ptr %= sizeof(uart_tx_buf);
-	src8 += bytes_to_copy;
-	if (bytes_to_copy < len) {
-		memcpy(&uart_tx_buf[new_tx_write_ptr], src8, len - bytes_to_copy);
-		new_tx_write_ptr += len - bytes_to_copy;
-		new_tx_write_ptr %= sizeof(uart_tx_buf);
-	}
+/* Header, parameters and their CRC, one byte is kept free to tell full from empty */
+_Static_assert(UART_RX_BUF_SIZE > 14 + CMD_PARAM_MAX_LEN + 4, "UART_RX_BUF_SIZE can not hold a command");
 
-	return new_tx_write_ptr;
-}
+/* Bounce buffer for parameters wrapping around the end of uart_rx_buf */
+static uint8_t cmd_param_buf[CMD_PARAM_MAX_LEN] __attribute__((aligned(4)));
 
-/*
-static void uart_write(const void *ptr, unsigned int len) {
-	const uint8_t *ptr8 = ptr;
-	tx_irq_flag = false;
-	while (len) {
-		disable_interrupts();
-		unsigned int buffer_space = uart_tx_buffer_space();
-		enable_interrupts();
-		unsigned int bytes_to_copy = buffer_space;
-		if (len < bytes_to_copy) {
-			bytes_to_copy = len;
-		}
-		unsigned int tx_write_ptr = uart_tx_buffer_copy(ptr, bytes_to_copy);
-		disable_interrupts();
-		uart_tx_write_ptr = tx_write_ptr;
-		if (!tx_dma_active) {
-			uart_start_tx_dma();
-		}
-		enable_interrupts();
-		while (!tx_irq_flag);
-		tx_irq_flag = false;
+/* Returns len contiguous bytes at the read pointer */
+static const void *uart_get_read_ptr(unsigned int len) {
+	if (uart_rx_read_ptr + len <= sizeof(uart_rx_buf)) {
+		return &uart_rx_buf[uart_rx_read_ptr];
 	}
+	uart_peek(cmd_param_buf, 0, len);
+	return cmd_param_buf;
 }
 
-static void uart_write_string(const char *str) {
-	uart_write(str, strlen(str));
+static void uart_advance_read_ptr(unsigned int increment) {
+	uart_rx_read_ptr += increment;
+	uart_rx_read_ptr %= sizeof(uart_rx_buf);
 }
 
-static void uart_flush(void) {
-	disable_interrupts();
-	unsigned int buffered_bytes = uart_tx_buffered_data();
-	enable_interrupts();
-	while (buffered_bytes) {
-		while (!tx_irq_flag) {
-			watchdog_reset();
-		}
-		tx_irq_flag = false;
+static volatile unsigned int num_rx_interrupts = 0;
+bool uart_rx_irq_flag = false;
+/* RX ring wrapped around */
+static void uart_rx_dma_irq(unsigned int channel) {
+	num_rx_interrupts++;
+	uart_rx_irq_flag = true;
+}
 
-		disable_interrupts();
-		buffered_bytes = uart_tx_buffered_data();
-		enable_interrupts();
-	}
+static void uart_rx_int(void) {
+	/*
+	UART_RX_TX_REG;
+	UART_CLEAR_RX_INT_REG = 1;
+	RESET_INT_PENDING_REG = RESET_INT_PENDING_REG_UART_RI_INT_PEND;
+	*/
+	dma_irq(DMA_UART_RX);
 }
 
+/*
 static void uart_read(void *ptr, unsigned int len) {
 	uart_rx_irq_flag = false;
 	DMAX_A_STARTL_REG(DMA_UART_RX) = (uint16_t)(uintptr_t)&UART_RX_TX_REG;
-	DMAX_A_STARTH_REG(DMA_UART_RX) = (uint16_t)((uint32_t)&UART_RX_TX_REG >> 16);
+	DMAX_A_STARTH_REG(DMA_UART_RX) = (uint16_t)((uintptr_t)&UART_RX_TX_REG >> 16);
 	DMAX_B_STARTL_REG(DMA_UART_RX) = (uint16_t)(uintptr_t)ptr;
-	DMAX_B_STARTH_REG(DMA_UART_RX) = (uint16_t)((uint32_t)ptr >> 16);
+	DMAX_B_STARTH_REG(DMA_UART_RX) = (uint16_t)((uintptr_t)ptr >> 16);
 	DMAX_INT_REG(DMA_UART_RX) = sizeof(len);
 	DMAX_LEN_REG(DMA_UART_RX) = sizeof(len);
 	DMAX_CTRL_REG(DMA_UART_RX) =
@@ -449,12 +645,20 @@ vector_table_t vector_table = {
 	.dbg_trap = dbg_trap,
 	.uart_ri_int = uart_rx_int,
 	.uart_ti_int = uart_tx_int,
+	.tim0_int = timer_tim0_int,
+	.tim1_int = profile_tim1_int,
 };
 
-static void qspic_read_erase_sector_size(uint8_t sector_desc[2], jedec_nor_flash_sector_t *sector_info) {
+static bool erase_type_valid(const jedec_nor_flash_sector_t *sector_info) {
+	return sector_info->size_exponent && sector_info->size_exponent < 32;
+}
+
+static void qspic_read_erase_sector_size(const uint8_t sector_desc[2], jedec_nor_flash_sector_t *sector_info) {
 	sector_info->size_exponent = sector_desc[0];
 	sector_info->erase_opcode = sector_desc[1];
-	if (sector_info->size_exponent != 0xff) {
+	sector_info->typ_erase_ms = 0;
+	sector_info->max_erase_ms = 0;
+	if (erase_type_valid(sector_info)) {
 		debug_puts("Sector size 2^");
 		debug_putint(sector_info->size_exponent);
 		debug_puts(" erase opcode is 0x");
@@ -463,8 +667,98 @@ static void qspic_read_erase_sector_size(uint8_t sector_desc[2], jedec_nor_flash
 	}
 }
 
-static void qspic_read_parameter_table_0(uint8_t parameter_table[64], jedec_nor_flash_info_t *flash_info) {
-	flash_info->erase_opcode_4kib = parameter_table[2];
+/* Typical time: 5 bit count + 1 in units of 1ms, 16ms, 128ms or 1s. Max time: typical * 2 * (multiplier + 1). */
+static void qspic_read_erase_times(const uint8_t *parameter_table, unsigned int table_len, jedec_nor_flash_info_t *flash_info) {
+	static const uint16_t erase_time_units_ms[] = { 1, 16, 128, 1000 };
+
+	/* DWORD 10 was added in JESD216A */
+	if (table_len < 40) {
+		return;
+	}
+
+	uint32_t dword10 = read_le32(&parameter_table[36]);
+	uint32_t max_multiplier = 2 * ((dword10 & 0x0f) + 1);
+	for (unsigned int i = 0; i < ARRAY_SIZE(flash_info->erase_sector_types); i++) {
+		jedec_nor_flash_sector_t *sector_info = &flash_info->erase_sector_types[i];
+		unsigned int shift = 4 + i * 7;
+		uint32_t count = ((dword10 >> shift) & 0x1f) + 1;
+		uint32_t typ_ms = count * erase_time_units_ms[(dword10 >> (shift + 5)) & 0x03];
+		uint32_t max_ms = typ_ms * max_multiplier;
+
+		if (!erase_type_valid(sector_info)) {
+			continue;
+		}
+		sector_info->typ_erase_ms = typ_ms > 0xffff ? 0xffff : typ_ms;
+		sector_info->max_erase_ms = max_ms > 0xffff ? 0xffff : max_ms;
+		debug_puts("Sector size 2^");
+		debug_putint(sector_info->size_exponent);
+		debug_puts(" typical erase time ");
+		debug_putint(sector_info->typ_erase_ms);
+		debug_puts("ms\r\n");
+	}
+}
+
+typedef struct jedec_fast_read_desc {
+	uint8_t support_bit;
+	uint8_t param_offset;
+	qspi_mode_t addr_mode;
+	qspi_mode_t data_mode;
+} jedec_fast_read_desc_t;
+
+/* Fastest first, support bits are in BFPT byte 2, wait/mode clocks and opcode in DWORD 3/4 */
+static const jedec_fast_read_desc_t jedec_fast_reads[JEDEC_NUM_FAST_READS] = {
+	{ .support_bit = 5, .param_offset = 8,  .addr_mode = QSPI_MODE_QIO, .data_mode = QSPI_MODE_QIO }, /* 1-4-4 */
+	{ .support_bit = 6, .param_offset = 10, .addr_mode = QSPI_MODE_SIO, .data_mode = QSPI_MODE_QIO }, /* 1-1-4 */
+	{ .support_bit = 4, .param_offset = 14, .addr_mode = QSPI_MODE_DIO, .data_mode = QSPI_MODE_DIO }, /* 1-2-2 */
+	{ .support_bit = 0, .param_offset = 12, .addr_mode = QSPI_MODE_SIO, .data_mode = QSPI_MODE_DIO }, /* 1-1-2 */
+};
+
+static unsigned int qspi_mode_bus_width(qspi_mode_t mode) {
+	switch (mode) {
+	case QSPI_MODE_DIO:
+		return 2;
+	case QSPI_MODE_QIO:
+		return 4;
+	default:
+		return 1;
+	}
+}
+
+static void qspic_read_fast_read_modes(const uint8_t *parameter_table, unsigned int table_len, jedec_nor_flash_info_t *flash_info) {
+	/* DWORD 3 and 4 are part of every BFPT revision, check anyway */
+	if (table_len < 16) {
+		return;
+	}
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(jedec_fast_reads); i++) {
+		const jedec_fast_read_desc_t *fast_read = &jedec_fast_reads[i];
+		if (!(parameter_table[2] & (1 << fast_read->support_bit))) {
+			continue;
+		}
+
+		uint8_t clocks = parameter_table[fast_read->param_offset];
+		unsigned int wait_clocks = clocks & 0x1f;
+		unsigned int mode_clocks = (clocks >> 5) & 0x07;
+		unsigned int dummy_bits = (wait_clocks + mode_clocks) * qspi_mode_bus_width(fast_read->addr_mode);
+		if (dummy_bits % 8) {
+			/* QSPIC can only clock out whole bytes */
+			continue;
+		}
+
+		jedec_nor_flash_read_t *read = &flash_info->fast_reads[i];
+		read->opcode = parameter_table[fast_read->param_offset + 1];
+		read->addr_mode = fast_read->addr_mode;
+		read->data_mode = fast_read->data_mode;
+		read->dummy_bytes = dummy_bits / 8;
+		/* flash_verify_read_mode() picks the one used for reads */
+	}
+}
+
+static void qspic_read_parameter_table_0(uint8_t parameter_table[64], unsigned int table_len, jedec_nor_flash_info_t *flash_info) {
+	/* Byte 0 bits 1:0 are 01 if 4 KiB erase is supported uniformly, byte 1 holds its opcode */
+	if ((parameter_table[0] & 0x03) == 0x01) {
+		flash_info->erase_opcode_4kib = parameter_table[1];
+	}
 	debug_puts("4KiB erase opcode 0x");
 	debug_putbyte_hex(flash_info->erase_opcode_4kib);
 	debug_puts("\r\n");
@@ -483,9 +777,15 @@ static void qspic_read_parameter_table_0(uint8_t parameter_table[64], jedec_nor_
 		flash_info->size_bytes = (raw_size + 1) / 8UL;
 	}
 
-	for (int i = 0; i < 4; i++) {
-		qspic_read_erase_sector_size(&parameter_table[7 * 4 + i / 2], &flash_info->erase_sector_types[i]);
+	/* DWORD 8 and 9, size exponent and opcode of erase types 1 to 4 */
+	if (table_len >= 36) {
+		for (unsigned int i = 0; i < ARRAY_SIZE(flash_info->erase_sector_types); i++) {
+			qspic_read_erase_sector_size(&parameter_table[28 + i * 2], &flash_info->erase_sector_types[i]);
+		}
+		qspic_read_erase_times(parameter_table, table_len, flash_info);
 	}
+
+	qspic_read_fast_read_modes(parameter_table, table_len, flash_info);
 }
 
 static const uint8_t sfdp_read_header_cmd[] = { JEDEC_CMD_RDSFDP, 0x00, 0x00, 0x00 };
@@ -493,8 +793,9 @@ static void qspic_read_parameter_table(uint8_t *parameter_header, jedec_nor_flas
 	uint8_t parameter_table[64];
 	unsigned int table_len = (unsigned int)parameter_header[3] * 4;
 	if (table_len > sizeof(parameter_table)) {
-		debug_puts("Parameter table > 64 byte, skipping");
-		return ;
+		/* Newer JESD216 revisions only append DWORDs, the first 64 bytes keep their layout */
+		debug_puts("Parameter table > 64 byte, truncating\r\n");
+		table_len = sizeof(parameter_table);
 	}
 	unsigned int table_id = parameter_header[0];
 	uint8_t read_parameter_table_cmd[] = { JEDEC_CMD_RDSFDP, parameter_header[6], parameter_header[5], parameter_header[4] };
@@ -517,7 +818,7 @@ static void qspic_read_parameter_table(uint8_t *parameter_header, jedec_nor_flas
 	debug_puts("\r\n");
 
 	if (table_type == 0x00) {
-		qspic_read_parameter_table_0(parameter_table, flash_info);
+		qspic_read_parameter_table_0(parameter_table, table_len, flash_info);
 	}
 }
 
@@ -572,20 +873,18 @@ static void qspic_read_sfdp(jedec_nor_flash_info_t *flash_info) {
 #define FUNCTION_ADDRESS(funcptr_) (((intptr_t)funcptr_) << 1)
 
 static void start_uart_rx_dma(void *ptr, unsigned int len) {
-	DMAX_A_STARTL_REG(DMA_UART_RX) = (uint16_t)(uintptr_t)&UART_RX_TX_REG;
-	DMAX_A_STARTH_REG(DMA_UART_RX) = (uint16_t)((uint32_t)&UART_RX_TX_REG >> 16);
-	DMAX_B_STARTL_REG(DMA_UART_RX) = (uint16_t)(uintptr_t)ptr;
-	DMAX_B_STARTH_REG(DMA_UART_RX) = (uint16_t)((uint32_t)ptr >> 16);
-	DMAX_INT_REG(DMA_UART_RX) = len;
-	DMAX_LEN_REG(DMA_UART_RX) = len;
-	DMAX_CTRL_REG(DMA_UART_RX) =
-		DMAX_CTRL_REG_DMA_PRIO_MIDHIGH |
-		DMAX_CTRL_REG_CIRCULAR |
-		DMAX_CTRL_REG_BINC |
-		DMAX_CTRL_REG_DREQ_MODE |
-		DMAX_CTRL_REG_DINT_MODE |
-		DMAX_CTRL_REG_BW_BYTE;
-	DMAX_CTRL_REG(DMA_UART_RX) |= DMAX_CTRL_REG_DMA_ON;
+	const dma_xfer_desc_t rx_desc = {
+		.dir = DMA_PERIPH_TO_MEM,
+		.src = &UART_RX_TX_REG,
+		.dst = ptr,
+		.len = len,
+		.width = DMAX_CTRL_REG_BW_BYTE,
+		.prio = DMAX_CTRL_REG_DMA_PRIO_MIDHIGH,
+		.circular = true,
+		.done = uart_rx_dma_irq
+	};
+
+	dma_xfer(DMA_UART_RX, &rx_desc);
 }
 
 static void reset_uart_rx_dma(void) {
@@ -609,36 +908,177 @@ static uint8_t read_flash_status_register(void) {
 	return status_register[0];
 }
 
-static bool wait_flash_write_finished(unsigned int timeout) {
-	do {
-		uint8_t status = read_flash_status_register();
-		if (!(status & JEDEC_RDSR_WIP)) {
-			return true;
+/* Waits timeout_ms for WIP to clear, with a last poll after the deadline in case the flash just finished */
+static bool wait_flash_write_finished(uint32_t timeout_ms) {
+	uint32_t start = timer_clocks();
+	uint32_t start_tick = timer_now();
+	bool finished;
+	for (;;) {
+		bool expired = timer_now() - start_tick > TIMER_MS_TO_TICKS(timeout_ms);
+		finished = !(read_flash_status_register() & JEDEC_RDSR_WIP);
+		if (finished || expired) {
+			break;
+		}
+		watchdog_reset();
+	}
+
+	stats_time_add(STATS_TIME_FLASH_WIP, start);
+	return finished;
+}
+
+static void flash_read_with(const jedec_nor_flash_read_t *read, uint32_t address, void *data, unsigned int len) {
+	uint8_t address_bytes[] = { (address >> 16) & 0xff, (address >> 8) & 0xff, address & 0xff };
+	qpsi_xfer_action_t actions[] = {
+		{
+			.action = QSPI_WRITE,
+			.tx_data = &read->opcode,
+			.len = 1
+		},
+		{
+			.action = QSPI_SET_MODE,
+			.mode = read->addr_mode
+		},
+		{
+			.action = QSPI_WRITE,
+			.tx_data = address_bytes,
+			.len = sizeof(address_bytes)
+		},
+		{
+			.action = QSPI_DUMMY,
+			.len = read->dummy_bytes
+		},
+		{
+			.action = QSPI_SET_MODE,
+			.mode = read->data_mode
+		},
+		{
+			.action = QSPI_READ,
+			.rx_data = data,
+			.len = len
 		}
-	} while (timeout--);
+	};
+
+	qspi_scatter_transfer(QSPI_MODE_SIO, actions, ARRAY_SIZE(actions));
+}
+
+static void flash_read(uint32_t address, void *data, unsigned int len) {
+	flash_read_with(&flash_info_g.read, address, data, len);
+}
 
+/* Places spread over the flash where a block to verify read modes with is looked for */
+#define FLASH_READ_VERIFY_PROBES	64
+#define FLASH_READ_VERIFY_LEN		16
+
+/* Erased or zeroed flash reads the same in every mode, it can not tell them apart */
+static bool flash_find_verify_block(uint32_t size, uint32_t *address, uint8_t data[FLASH_READ_VERIFY_LEN]) {
+	for (unsigned int probe = 0; probe < FLASH_READ_VERIFY_PROBES; probe++) {
+		*address = size / FLASH_READ_VERIFY_PROBES * probe;
+		flash_read_with(&flash_read_legacy, *address, data, FLASH_READ_VERIFY_LEN);
+		for (unsigned int i = 1; i < FLASH_READ_VERIFY_LEN; i++) {
+			if (data[i] != data[0]) {
+				return true;
+			}
+		}
+		watchdog_reset();
+	}
 	return false;
 }
 
+/*
+ * SFDP only tells us what the flash can do, not whether quad mode is enabled
+ * (QE bit) or IO2/IO3 are routed on this board. Every advertised mode, fastest
+ * first, is compared against a legacy read of a block that is not uniform.
+ * If the flash has no such block, only modes that do not need QE are used.
+ */
+static void flash_verify_read_mode(jedec_nor_flash_info_t *flash_info) {
+	uint8_t legacy_data[FLASH_READ_VERIFY_LEN];
+	uint8_t fast_data[FLASH_READ_VERIFY_LEN];
+	uint32_t address;
+
+	bool verifiable = flash_find_verify_block(flash_info->size_bytes, &address, legacy_data);
+	for (unsigned int i = 0; i < ARRAY_SIZE(flash_info->fast_reads); i++) {
+		const jedec_nor_flash_read_t *read = &flash_info->fast_reads[i];
+		if (!read->opcode) {
+			continue;
+		}
+
+		bool works;
+		if (verifiable) {
+			flash_read_with(read, address, fast_data, sizeof(fast_data));
+			works = !memcmp(legacy_data, fast_data, sizeof(legacy_data));
+		} else {
+			works = read->addr_mode != QSPI_MODE_QIO && read->data_mode != QSPI_MODE_QIO;
+		}
+		if (works) {
+			flash_info->read = *read;
+			debug_puts("Using fast read opcode 0x");
+			debug_putbyte_hex(read->opcode);
+			debug_puts(verifiable ? "\r\n" : ", flash is blank, not verified\r\n");
+			return;
+		}
+
+		debug_puts("Fast read opcode 0x");
+		debug_putbyte_hex(read->opcode);
+		debug_puts(verifiable ? " returned bad data\r\n" : " may need QE, flash is blank\r\n");
+	}
+
+	debug_puts("Falling back to SIO\r\n");
+	flash_info->read = flash_read_legacy;
+}
+
+/* Payload is the size of the RX ring, older loaders send none */
 static void call_ping_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
-	send_response(RESPONSE_OK, id);
+	uint8_t rx_buf_size[4];
+
+	write_le32(rx_buf_size, sizeof(uart_rx_buf));
+	send_response_with_payload(RESPONSE_OK, id, rx_buf_size, sizeof(rx_buf_size));
 }
 
+/* Baudrate restored unless CONFIRM_BAUDRATE arrives at the new one, see main() and dispatch_cmd() */
+static unsigned long baudrate_fallback;
+static bool baudrate_confirm_pending = false;
+static uint32_t baudrate_confirm_start;
+
 static void call_set_baudrate_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
 	uint32_t baudrate = read_le32(param_data);
 	if (uart_is_baudrate_attainable(baudrate)) {
 		send_response(RESPONSE_OK, id);
-		uart_flush();
+		uart_tx_flush();
+		/* Fall back to the last confirmed baudrate */
+		if (!baudrate_confirm_pending) {
+			baudrate_fallback = uart_get_baudrate();
+		}
 		uart_set_baudrate(baudrate);
-
+		if (baudrate != baudrate_fallback) {
+			baudrate_confirm_pending = true;
+			baudrate_confirm_start = timer_now();
+		}
 	} else {
 		send_response(RESPONSE_INVALID_PARAM, id);
 	}
 }
 
+static void call_confirm_baudrate_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+	baudrate_confirm_pending = false;
+	send_response(RESPONSE_OK, id);
+}
+
+/* Flash size, then size exponent, opcode, typical and max time in ms of every erase type */
 static void call_flash_info_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
-	uint8_t flash_info_buf[4];
+	uint8_t flash_info_buf[4 + ARRAY_SIZE(flash_info_g.erase_sector_types) * 6];
+	uint8_t *erase_type_buf = &flash_info_buf[4];
 	write_le32(flash_info_buf, flash_info_g.size_bytes);
+	for (unsigned int i = 0; i < ARRAY_SIZE(flash_info_g.erase_sector_types); i++) {
+		const jedec_nor_flash_sector_t *sector_info = &flash_info_g.erase_sector_types[i];
+		bool valid = erase_type_valid(sector_info);
+		erase_type_buf[0] = valid ? sector_info->size_exponent : 0;
+		erase_type_buf[1] = sector_info->erase_opcode;
+		erase_type_buf[2] = sector_info->typ_erase_ms & 0xff;
+		erase_type_buf[3] = sector_info->typ_erase_ms >> 8;
+		erase_type_buf[4] = sector_info->max_erase_ms & 0xff;
+		erase_type_buf[5] = sector_info->max_erase_ms >> 8;
+		erase_type_buf += 6;
+	}
 	send_response_with_payload(RESPONSE_FLASH_INFO, id, flash_info_buf, sizeof(flash_info_buf));
 }
 
@@ -657,12 +1097,30 @@ static void flash_write_enable(void) {
 	qspi_write_then_read(&write_enable_desc);
 }
 
-static void call_erase_sector_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
-	uint32_t address = read_le32(param_data);
+static void send_flash_response(uint32_t id, bool success) {
+	if (success) {
+		send_response(RESPONSE_OK, id);
+	} else {
+		send_response(RESPONSE_FLASH_TIMEOUT, id);
+	}
+}
+
+/* SFDP max erase time of the erase type of that size, a generous default without one */
+static uint32_t flash_erase_timeout_ms(unsigned int size_exponent) {
+	for (unsigned int i = 0; i < ARRAY_SIZE(flash_info_g.erase_sector_types); i++) {
+		const jedec_nor_flash_sector_t *sector_info = &flash_info_g.erase_sector_types[i];
+		if (erase_type_valid(sector_info) && sector_info->size_exponent == size_exponent && sector_info->max_erase_ms) {
+			return sector_info->max_erase_ms;
+		}
+	}
+
+	return (uint32_t)TIMEOUT_SECTOR_ERASE_MS << (size_exponent - 12);
+}
 
+static bool flash_erase(uint32_t address, uint8_t opcode, unsigned int size_exponent) {
 	flash_write_enable();
 
-	uint8_t erase_sector_cmd[] = { 0x20, (address >> 16) & 0xff, (address >> 8) & 0xff, address & 0xff };
+	uint8_t erase_sector_cmd[] = { opcode, (address >> 16) & 0xff, (address >> 8) & 0xff, address & 0xff };
 	qspi_xfer_desc_t erase_sector_desc = {
 		.mode = QSPI_MODE_SIO,
 		.tx_data = erase_sector_cmd,
@@ -673,21 +1131,44 @@ static void call_erase_sector_handler(const cmd_handler_t *handler, uint32_t id,
 	};
 	qspi_write_then_read(&erase_sector_desc);
 
-	bool success = wait_flash_write_finished(TIMEOUT_SECTOR_ERASE);
+	bool success = wait_flash_write_finished(flash_erase_timeout_ms(size_exponent));
 
 	qspi_set_write_protect(true);
 
-	if (success) {
-		send_response(RESPONSE_OK, id);
-	} else {
-		send_response(RESPONSE_FLASH_TIMEOUT, id);
-	}
+	return success;
 }
 
-static void call_program_page_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+static bool flash_erase_sector(uint32_t address) {
+	return flash_erase(address, flash_info_g.erase_opcode_4kib, 12);
+}
+
+static void call_erase_sector_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+	uint32_t address = read_le32(param_data);
+
+	send_flash_response(id, flash_erase_sector(address));
+}
+
+/* Erase with one of the SFDP erase types, address must be aligned to its size */
+static void call_erase_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
 	const uint8_t *param8 = param_data;
 	uint32_t address = read_le32(&param8[0]);
+	unsigned int erase_type = param8[4];
+
+	if (erase_type >= ARRAY_SIZE(flash_info_g.erase_sector_types)) {
+		send_response(RESPONSE_INVALID_PARAM, id);
+		return;
+	}
+	const jedec_nor_flash_sector_t *sector_info = &flash_info_g.erase_sector_types[erase_type];
+	if (!erase_type_valid(sector_info) || sector_info->size_exponent < 12 ||
+	    (address & ((1UL << sector_info->size_exponent) - 1))) {
+		send_response(RESPONSE_INVALID_PARAM, id);
+		return;
+	}
 
+	send_flash_response(id, flash_erase(address, sector_info->erase_opcode, sector_info->size_exponent));
+}
+
+static bool flash_program(uint32_t address, const void *data, unsigned int len) {
 	flash_write_enable();
 
 	uint8_t program_sector_cmd[] = { 0x02, (address >> 16) & 0xff, (address >> 8) & 0xff, address & 0xff };
@@ -699,30 +1180,88 @@ static void call_program_page_handler(const cmd_handler_t *handler, uint32_t id,
 		},
 		{
 			.action = QSPI_WRITE,
-			.tx_data = &param8[4],
-			.len = 256
+			.tx_data = data,
+			.len = len
 		}
 	};
 
 	qspi_scatter_transfer(QSPI_MODE_SIO, actions, ARRAY_SIZE(actions));
 
-	bool success = wait_flash_write_finished(TIMEOUT_PAGE_PROGRAM);
+	bool success = wait_flash_write_finished(TIMEOUT_PAGE_PROGRAM_MS);
 
 	qspi_set_write_protect(true);
 
-	if (success) {
-		send_response(RESPONSE_OK, id);
-	} else {
+	return success;
+}
+
+static void call_program_page_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+	const uint8_t *param8 = param_data;
+	uint32_t address = read_le32(&param8[0]);
+
+	send_flash_response(id, flash_program(address, &param8[4], FLASH_PAGE_SIZE));
+}
+
+/* Staging buffer for flash reads, also holds decoded PROGRAM_PAGE_RLE data. Aligned for QSPI DMA */
+static uint8_t flash_read_buffer[FLASH_READ_BUF_SIZE] __attribute__((aligned(4)));
+
+_Static_assert(FLASH_READ_BUF_SIZE >= FLASH_PAGE_SIZE && FLASH_READ_BUF_SIZE % 4 == 0, "FLASH_READ_BUF_SIZE must hold an aligned page");
+
+static void call_program_page_rle_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+	const uint8_t *param8 = param_data;
+	uint32_t address = read_le32(&param8[0]);
+	unsigned int page_len;
+
+	/* Programming starts at address and wraps around within its page, at most one page fits */
+	if (!rle_decode(flash_read_buffer, FLASH_PAGE_SIZE, &param8[4], param_len - 4, &page_len) || !page_len) {
+		send_response(RESPONSE_INVALID_PARAM, id);
+		return;
+	}
+
+	send_flash_response(id, flash_program(address, flash_read_buffer, page_len));
+}
+
+/*
+ * Programs a page without erasing it first. Programming can only clear bits,
+ * the page is programmed if every bit set in the new data is still set in
+ * flash. Otherwise nothing is written and the host has to erase.
+ */
+static void call_program_page_cond_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+	const uint8_t *param8 = param_data;
+	uint32_t address = read_le32(&param8[0]);
+	const uint8_t *data = &param8[4];
+	uint8_t result = PROGRAM_RESULT_UNCHANGED;
+
+	if (address % FLASH_PAGE_SIZE) {
+		send_response(RESPONSE_INVALID_PARAM, id);
+		return;
+	}
+
+	flash_read(address, flash_read_buffer, FLASH_PAGE_SIZE);
+	for (unsigned int i = 0; i < FLASH_PAGE_SIZE; i++) {
+		if (flash_read_buffer[i] == data[i]) {
+			continue;
+		}
+		if ((flash_read_buffer[i] & data[i]) != data[i]) {
+			result = PROGRAM_RESULT_NEEDS_ERASE;
+			break;
+		}
+		result = PROGRAM_RESULT_PROGRAMMED;
+	}
+
+	if (result == PROGRAM_RESULT_PROGRAMMED && !flash_program(address, data, FLASH_PAGE_SIZE)) {
 		send_response(RESPONSE_FLASH_TIMEOUT, id);
+		return;
 	}
+
+	send_response_with_payload(RESPONSE_PROGRAM_RESULT, id, &result, sizeof(result));
 }
 
 static void call_reset_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
 	send_response(RESPONSE_OK, id);
+	uart_tx_flush();
 	system_reset();
 }
 
-static uint8_t flash_read_buffer[256];
 static void call_read_flash_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
 	const uint8_t *param8 = param_data;
 	uint32_t start_address = read_le32(&param8[0]);
@@ -744,18 +1283,10 @@ static void call_read_flash_handler(const cmd_handler_t *handler, uint32_t id, c
 			read_length = sizeof(flash_read_buffer);
 		}
 
-		uint8_t read_flash_cmd[] = { 0x03, (start_address >> 16) & 0xff, (start_address >> 8) & 0xff, start_address & 0xff };
-		qspi_xfer_desc_t desc = {
-			.mode = QSPI_MODE_SIO,
-			.tx_data = read_flash_cmd,
-			.tx_len = sizeof(read_flash_cmd),
-			.dummy_cycles_after_tx = 0,
-			.rx_data = flash_read_buffer,
-			.rx_len = read_length
-		};
-		qspi_write_then_read(&desc);
+		/* Runs while DMA is still draining previous blocks from the TX ring */
+		flash_read(start_address, flash_read_buffer, read_length);
 		crc = crc32_update(crc, flash_read_buffer, read_length);
-		uart_write(flash_read_buffer, read_length);
+		uart_tx_write(flash_read_buffer, read_length);
 
 		length -= read_length;
 		start_address += read_length;
@@ -764,7 +1295,7 @@ static void call_read_flash_handler(const cmd_handler_t *handler, uint32_t id, c
 	crc = crc32_final(crc);
 	uint8_t crc_buf[4];
 	write_le32(crc_buf, crc);
-	uart_write(crc_buf, sizeof(crc_buf));
+	uart_tx_write(crc_buf, sizeof(crc_buf));
 
 /*
 	debug_puts("Read done, CRC embedded 0x");
@@ -773,11 +1304,60 @@ static void call_read_flash_handler(const cmd_handler_t *handler, uint32_t id, c
 */
 }
 
-static void call_checksum_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+static rle_encoder_t rle_encoder;
+static uint32_t rle_payload_len;
+static uint32_t rle_payload_crc;
+
+static void rle_count(const void *data, unsigned int len) {
+	rle_payload_len += len;
+}
+
+static void rle_send(const void *data, unsigned int len) {
+	rle_payload_crc = crc32_update(rle_payload_crc, data, len);
+	uart_tx_write(data, len);
+}
+
+static void flash_read_rle(uint32_t start_address, uint32_t length, rle_emit_t emit) {
+	rle_encoder_init(&rle_encoder, emit);
+	while (length) {
+		uint32_t read_length = length;
+		if (read_length > sizeof(flash_read_buffer)) {
+			read_length = sizeof(flash_read_buffer);
+		}
+
+		flash_read(start_address, flash_read_buffer, read_length);
+		rle_encode(&rle_encoder, flash_read_buffer, read_length);
+		watchdog_reset();
+
+		length -= read_length;
+		start_address += read_length;
+	}
+	rle_encoder_finish(&rle_encoder);
+}
+
+/*
+ * The response header carries the payload length, so flash is encoded twice:
+ * once to size the payload and once more while sending it. Flash reads are
+ * much faster than the UART and there is no RAM to hold the encoded data.
+ */
+static void call_read_flash_rle_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
 	const uint8_t *param8 = param_data;
 	uint32_t start_address = read_le32(&param8[0]);
 	uint32_t length = read_le32(&param8[4]);
 
+	rle_payload_len = 0;
+	flash_read_rle(start_address, length, rle_count);
+
+	send_response_with_payload_(RESPONSE_FLASH_DATA_RLE, id, rle_payload_len);
+	rle_payload_crc = crc32_init();
+	flash_read_rle(start_address, length, rle_send);
+
+	uint8_t crc_buf[4];
+	write_le32(crc_buf, crc32_final(rle_payload_crc));
+	uart_tx_write(crc_buf, sizeof(crc_buf));
+}
+
+static uint32_t flash_checksum(uint32_t start_address, uint32_t length) {
 	uint32_t crc = crc32_init();
 	while (length) {
 		uint32_t read_length = length;
@@ -785,16 +1365,7 @@ static void call_checksum_handler(const cmd_handler_t *handler, uint32_t id, con
 			read_length = sizeof(flash_read_buffer);
 		}
 
-		uint8_t read_flash_cmd[] = { 0x03, (start_address >> 16) & 0xff, (start_address >> 8) & 0xff, start_address & 0xff };
-		qspi_xfer_desc_t desc = {
-			.mode = QSPI_MODE_SIO,
-			.tx_data = read_flash_cmd,
-			.tx_len = sizeof(read_flash_cmd),
-			.dummy_cycles_after_tx = 0,
-			.rx_data = flash_read_buffer,
-			.rx_len = read_length
-		};
-		qspi_write_then_read(&desc);
+		flash_read(start_address, flash_read_buffer, read_length);
 		crc = crc32_update(crc, flash_read_buffer, read_length);
 		watchdog_reset();
 
@@ -802,13 +1373,405 @@ static void call_checksum_handler(const cmd_handler_t *handler, uint32_t id, con
 		start_address += read_length;
 	}
 
-	/* Inner CRC of flash data */
+	return crc32_final(crc);
+}
+
+/*
+ * CRC32 of the whole range or, with the optional block size parameter, one
+ * CRC32 per block in a single response. The last block may be short.
+ */
+static void call_checksum_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+	const uint8_t *param8 = param_data;
+	uint32_t start_address = read_le32(&param8[0]);
+	uint32_t length = read_le32(&param8[4]);
+	uint32_t block_size = param_len >= 12 ? read_le32(&param8[8]) : 0;
+	uint8_t crc_buf[4];
+
+	if (!block_size) {
+		/* Inner CRC of flash data */
+		write_le32(crc_buf, flash_checksum(start_address, length));
+		send_response_with_payload(RESPONSE_CHECKSUM, id, crc_buf, sizeof(crc_buf));
+		return;
+	}
+
+	if (!length) {
+		send_response(RESPONSE_INVALID_PARAM, id);
+		return;
+	}
+
+	uint32_t num_blocks = (length - 1) / block_size + 1;
+	send_response_with_payload_(RESPONSE_CHECKSUM, id, num_blocks * sizeof(crc_buf));
+
+	uint32_t crc = crc32_init();
+	while (length) {
+		uint32_t block_length = length < block_size ? length : block_size;
+		write_le32(crc_buf, flash_checksum(start_address, block_length));
+		crc = crc32_update(crc, crc_buf, sizeof(crc_buf));
+		uart_tx_write(crc_buf, sizeof(crc_buf));
+		start_address += block_length;
+		length -= block_length;
+	}
+
+	write_le32(crc_buf, crc32_final(crc));
+	uart_tx_write(crc_buf, sizeof(crc_buf));
+}
+
+static bool buffer_is_blank(const uint8_t *data, unsigned int len) {
+	while (len--) {
+		if (*data++ != 0xFF) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Stops reading at the first programmed byte */
+static bool flash_is_blank(uint32_t start_address, uint32_t length) {
+	while (length) {
+		uint32_t read_length = length;
+		if (read_length > sizeof(flash_read_buffer)) {
+			read_length = sizeof(flash_read_buffer);
+		}
+
+		flash_read(start_address, flash_read_buffer, read_length);
+		watchdog_reset();
+		if (!buffer_is_blank(flash_read_buffer, read_length)) {
+			return false;
+		}
+
+		length -= read_length;
+		start_address += read_length;
+	}
+
+	return true;
+}
+
+/* One bit per block, LSB first, set if the block is erased. The last block may be short. */
+static void call_blank_map_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+	const uint8_t *param8 = param_data;
+	uint32_t start_address = read_le32(&param8[0]);
+	uint32_t length = read_le32(&param8[4]);
+	uint32_t block_size = read_le32(&param8[8]);
+
+	if (!length || !block_size) {
+		send_response(RESPONSE_INVALID_PARAM, id);
+		return;
+	}
+
+	uint32_t num_blocks = (length - 1) / block_size + 1;
+	send_response_with_payload_(RESPONSE_BLANK_MAP, id, (num_blocks + 7) / 8);
+
+	uint32_t crc = crc32_init();
+	uint8_t map_byte = 0;
+	for (uint32_t block = 0; block < num_blocks; block++) {
+		uint32_t block_length = length < block_size ? length : block_size;
+		if (flash_is_blank(start_address, block_length)) {
+			map_byte |= 1 << (block % 8);
+		}
+		start_address += block_length;
+		length -= block_length;
+
+		if (block % 8 == 7 || block == num_blocks - 1) {
+			crc = crc32_update(crc, &map_byte, sizeof(map_byte));
+			uart_tx_write(&map_byte, sizeof(map_byte));
+			map_byte = 0;
+		}
+	}
+
 	crc = crc32_final(crc);
 	uint8_t crc_buf[4];
 	write_le32(crc_buf, crc);
-	uart_write(crc_buf, sizeof(crc_buf));
+	uart_tx_write(crc_buf, sizeof(crc_buf));
+}
+
+/* Waits for len bytes in the RX ring */
+static bool uart_rx_wait(unsigned int len) {
+	uint32_t start = timer_now();
+	while (uart_rx_buffered_data() < len) {
+		if (timer_now() - start >= TIMER_MS_TO_TICKS(TIMEOUT_STREAM_MS)) {
+			return false;
+		}
+		watchdog_reset();
+	}
+
+	return true;
+}
+
+/*
+ * Erases a sector and programs it from the same frame. Pages keep arriving in
+ * the RX ring while the erase runs. Each page carries its own CRC and is
+ * programmed as soon as it checks out, without waiting for the frame CRC. Every
+ * consumed page is acknowledged with CMD_OK, the host only sends as many pages
+ * ahead as the ring can hold. Bytes left over after an error are skipped by
+ * header search.
+ */
+static void call_write_sector_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+	uint8_t address_buf[8];
+	if (!uart_rx_wait(sizeof(address_buf))) {
+		send_response(RESPONSE_PARAM_SHORT, id);
+		return;
+	}
+	uart_read(address_buf, sizeof(address_buf));
+	uint32_t frame_crc = crc32_update(crc32_init(), address_buf, sizeof(address_buf));
+
+	/* Checked before erasing, the frame CRC comes too late for that */
+	uint32_t address = read_le32(&address_buf[0]);
+	uint32_t address_crc = crc32_final(crc32_update(crc32_init(), address_buf, 4));
+	if (address_crc != read_le32(&address_buf[4])) {
+		send_response(RESPONSE_INVALID_CRC, id);
+		return;
+	}
+	if (address % WRITE_SECTOR_SIZE) {
+		send_response(RESPONSE_INVALID_PARAM, id);
+		return;
+	}
+
+	if (!flash_erase_sector(address)) {
+		send_response(RESPONSE_FLASH_TIMEOUT, id);
+		return;
+	}
+
+	for (unsigned int offset = 0; offset < WRITE_SECTOR_SIZE; offset += FLASH_PAGE_SIZE) {
+		if (!uart_rx_wait(FLASH_PAGE_SIZE + 4)) {
+			send_response(RESPONSE_PARAM_SHORT, id);
+			return;
+		}
+		const uint8_t *page = uart_get_read_ptr(FLASH_PAGE_SIZE + 4);
+		frame_crc = crc32_update(frame_crc, page, FLASH_PAGE_SIZE + 4);
+		uint32_t page_crc = crc32_final(crc32_update(crc32_init(), page, FLASH_PAGE_SIZE));
+		if (page_crc != read_le32(&page[FLASH_PAGE_SIZE])) {
+			send_response(RESPONSE_INVALID_CRC, id);
+			return;
+		}
+		/* Erased pages need no programming */
+		if (!buffer_is_blank(page, FLASH_PAGE_SIZE) && !flash_program(address + offset, page, FLASH_PAGE_SIZE)) {
+			send_response(RESPONSE_FLASH_TIMEOUT, id);
+			return;
+		}
+		uart_advance_read_ptr(FLASH_PAGE_SIZE + 4);
+		send_response(RESPONSE_CMD_OK, id);
+	}
+
+	uint8_t crc_buf[4];
+	if (!uart_rx_wait(sizeof(crc_buf))) {
+		send_response(RESPONSE_PARAM_SHORT, id);
+		return;
+	}
+	uart_read(crc_buf, sizeof(crc_buf));
+	if (crc32_final(frame_crc) != read_le32(crc_buf)) {
+		send_response(RESPONSE_INVALID_CRC, id);
+		return;
+	}
+
+	send_response(RESPONSE_OK, id);
+}
+
+static void send_stream_block(uint32_t id, uint32_t address, uint32_t seq, unsigned int len) {
+	uint8_t seq_buf[4];
+	write_le32(seq_buf, seq);
+	send_response_with_payload_(RESPONSE_STREAM_BLOCK, id, sizeof(seq_buf) + len);
+	uart_tx_write(seq_buf, sizeof(seq_buf));
+	uint32_t crc = crc32_update(crc32_init(), seq_buf, sizeof(seq_buf));
+
+	while (len) {
+		unsigned int read_len = len < sizeof(flash_read_buffer) ? len : sizeof(flash_read_buffer);
+		flash_read(address, flash_read_buffer, read_len);
+		crc = crc32_update(crc, flash_read_buffer, read_len);
+		uart_tx_write(flash_read_buffer, read_len);
+		watchdog_reset();
+		address += read_len;
+		len -= read_len;
+	}
 
-	send_response_with_payload(RESPONSE_CHECKSUM, id, crc_buf, sizeof(crc_buf));
+	uint8_t crc_buf[4];
+	write_le32(crc_buf, crc32_final(crc));
+	uart_tx_write(crc_buf, sizeof(crc_buf));
+}
+
+/*
+ * Takes the next STREAM_ACK frame for the stream id out of the RX ring.
+ * Other commands are rejected with CMD_INVALID and skipped as a whole, *skip
+ * holds the part of them not received yet. False if no complete
+ * STREAM_ACK frame is buffered yet.
+ */
+static bool stream_poll_ack(uint32_t id, uint32_t *skip, uint32_t *ack, uint32_t *nak) {
+	uint8_t frame[1 + 13 + 8 + 4];
+
+	while (uart_data_available()) {
+		if (*skip) {
+			uint32_t skip_len = uart_rx_buffered_data();
+			if (skip_len > *skip) {
+				skip_len = *skip;
+			}
+			uart_advance_read_ptr(skip_len);
+			*skip -= skip_len;
+			continue;
+		}
+		uart_peek(frame, 0, 1);
+		if (frame[0] != HEADER_BYTE) {
+			uart_advance_read_ptr(1);
+			continue;
+		}
+		if (uart_rx_buffered_data() < 1 + 13) {
+			return false;
+		}
+		uart_peek(frame, 0, 1 + 13);
+		uint32_t crc_check = crc32_final(crc32_update(crc32_init(), &frame[1], 9));
+		if (crc_check != read_le32(&frame[10])) {
+			/* Stray sync byte */
+			uart_advance_read_ptr(1);
+			continue;
+		}
+		if (frame[1] != UART_CMD_STREAM_ACK || read_le32(&frame[2]) != id || read_le32(&frame[6]) != 8) {
+			/* Stale acknowledgements of other streams need no response */
+			if (frame[1] != UART_CMD_STREAM_ACK) {
+				send_response(RESPONSE_CMD_INVALID, read_le32(&frame[2]));
+			}
+			uint32_t param_len = read_le32(&frame[6]);
+			*skip = param_len ? param_len + 4 : 0;
+			uart_advance_read_ptr(1 + 13);
+			continue;
+		}
+		if (uart_rx_buffered_data() < sizeof(frame)) {
+			return false;
+		}
+		uart_read(frame, sizeof(frame));
+		crc_check = crc32_final(crc32_update(crc32_init(), &frame[14], 8));
+		if (crc_check != read_le32(&frame[22])) {
+			continue;
+		}
+		*ack = read_le32(&frame[14]);
+		*nak = read_le32(&frame[18]);
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Streams a flash range as STREAM_BLOCK responses, each carrying its sequence
+ * number. At most credits blocks past the last acknowledged one are sent. The
+ * host returns credits with STREAM_ACK frames carrying the number of blocks
+ * received in order and optionally a block to send again. The stream ends
+ * with OK once all blocks are acknowledged.
+ */
+static void call_read_stream_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+	uint8_t params[READ_STREAM_PARAM_LEN + 4];
+	if (!uart_rx_wait(sizeof(params))) {
+		send_response(RESPONSE_PARAM_SHORT, id);
+		return;
+	}
+	uart_read(params, sizeof(params));
+	uint32_t params_crc = crc32_final(crc32_update(crc32_init(), params, READ_STREAM_PARAM_LEN));
+	if (params_crc != read_le32(&params[READ_STREAM_PARAM_LEN])) {
+		send_response(RESPONSE_INVALID_CRC, id);
+		return;
+	}
+
+	uint32_t start_address = read_le32(&params[0]);
+	uint32_t length = read_le32(&params[4]);
+	uint32_t block_size = read_le32(&params[8]);
+	uint32_t credits = read_le32(&params[12]);
+	if (!length || !block_size || block_size > READ_STREAM_BLOCK_MAX || !credits) {
+		send_response(RESPONSE_INVALID_PARAM, id);
+		return;
+	}
+
+	uint32_t num_blocks = (length - 1) / block_size + 1;
+	uint32_t next_seq = 0;
+	uint32_t acked = 0;
+	uint32_t skip = 0;
+	uint32_t idle_start = timer_now();
+	while (acked < num_blocks) {
+		uint32_t ack, nak;
+		if (stream_poll_ack(id, &skip, &ack, &nak)) {
+			if (ack == STREAM_ACK_ABORT) {
+				break;
+			}
+			if (ack > acked && ack <= next_seq) {
+				acked = ack;
+			}
+			if (nak != STREAM_NAK_NONE && nak < next_seq) {
+				uint32_t offset = nak * block_size;
+				send_stream_block(id, start_address + offset, nak, length - offset < block_size ? length - offset : block_size);
+			}
+			idle_start = timer_now();
+			continue;
+		}
+
+		if (next_seq < num_blocks && next_seq - acked < credits) {
+			uint32_t offset = next_seq * block_size;
+			send_stream_block(id, start_address + offset, next_seq, length - offset < block_size ? length - offset : block_size);
+			next_seq++;
+			idle_start = timer_now();
+			continue;
+		}
+
+		/* Out of credits, host gone if it stays silent */
+		if (timer_now() - idle_start >= TIMER_MS_TO_TICKS(TIMEOUT_STREAM_MS)) {
+			debug_puts("Stream timed out\r\n");
+			return;
+		}
+		watchdog_reset();
+	}
+
+	send_response(RESPONSE_OK, id);
+}
+
+/* Acknowledgements that arrive after their stream ended are dropped silently */
+static void call_stream_ack_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+}
+
+/* xorshift32, the host generates the same sequence to test the link */
+static uint32_t prbs_next(uint32_t state) {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+/*
+ * Link test: parameters are seed, response length and optionally the start of
+ * the sequence for that seed. The response carries length bytes of the
+ * sequence, four bytes per step, little endian.
+ */
+static void call_prbs_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+	const uint8_t *param8 = param_data;
+	uint32_t state = read_le32(&param8[0]);
+	uint32_t length = read_le32(&param8[4]);
+	uint8_t prbs_buf[4];
+
+	if (!state) {
+		send_response(RESPONSE_INVALID_PARAM, id);
+		return;
+	}
+
+	uint32_t check_state = state;
+	for (unsigned int offset = 8; offset < param_len; offset++) {
+		if (offset % 4 == 0) {
+			check_state = prbs_next(check_state);
+			write_le32(prbs_buf, check_state);
+		}
+		if (param8[offset] != prbs_buf[offset % 4]) {
+			send_response(RESPONSE_INVALID_PARAM, id);
+			return;
+		}
+	}
+
+	send_response_with_payload_(RESPONSE_PRBS, id, length);
+	uint32_t crc = crc32_init();
+	while (length) {
+		unsigned int chunk_len = length < sizeof(prbs_buf) ? length : sizeof(prbs_buf);
+		state = prbs_next(state);
+		write_le32(prbs_buf, state);
+		crc = crc32_update(crc, prbs_buf, chunk_len);
+		uart_tx_write(prbs_buf, chunk_len);
+		length -= chunk_len;
+	}
+
+	write_le32(prbs_buf, crc32_final(crc));
+	uart_tx_write(prbs_buf, sizeof(prbs_buf));
 }
 
 static void call_chipid_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
@@ -824,6 +1787,282 @@ static void call_chipid_handler(const cmd_handler_t *handler, uint32_t id, const
 	send_response_with_payload(RESPONSE_CHIPID, id, chipid_buf, sizeof(chipid_buf));
 }
 
+/* One entry per command code, filled by dispatch_cmd() */
+static stats_cmd_t cmd_stats[UART_NUM_CMDS];
+
+#define STATS_FLAG_RESET	(1 << 0)
+
+static uint32_t uart_tx_write_le32(uint32_t crc, uint32_t val) {
+	uint8_t buf[4];
+	write_le32(buf, val);
+	uart_tx_write(buf, sizeof(buf));
+	return crc32_update(crc, buf, sizeof(buf));
+}
+
+/*
+ * Tick frequency and uptime in ticks, clock frequency, the hardware wait
+ * times of stats_time_t and count, total and maximum handler time of every
+ * command code. Times are in timer clocks, all fields little endian 32 bit.
+ * An optional flag byte resets everything once the response is sent.
+ */
+static void call_stats_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+	const uint8_t *param8 = param_data;
+	uint32_t crc = crc32_init();
+
+	send_response_with_payload_(RESPONSE_STATS, id, (3 + STATS_NUM_TIMES + UART_NUM_CMDS * 3) * 4);
+	crc = uart_tx_write_le32(crc, TIMER_TICK_HZ);
+	crc = uart_tx_write_le32(crc, stats_uptime());
+	crc = uart_tx_write_le32(crc, TIMER_CLK_HZ);
+	for (unsigned int i = 0; i < STATS_NUM_TIMES; i++) {
+		crc = uart_tx_write_le32(crc, stats_time_get(i));
+	}
+	for (unsigned int i = 0; i < UART_NUM_CMDS; i++) {
+		crc = uart_tx_write_le32(crc, cmd_stats[i].count);
+		crc = uart_tx_write_le32(crc, cmd_stats[i].total_clocks);
+		crc = uart_tx_write_le32(crc, cmd_stats[i].max_clocks);
+	}
+	uart_tx_write_le32(crc, crc32_final(crc));
+
+	if (param_len && (param8[0] & STATS_FLAG_RESET)) {
+		memset(cmd_stats, 0, sizeof(cmd_stats));
+		stats_reset();
+	}
+}
+
+#define PROFILE_FLAG_START	(1 << 0)
+#define PROFILE_FLAG_STOP	(1 << 1)
+#define PROFILE_FLAG_CLEAR	(1 << 2)
+
+/*
+ * Optional flags stop, clear and start the profiler, in that order. The
+ * response is the histogram afterwards: code start address, sample count,
+ * samples outside of the code (32 bit each), bucket shift, count shift,
+ * running flag, one reserved byte and PROFILE_BUCKETS 16 bit buckets, all
+ * little endian. A running profiler keeps counting while it is sent.
+ */
+static void call_profile_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+	const uint8_t *param8 = param_data;
+	uint8_t flags = param_len ? param8[0] : 0;
+
+	if (flags & PROFILE_FLAG_STOP) {
+		profile_stop();
+	}
+	if (flags & PROFILE_FLAG_CLEAR) {
+		profile_clear();
+	}
+	if (flags & PROFILE_FLAG_START) {
+		profile_start();
+	}
+
+	const profile_t *prof = profile_get();
+	uint8_t hdr[16];
+	write_le32(&hdr[0], prof->text_start);
+	write_le32(&hdr[4], prof->samples);
+	write_le32(&hdr[8], prof->outside);
+	hdr[12] = prof->bucket_shift;
+	hdr[13] = prof->count_shift;
+	hdr[14] = profile_running();
+	hdr[15] = 0;
+
+	send_response_with_payload_(RESPONSE_PROFILE, id, sizeof(hdr) + PROFILE_BUCKETS * 2);
+	uint32_t crc = crc32_update(crc32_init(), hdr, sizeof(hdr));
+	uart_tx_write(hdr, sizeof(hdr));
+	for (unsigned int i = 0; i < PROFILE_BUCKETS; i++) {
+		uint8_t bucket[2] = { prof->buckets[i] & 0xff, prof->buckets[i] >> 8 };
+		crc = crc32_update(crc, bucket, sizeof(bucket));
+		uart_tx_write(bucket, sizeof(bucket));
+	}
+	uart_tx_write_le32(crc, crc32_final(crc));
+}
+
+#define BENCH_QSPI_READ		0x00
+#define BENCH_CRC32		0x01
+#define BENCH_MEMCPY		0x02
+#define BENCH_UART_TX		0x03
+#define BENCH_FLASH_WRITE	0x04
+
+/* Throughput benchmarks run for a fixed time, all times are in timer clocks */
+#define BENCH_CLOCKS		(TIMER_CLK_HZ / 4)
+/* Read mode argument of BENCH_QSPI_READ, 1 + index into jedec_fast_reads otherwise */
+#define BENCH_READ_LEGACY	0
+
+#define BENCH_UART_TX_MAX	0x10000
+
+static void send_bench_result(uint32_t id, uint8_t test, const uint32_t *values, unsigned int num_values) {
+	uint8_t payload[8 + 4 * 4] = { test, 0, 0, 0 };
+
+	write_le32(&payload[4], TIMER_CLK_HZ);
+	for (unsigned int i = 0; i < num_values; i++) {
+		write_le32(&payload[8 + i * 4], values[i]);
+	}
+	send_response_with_payload(RESPONSE_BENCH, id, payload, 8 + num_values * 4);
+}
+
+static void bench_qspi_read(const jedec_nor_flash_read_t *read, uint32_t result[2]) {
+	uint32_t address = 0;
+	uint32_t bytes = 0;
+	uint32_t start = timer_clocks();
+
+	do {
+		flash_read_with(read, address, flash_read_buffer, sizeof(flash_read_buffer));
+		bytes += sizeof(flash_read_buffer);
+		address = (address + sizeof(flash_read_buffer)) % flash_info_g.size_bytes;
+		watchdog_reset();
+	} while (timer_clocks() - start < BENCH_CLOCKS);
+	result[0] = bytes;
+	result[1] = timer_clocks() - start;
+}
+
+static void bench_crc32(uint32_t result[2]) {
+	uint32_t bytes = 0;
+	uint32_t crc = crc32_init();
+	uint32_t start = timer_clocks();
+
+	do {
+		crc = crc32_update(crc, flash_read_buffer, sizeof(flash_read_buffer));
+		bytes += sizeof(flash_read_buffer);
+		watchdog_reset();
+	} while (timer_clocks() - start < BENCH_CLOCKS);
+	result[0] = bytes;
+	result[1] = timer_clocks() - start;
+}
+
+static void bench_memcpy(uint32_t result[2]) {
+	const unsigned int half = sizeof(flash_read_buffer) / 2;
+	uint32_t bytes = 0;
+	uint32_t start = timer_clocks();
+
+	do {
+		memcpy(flash_read_buffer, &flash_read_buffer[half], half);
+		memcpy(&flash_read_buffer[half], flash_read_buffer, half);
+		bytes += 2 * half;
+		watchdog_reset();
+	} while (timer_clocks() - start < BENCH_CLOCKS);
+	result[0] = bytes;
+	result[1] = timer_clocks() - start;
+}
+
+/*
+ * The len filler bytes between the usual header and the result are what is
+ * timed. The ring is drained first, the time ends when the last byte left
+ * the shift register.
+ */
+static void bench_uart_tx(uint32_t id, uint32_t len) {
+	uint8_t hdr[8] = { BENCH_UART_TX, 0, 0, 0 };
+	uint8_t filler[16];
+
+	write_le32(&hdr[4], TIMER_CLK_HZ);
+	memset(filler, 0x55, sizeof(filler));
+	send_response_with_payload_(RESPONSE_BENCH, id, sizeof(hdr) + len + 2 * 4);
+	uint32_t crc = crc32_update(crc32_init(), hdr, sizeof(hdr));
+	uart_tx_write(hdr, sizeof(hdr));
+	uart_tx_flush();
+
+	uint32_t start = timer_clocks();
+	for (uint32_t sent = 0; sent < len; sent += sizeof(filler)) {
+		unsigned int chunk = len - sent < sizeof(filler) ? len - sent : sizeof(filler);
+		crc = crc32_update(crc, filler, chunk);
+		uart_tx_write(filler, chunk);
+	}
+	uart_tx_flush();
+	uint32_t clocks = timer_clocks() - start;
+
+	crc = uart_tx_write_le32(crc, len);
+	crc = uart_tx_write_le32(crc, clocks);
+	uart_tx_write_le32(crc, crc32_final(crc));
+}
+
+/* Erases and programs a scratch sector, its content is lost */
+static bool bench_flash_write(uint32_t address, uint32_t result[4]) {
+	uint32_t start = timer_clocks();
+	if (!flash_erase_sector(address)) {
+		return false;
+	}
+	result[0] = timer_clocks() - start;
+
+	for (unsigned int i = 0; i < sizeof(flash_read_buffer); i++) {
+		flash_read_buffer[i] = i;
+	}
+	result[1] = 0;
+	result[2] = 0;
+	result[3] = 0;
+	for (uint32_t offset = 0; offset < WRITE_SECTOR_SIZE; offset += FLASH_PAGE_SIZE) {
+		start = timer_clocks();
+		if (!flash_program(address + offset, flash_read_buffer, FLASH_PAGE_SIZE)) {
+			return false;
+		}
+		uint32_t clocks = timer_clocks() - start;
+		result[1]++;
+		result[2] += clocks;
+		if (clocks > result[3]) {
+			result[3] = clocks;
+		}
+	}
+	return true;
+}
+
+/*
+ * Device side microbenchmarks, parameters are the benchmark and a 32 bit
+ * argument. Results are the benchmark, three reserved bytes, the timer
+ * clock frequency and benchmark specific 32 bit values, all little endian:
+ *   QSPI_READ (argument: read mode), CRC32, MEMCPY: bytes, clocks
+ *   UART_TX (argument: length): length filler bytes, bytes, clocks
+ *   FLASH_WRITE (argument: 4 KiB sector): erase clocks, pages, total and
+ *     maximum page program clocks
+ */
+static void call_bench_handler(const cmd_handler_t *handler, uint32_t id, const void *param_data, unsigned int param_len) {
+	const uint8_t *param8 = param_data;
+	uint8_t test = param8[0];
+	uint32_t arg = read_le32(&param8[1]);
+	uint32_t result[4];
+
+	switch (test) {
+	case BENCH_QSPI_READ: {
+		const jedec_nor_flash_read_t *read = &flash_read_legacy;
+		if (arg > JEDEC_NUM_FAST_READS || !flash_info_g.size_bytes ||
+		    (arg != BENCH_READ_LEGACY && !flash_info_g.fast_reads[arg - 1].opcode)) {
+			send_response(RESPONSE_INVALID_PARAM, id);
+			return;
+		}
+		if (arg != BENCH_READ_LEGACY) {
+			read = &flash_info_g.fast_reads[arg - 1];
+		}
+		bench_qspi_read(read, result);
+		send_bench_result(id, test, result, 2);
+		break;
+	}
+	case BENCH_CRC32:
+		bench_crc32(result);
+		send_bench_result(id, test, result, 2);
+		break;
+	case BENCH_MEMCPY:
+		bench_memcpy(result);
+		send_bench_result(id, test, result, 2);
+		break;
+	case BENCH_UART_TX:
+		if (!arg || arg > BENCH_UART_TX_MAX) {
+			send_response(RESPONSE_INVALID_PARAM, id);
+			return;
+		}
+		bench_uart_tx(id, arg);
+		break;
+	case BENCH_FLASH_WRITE:
+		if (arg % WRITE_SECTOR_SIZE || arg >= flash_info_g.size_bytes) {
+			send_response(RESPONSE_INVALID_PARAM, id);
+			return;
+		}
+		if (!bench_flash_write(arg, result)) {
+			send_response(RESPONSE_FLASH_TIMEOUT, id);
+			return;
+		}
+		send_bench_result(id, test, result, 4);
+		break;
+	default:
+		send_response(RESPONSE_INVALID_PARAM, id);
+		break;
+	}
+}
+
 static const cmd_handler_t cmd_handlers[] = {
 	[UART_CMD_PING] = {
 		.call = call_ping_handler,
@@ -861,25 +2100,77 @@ static const cmd_handler_t cmd_handlers[] = {
 		.call = call_chipid_handler,
 		.min_param_len = 0,
 	},
+	[UART_CMD_READ_FLASH_RLE] = {
+		.call = call_read_flash_rle_handler,
+		.min_param_len = 8,
+	},
+	[UART_CMD_PROGRAM_PAGE_RLE] = {
+		.call = call_program_page_rle_handler,
+		.min_param_len = 4 + 1,
+	},
+	[UART_CMD_BLANK_MAP] = {
+		.call = call_blank_map_handler,
+		.min_param_len = 12,
+	},
+	[UART_CMD_WRITE_SECTOR] = {
+		.call = call_write_sector_handler,
+		.min_param_len = WRITE_SECTOR_PARAM_LEN,
+		.stream_params = true,
+	},
+	[UART_CMD_ERASE] = {
+		.call = call_erase_handler,
+		.min_param_len = 5,
+	},
+	[UART_CMD_PROGRAM_PAGE_COND] = {
+		.call = call_program_page_cond_handler,
+		.min_param_len = 4 + FLASH_PAGE_SIZE,
+	},
+	[UART_CMD_PRBS] = {
+		.call = call_prbs_handler,
+		.min_param_len = 8,
+	},
+	[UART_CMD_READ_STREAM] = {
+		.call = call_read_stream_handler,
+		.min_param_len = READ_STREAM_PARAM_LEN,
+		.stream_params = true,
+	},
+	[UART_CMD_STREAM_ACK] = {
+		.call = call_stream_ack_handler,
+		.min_param_len = 8,
+	},
+	[UART_CMD_STATS] = {
+		.call = call_stats_handler,
+		.min_param_len = 0,
+	},
+	[UART_CMD_PROFILE] = {
+		.call = call_profile_handler,
+		.min_param_len = 0,
+	},
+	[UART_CMD_BENCH] = {
+		.call = call_bench_handler,
+		.min_param_len = 5,
+	},
+	[UART_CMD_CONFIRM_BAUDRATE] = {
+		.call = call_confirm_baudrate_handler,
+		.min_param_len = 0,
+	},
 };
 
 static void dispatch_cmd(const cmd_handler_t *handler, uint32_t id, const void *parameter_data, uint32_t parameter_len) {
+	uint32_t start = timer_clocks();
 	handler->call(handler, id, parameter_data, parameter_len);
+	stats_cmd_add(&cmd_stats[handler - cmd_handlers], start);
+	/* Link tests at slow baudrates outlast the confirm window, it restarts after every command */
+	baudrate_confirm_start = timer_now();
 }
 
 int main(void) {
 	uart_init();
-
-	DMAX_B_STARTL_REG(DMA_UART_TX) = (uint16_t)(uintptr_t)&UART_RX_TX_REG;
-	DMAX_B_STARTH_REG(DMA_UART_TX) = (uint16_t)((uint32_t)&UART_RX_TX_REG >> 16);
-	DMAX_CTRL_REG(DMA_UART_TX) =
-		DMAX_CTRL_REG_DMA_PRIO_LOW |
-		DMAX_CTRL_REG_AINC |
-		DMAX_CTRL_REG_DREQ_MODE |
-		DMAX_CTRL_REG_DINT_MODE |
-		DMAX_CTRL_REG_BW_BYTE;
-
+	uart_tx_init();
 	reset_uart_rx_dma();
+	/* After the UART, uart_init() overwrites the interrupt priorities */
+	timer_init();
+	profile_init();
 
 /*
 	uint8_t data[] = { 0xff, 0x42 };
@@ -935,10 +2226,15 @@ int main(void) {
 */
 	watchdog_reset();
 
+#ifdef LOADER_HOST
+	vector_table.svc_trap();
+#else
 	asm("excp svc");
+#endif
 	debug_puts("SVC call returned\r\n");
 
 	qspic_read_sfdp(&flash_info_g);
+	flash_verify_read_mode(&flash_info_g);
 	debug_puts("Flash size ");
 	debug_putlong(flash_info_g.size_bytes);
 	debug_puts(" bytes\r\n");
@@ -953,6 +2249,7 @@ int main(void) {
 	uart_puts("Bootrom2:\r\n");
 	uart_hexdump((void *)0xFEF000, 0x800);
 	uart_puts("\r\nBootrom dump complete\r\n");
+*/
 /*
 	for (unsigned int port = 0; port <= 7; port++) {
 		for (unsigned int pin = 0; pin < 8; pin++) {
@@ -990,7 +2287,7 @@ int main(void) {
 
 	UART_CLEAR_TX_INT_REG = 1;
 	DMAX_A_STARTL_REG(DMA_UART_TX) = (uint16_t)(uintptr_t)dma_test_string;
-	DMAX_A_STARTH_REG(DMA_UART_TX) = (uint16_t)((uint32_t)dma_test_string >> 16);
+	DMAX_A_STARTH_REG(DMA_UART_TX) = (uint16_t)((uintptr_t)dma_test_string >> 16);
 	DMAX_INT_REG(DMA_UART_TX) = strlen(dma_test_string) * 2;
 	DMAX_LEN_REG(DMA_UART_TX) = strlen(dma_test_string);
 	DMAX_CTRL_REG(DMA_UART_TX) |= DMAX_CTRL_REG_DMA_ON;
@@ -1022,8 +2319,8 @@ int main(void) {
 //				for (volatile unsigned int i = 0; i < 1000; i++);
 //				DMAX_CTRL_REG(DMA_UART_RX) &= ~DMAX_CTRL_REG_DMA_ON;
 //				while (DMAX_CTRL_REG(DMA_UART_RX) & DMAX_CTRL_REG_DMA_ON);
-				uint8_t *hdr = uart_get_read_ptr();
-				uart_advance_read_ptr(13);
+				uint8_t hdr[13];
+				uart_peek(hdr, 0, sizeof(hdr));
 				uint8_t cmd = hdr[0];
 				id = read_le32(&hdr[1]);
 				parameter_len = read_le32(&hdr[5]);
@@ -1038,22 +2335,34 @@ int main(void) {
 				debug_puts("\r\n");
 */
 				if (crc_check == crc) {
+					uart_advance_read_ptr(sizeof(hdr));
 					if (cmd < ARRAY_SIZE(cmd_handlers)) {
 						current_handler = &cmd_handlers[cmd];
-						if (parameter_len >= current_handler->min_param_len) {
-							timeout = TIMEOUT_PARAM;
-							cmd_state = CMD_STATE_WAIT_PARAM;
-						} else {
+						if (parameter_len < current_handler->min_param_len) {
 							timeout = TIMEOUT_HEADER;
 							cmd_state = CMD_STATE_WAIT_HEADER;
 							send_response(RESPONSE_PARAM_SHORT, id);
-							reset_uart_rx_dma();
+						} else if (current_handler->stream_params) {
+							if (parameter_len == current_handler->min_param_len) {
+								dispatch_cmd(current_handler, id, NULL, parameter_len);
+							} else {
+								send_response(RESPONSE_INVALID_PARAM, id);
+							}
+							timeout = TIMEOUT_HEADER;
+							cmd_state = CMD_STATE_WAIT_HEADER;
+						} else if (parameter_len > CMD_PARAM_MAX_LEN) {
+							/* Would never fit, parameters are skipped by header search */
+							timeout = TIMEOUT_HEADER;
+							cmd_state = CMD_STATE_WAIT_HEADER;
+							send_response(RESPONSE_INVALID_PARAM, id);
+						} else {
+							timeout = TIMEOUT_PARAM;
+							cmd_state = CMD_STATE_WAIT_PARAM;
 						}
 					} else {
 						timeout = TIMEOUT_HEADER;
 						cmd_state = CMD_STATE_WAIT_HEADER;
 						send_response(RESPONSE_CMD_INVALID, id);
-						reset_uart_rx_dma();
 					}
 				} else {
 					debug_puts("Invalid CRC32 on header ");
@@ -1064,10 +2373,13 @@ int main(void) {
 					debug_puts(" but received 0x");
 					debug_putlong_hex(crc);
 					debug_puts("\r\n");
+					/*
+					 * Header bytes are left in the buffer, the sync byte
+					 * may have been a stray 0xA5 in front of a real frame
+					 */
 					timeout = TIMEOUT_HEADER;
 					cmd_state = CMD_STATE_WAIT_HEADER;
 					send_response(RESPONSE_INVALID_CRC, id);
-					reset_uart_rx_dma();
 				}
 			}
 		}
@@ -1080,22 +2392,26 @@ int main(void) {
 	//				for (volatile unsigned int i = 0; i < 1000; i++);
 	//				DMAX_CTRL_REG(DMA_UART_RX) &= ~DMAX_CTRL_REG_DMA_ON;
 	//				while (DMAX_CTRL_REG(DMA_UART_RX) & DMAX_CTRL_REG_DMA_ON);
-					const uint8_t *read_ptr = uart_get_read_ptr();
-					uart_advance_read_ptr(parameter_len + 4);
+					uint8_t crc_buf[4];
+					uart_peek(crc_buf, parameter_len, sizeof(crc_buf));
 					uint32_t crc_check = crc32_init();
-					crc_check = crc32_update(crc_check, read_ptr, parameter_len);
+					crc_check = uart_rx_crc32_update(crc_check, parameter_len);
 					crc_check = crc32_final(crc_check);
-					uint32_t crc = read_le32(&read_ptr[parameter_len]);
+					uint32_t crc = read_le32(crc_buf);
 	//				DMAX_CTRL_REG(DMA_UART_RX) |= DMAX_CTRL_REG_DMA_ON;
 					if (crc_check == crc) {
+						/*
+						 * Parameters stay in the ring until the handler returned,
+						 * the host limits data in flight to not overwrite them.
+						 */
+						const uint8_t *read_ptr = uart_get_read_ptr(parameter_len);
 						dispatch_cmd(current_handler, id, read_ptr, parameter_len);
-						reset_uart_rx_dma();
+						uart_advance_read_ptr(parameter_len + 4);
 						cmd_state = CMD_STATE_WAIT_HEADER;
 						timeout = TIMEOUT_HEADER;
 					} else {
-						debug_puts("Invalid CRC32 on params ");
-						debug_hexdump(read_ptr, parameter_len + 4);
-						debug_puts("\r\n");
+						uart_advance_read_ptr(parameter_len + 4);
+						debug_puts("Invalid CRC32 on params\r\n");
 						debug_puts("Expected 0x");
 						debug_putlong_hex(crc_check);
 						debug_puts(" but received 0x");
@@ -1104,22 +2420,30 @@ int main(void) {
 						timeout = TIMEOUT_HEADER;
 						cmd_state = CMD_STATE_WAIT_HEADER;
 						send_response(RESPONSE_INVALID_CRC, id);
-						reset_uart_rx_dma();
 					}
 				}
 			} else {
 				dispatch_cmd(current_handler, id, NULL, 0);
-				reset_uart_rx_dma();
 				cmd_state = CMD_STATE_WAIT_HEADER;
 				timeout = TIMEOUT_HEADER;
 			}
 		}
 
+		if (baudrate_confirm_pending && timer_now() - baudrate_confirm_start >= TIMEOUT_BAUDRATE_CONFIRM) {
+			baudrate_confirm_pending = false;
+			debug_puts("Baudrate not confirmed, reverting\r\n");
+			uart_set_baudrate(baudrate_fallback);
+			reset_uart_rx_dma();
+			cmd_state = CMD_STATE_WAIT_HEADER;
+			timeout = TIMEOUT_HEADER;
+		}
+
 		if (timeout) {
 			timeout--;
 			watchdog_reset();
 		} else {
 			debug_puts("Timeout elapsed, resetting\r\n");
+			uart_tx_flush();
 			system_reset();
 		}
 	}
@@ -0,0 +1,45 @@
+#include "timer.h"
+
+#include "irq.h"
+
+static volatile uint32_t timer_ticks = 0;
+
+void timer_init(void) {
+	TIMER_CTRL_REG &= ~(TIMER_CTRL_REG_TIM0_CTRL | TIMER_CTRL_REG_CLK_CTRL0);
+	TIMER0_RELOAD_M_REG = TIMER0_RELOAD_M;
+	TIMER0_RELOAD_N_REG = TIMER0_RELOAD_N;
+	RESET_INT_PENDING_REG = RESET_INT_PENDING_REG_TIM0_INT_PEND;
+	/* Lowest priority, the UART interrupts must not wait for bookkeeping */
+	INT2_PRIORITY_REG &= ~INT2_PRIORITY_REG_TIM0_INT_PRIO_MASK;
+	INT2_PRIORITY_REG |= (1 << INT2_PRIORITY_REG_TIM0_INT_PRIO_SHIFT);
+	TIMER_CTRL_REG |= TIMER_CTRL_REG_TIM0_CTRL;
+}
+
+void timer_tim0_int(void) {
+	RESET_INT_PENDING_REG = RESET_INT_PENDING_REG_TIM0_INT_PEND;
+	timer_ticks++;
+}
+
+/* 32 bit reads are two accesses on the CR16C */
+uint32_t timer_now(void) {
+	irq_state_t irq = irq_save();
+	uint32_t ticks = timer_ticks;
+	irq_restore(irq);
+	return ticks;
+}
+
+uint32_t timer_clocks(void) {
+	irq_state_t irq = irq_save();
+	uint32_t ticks = timer_ticks;
+	uint16_t count = TIMER0_RELOAD_M_REG;
+	/* Reloaded while interrupts were off, the counter is read again in the new period */
+	if (SET_INT_PENDING_REG & RESET_INT_PENDING_REG_TIM0_INT_PEND) {
+		ticks++;
+		count = TIMER0_RELOAD_M_REG;
+	}
+	irq_restore(irq);
+	if (count > TIMER0_RELOAD_M) {
+		count = TIMER0_RELOAD_M;
+	}
+	return ticks * TIMER_TICK_CLKS + (TIMER0_RELOAD_M - count);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "util.h"
+
+/* Layout of the SC14450 timer block, the SC14441 has the same one */
+#define TIMER_CTRL_REG			MMIO16(0xFF4C02)
+#define TIMER_CTRL_REG_TIM0_CTRL	(1 << 0)
+#define TIMER_CTRL_REG_TIM1_CTRL	(1 << 1)
+/* Clear: timers run from the 1.152 MHz DECT clock, set: from the system clock */
+#define TIMER_CTRL_REG_CLK_CTRL0	(1 << 2)
+#define TIMER_CTRL_REG_CLK_CTRL1	(1 << 3)
+#define TIMER0_ON_REG			MMIO16(0xFF4C04)
+#define TIMER0_RELOAD_M_REG		MMIO16(0xFF4C06)
+#define TIMER0_RELOAD_N_REG		MMIO16(0xFF4C08)
+#define TIMER1_RELOAD_M_REG		MMIO16(0xFF4C0A)
+#define TIMER1_RELOAD_N_REG		MMIO16(0xFF4C0C)
+
+#define TIMER_CLK_HZ			1152000UL
+
+/*
+ * TIM0 counts down RELOAD_M + 1 clocks, then RELOAD_N + 1 clocks, and
+ * interrupts once per period. Reads of TIMER0_RELOAD_M_REG return the
+ * counter of the M phase, with a single clock N phase that gives the
+ * position within the period. The interrupt only counts the high bits, a
+ * 1152 clock period makes an even 1 kHz tick.
+ */
+#define TIMER_TICK_HZ			1000UL
+#define TIMER_TICK_CLKS			(TIMER_CLK_HZ / TIMER_TICK_HZ)
+#define TIMER0_RELOAD_M			(TIMER_TICK_CLKS - 2)
+#define TIMER0_RELOAD_N			0
+#define TIMER_MS_TO_TICKS(ms)		((ms) * TIMER_TICK_HZ / 1000)
+
+void timer_init(void);
+/* TIM0 interrupt handler, see vector_table */
+void timer_tim0_int(void);
+/* Ticks of TIMER_TICK_HZ since timer_init(), wraps after about 49 days */
+uint32_t timer_now(void);
+/* Clocks of TIMER_CLK_HZ since timer_init(), for short intervals. Wraps after about an hour */
+uint32_t timer_clocks(void);
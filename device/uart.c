@@ -9,7 +9,8 @@
 void uart_init(void) {
 	P0_DIR_REG |= 0x03;
 	P0_MODE_REG |= 0x01;
-	UART_CTRL_REG = UART_CTRL_REG_UART_TEN | UART_CTRL_REG_UART_REN;
+	/* Keeps the baudrate of the boot stage, 9600 after the ROM, see stage0.c */
+	UART_CTRL_REG = (UART_CTRL_REG & UART_CTRL_REG_BAUDRATE_MASK) | UART_CTRL_REG_UART_TEN | UART_CTRL_REG_UART_REN;
 
 //	INT0_PRIORITY_REG = 0x2222;
 //	INT1_PRIORITY_REG = 0x2222;
@@ -49,6 +50,17 @@ bool uart_is_baudrate_attainable(unsigned long baudrate) {
 	return !!get_config_for_baudrate(baudrate);
 }
 
+unsigned long uart_get_baudrate(void) {
+	unsigned int uart_ctrl = UART_CTRL_REG & UART_CTRL_REG_BAUDRATE_MASK;
+	for (unsigned int i = 0; i < ARRAY_SIZE(supported_baudrates); i++) {
+		if (supported_baudrates[i].uart_ctrl == uart_ctrl) {
+			return supported_baudrates[i].baudrate;
+		}
+	}
+
+	return 0;
+}
+
 void uart_set_baudrate(unsigned long baudrate) {
 	const uart_baudrate_config_t *cfg = get_config_for_baudrate(baudrate);
 	unsigned int uart_enable = UART_CTRL_REG & (UART_CTRL_REG_UART_TEN | UART_CTRL_REG_UART_REN);
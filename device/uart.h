@@ -26,6 +26,7 @@
 
 void uart_init(void);
 bool uart_is_baudrate_attainable(unsigned long baudrate);
+unsigned long uart_get_baudrate(void);
 void uart_set_baudrate(unsigned long baudrate);
 void uart_putc(char c);
 void uart_puts(const char *str);
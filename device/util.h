@@ -2,9 +2,17 @@
 
 #include <stdint.h>
 
+#ifdef LOADER_HOST
+#include "host/mmio_host.h"
+
+#define MMIO16(addr) (*((volatile uint16_t*)mmio_host_access((addr), sizeof(uint16_t))))
+#define MMIO32(addr) (*((volatile uint32_t*)mmio_host_access((addr), sizeof(uint32_t))))
+#define MMIO8(addr) (*((volatile uint8_t*)mmio_host_access((addr), sizeof(uint8_t))))
+#else
 #define MMIO16(addr) (*((volatile uint16_t*)(addr)))
 #define MMIO32(addr) (*((volatile uint32_t*)(addr)))
 #define MMIO8(addr) (*((volatile uint8_t*)(addr)))
+#endif
 
 #define ARRAY_SIZE(x_) (sizeof(x_) / sizeof(*(x_)))
 
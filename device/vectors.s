@@ -40,6 +40,13 @@ vector\start:
 	loadd 0x00(r1, r0), (r3, r2)
 	addd $1, (r3, r2)
 	stord (r3, r2), 0x0(r1, r0)
+.endif
+.if \start == 24
+	/* TIM1 drives the profiler, hand it the interrupted PC. See profile.c */
+	sprd isp, (r1, r0)
+	loadd 0x00(r1, r0), (r3, r2)
+	movd $_profile_irq_pc, (r1, r0)
+	stord (r3, r2), 0x0(r1, r0)
 .endif
 	movd $\offset, (r1, r0)
 	br vector_common
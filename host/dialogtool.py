@@ -1,12 +1,21 @@
 #!/usr/bin/env python3
 
 from argparse import ArgumentParser
+import bisect
+from collections import deque
+from contextlib import closing
+from datetime import datetime, timezone
+import hashlib
+import json
+import mmap
 import os
+import queue
+import random
 import serial
 import struct
 import sys
 import threading
-from time import sleep
+from time import monotonic, sleep
 from zlib import crc32
 
 class Bootrom():
@@ -27,18 +36,23 @@ class Bootrom():
 	def __exit__(self, *kwargs):
 		self.serial.close()
 
+	def set_modem_lines(self, rts, dtr):
+		# Plain USB-UART adapters and ptys (loader_sim.py) have no modem control
+		try:
+			self.serial.rts = rts
+			self.serial.dtr = dtr
+		except OSError:
+			pass
+
 	def reset(self):
-		self.serial.rts = True
-		self.serial.dtr = False
+		self.set_modem_lines(True, False)
 		sleep(0.1)
-		self.serial.rts = False
+		self.set_modem_lines(False, False)
 
 	def uart_boot(self, payload):
-		self.serial.rts = True
-		self.serial.dtr = False
+		self.set_modem_lines(True, False)
 		sleep(0.1)
-		self.serial.dtr = True
-		self.serial.rts = False
+		self.set_modem_lines(False, True)
 
 		print(f"Will send {len(payload)} bytes to SC14441 bootloader")
 		while True:
@@ -80,7 +94,10 @@ class Bootrom():
 		for byt in payload:
 			checksum ^= byt
 
+		# The payload may still be on its way, at 9600 baud that takes seconds
+		self.serial.timeout = 1 + len(payload) * 10 / self.serial.baudrate
 		byts = self.serial.read(1)
+		self.serial.timeout = 1
 		if len(byts) < 1:
 			print("Timed out waiting for response to payload")
 			return False
@@ -97,6 +114,68 @@ class Bootrom():
 		with open(file, 'rb') as f:
 			return self.uart_boot(f.read())
 
+	def uart_boot_staged(self, stage0, loader, baudrate, compress=True):
+		"""
+		Upload stage0 through the ROM, then the loader through stage 0 at
+		baudrate. The loader keeps running at that baudrate. False if stage 0
+		rejected the loader, the chip needs to be reset then.
+		"""
+		if not self.uart_boot(stage0):
+			return False
+
+		ready = self.serial.read(1)
+		if ready != bytes([ Stage0.READY ]):
+			print("Stage 0 did not report ready")
+			return False
+
+		flags = 0
+		payload = loader
+		if compress:
+			encoded = rle_encode(loader)
+			if len(encoded) < len(loader):
+				flags |= Stage0.FLAG_RLE
+				payload = encoded
+		hdr = struct.pack("<BBHL", Stage0.BAUDRATES.index(baudrate), flags, len(loader), crc32(loader))
+		self.serial.write(hdr + crc32(hdr).to_bytes(4, byteorder="little"))
+		ack = self.serial.read(1)
+		if ack != bytes([ Bootrom.ACK ]):
+			print("Stage 0 refused loader header")
+			return False
+
+		self.serial.baudrate = baudrate
+		print(f"Sending {len(payload)} byte loader at {baudrate} baud")
+		self.serial.write(payload)
+		self.serial.timeout = 1 + len(payload) * 10 / baudrate
+		ack = self.serial.read(1)
+		self.serial.timeout = 1
+		if ack != bytes([ Bootrom.ACK ]):
+			print("Stage 0 failed to receive loader")
+			return False
+		print("Loader received, starting it")
+		return True
+
+	def uart_boot_staged_file(self, stage0_file, loader_file, baudrate):
+		with open(stage0_file, 'rb') as f:
+			stage0 = f.read()
+		with open(loader_file, 'rb') as f:
+			return self.uart_boot_staged(stage0, f.read(), baudrate)
+
+class Stage0():
+	"""Constants of device/stage0.c"""
+	READY = 0x53
+	FLAG_RLE = 0x01
+	# Index is the baudrate code sent to stage 0, see UART_CTRL_REG_BAUDRATE_* in device/uart.h
+	BAUDRATES = [ 9600, 19200, 57600, 115200, 230400 ]
+	# Used with -b auto, negotiation continues from there
+	DEFAULT_BAUDRATE = 115200
+
+	@staticmethod
+	def baudrate_for(baudrate):
+		"""Fastest baudrate stage 0 supports up to the requested one"""
+		if baudrate == "auto":
+			return Stage0.DEFAULT_BAUDRATE
+		return max([ rate for rate in Stage0.BAUDRATES if rate <= baudrate ], default=Bootrom.BAUDRATE)
+
 class Command():
 	def __init__(self, cmd):
 		self.cmd = cmd
@@ -124,10 +203,18 @@ class Command():
 	def get_timeout(self, baudrate):
 		return 1
 
+	def encoded_length(self):
+		payload = self.get_payload()
+		if not payload:
+			return 14
+		return 14 + len(payload) + 4
+
 class DispatchedCommand():
 	def __init__(self, cmd, id):
 		self.cmd = cmd
 		self.id = id
+		# Filled by the listener thread, some commands get more than one response
+		self.responses = queue.SimpleQueue()
 
 	def encode(self):
 		return self.cmd.encode(self.id)
@@ -155,6 +242,49 @@ class ReadFlashCommand(Command):
 	def __repr__(self):
 		return f"ReadFlash(0x{self.start_address:08x}, {self.length})"
 
+class ReadFlashRleCommand(ReadFlashCommand):
+	def __init__(self, start_address, length):
+		super().__init__(start_address, length)
+		self.cmd = 0x09
+
+	def __repr__(self):
+		return f"ReadFlashRle(0x{self.start_address:08x}, {self.length})"
+
+class ReadStreamCommand(Command):
+	def __init__(self, start_address, length, block_size, credits):
+		super().__init__(0x10)
+		self.start_address = start_address
+		self.length = length
+		self.block_size = block_size
+		self.credits = credits
+
+	def get_payload(self):
+		return struct.pack("<LLLL", self.start_address, self.length, self.block_size, self.credits)
+
+	def get_timeout(self, baudrate):
+		# Time without any block arriving before the stream counts as stalled
+		base = super().get_timeout(baudrate)
+		return base + 0.5 + 2 * self.block_size * self.credits / (baudrate / 10)
+
+	def __repr__(self):
+		return f"ReadStream(0x{self.start_address:08x}, {self.length}, blocks of {self.block_size})"
+
+class StreamAckCommand(Command):
+	ABORT = 0xFFFFFFFF
+	NAK_NONE = 0xFFFFFFFF
+
+	def __init__(self, ack, nak=NAK_NONE):
+		super().__init__(0x11)
+		self.ack = ack
+		self.nak = nak
+
+	def get_payload(self):
+		return struct.pack("<LL", self.ack, self.nak)
+
+	def __repr__(self):
+		nak = "" if self.nak == StreamAckCommand.NAK_NONE else f", NAK {self.nak}"
+		return f"StreamAck({self.ack}{nak})"
+
 class SetBaudrateCommand(Command):
 	def __init__(self, baudrate):
 		super().__init__(0x01)
@@ -163,6 +293,27 @@ class SetBaudrateCommand(Command):
 	def get_payload(self):
 		return struct.pack("<L", self.baudrate)
 
+class ConfirmBaudrateCommand(Command):
+	def __init__(self):
+		super().__init__(0x15)
+
+class PrbsCommand(Command):
+	def __init__(self, seed, length, pattern_length=0):
+		super().__init__(0x0F)
+		self.seed = seed
+		self.length = length
+		self.pattern_length = pattern_length
+
+	def get_payload(self):
+		return struct.pack("<LL", self.seed, self.length) + prbs_bytes(self.seed, self.pattern_length)
+
+	def get_timeout(self, baudrate):
+		base = super().get_timeout(baudrate)
+		return base + 2 * (self.length + self.pattern_length) / (baudrate / 10)
+
+	def __repr__(self):
+		return f"Prbs(0x{self.seed:08x}, {self.length})"
+
 class EraseFlashSectorCommand(Command):
 	def __init__(self, address):
 		super().__init__(0x03)
@@ -178,6 +329,22 @@ class EraseFlashSectorCommand(Command):
 	def __repr__(self):
 		return f"EraseFlashSector(0x{self.address:08x})"
 
+class EraseCommand(Command):
+	def __init__(self, address, erase_type):
+		super().__init__(0x0D)
+		self.address = address
+		self.erase_type = erase_type
+
+	def get_payload(self):
+		return struct.pack("<LB", self.address, self.erase_type.index)
+
+	def get_timeout(self, baudrate):
+		base = super().get_timeout(baudrate)
+		return base + self.erase_type.max_seconds() + 0.5
+
+	def __repr__(self):
+		return f"Erase(0x{self.address:08x}, {self.erase_type.size // 1024} KiB)"
+
 class ProgramFlashPageCommand(Command):
 	def __init__(self, start_address, data):
 		super().__init__(0x04)
@@ -194,13 +361,66 @@ class ProgramFlashPageCommand(Command):
 	def __repr__(self):
 		return f"ProgramFlashPage(0x{self.start_address:08x})"
 
+class ProgramFlashPageCondCommand(ProgramFlashPageCommand):
+	def __init__(self, start_address, data):
+		super().__init__(start_address, data)
+		self.cmd = 0x0E
+
+	def __repr__(self):
+		return f"ProgramFlashPageCond(0x{self.start_address:08x})"
+
+class ProgramFlashPageRleCommand(ProgramFlashPageCommand):
+	def __init__(self, start_address, data, encoded=None):
+		super().__init__(start_address, data)
+		self.cmd = 0x0A
+		self.encoded = encoded if encoded is not None else rle_encode(data)
+
+	def get_payload(self):
+		return struct.pack("<L", self.start_address) + self.encoded
+
+	def __repr__(self):
+		return f"ProgramFlashPageRle(0x{self.start_address:08x}, {len(self.encoded)}/{len(self.data)} bytes)"
+
+class WriteSectorCommand(Command):
+	SECTOR_SIZE = 0x1000
+	PAGE_SIZE = 256
+	# Sync byte, header, address and address CRC
+	HEADER_LENGTH = 14 + 8
+	PAGE_RECORD_LENGTH = PAGE_SIZE + 4
+
+	def __init__(self, address, data, rx_buffer_size):
+		super().__init__(0x0C)
+		self.address = address
+		# Bounds the pages in flight, see LoaderSession.write_sector()
+		self.rx_buffer_size = rx_buffer_size
+		# A short tail stays erased
+		self.data = data.ljust(WriteSectorCommand.SECTOR_SIZE, b'\xff')
+
+	def get_payload(self):
+		address = struct.pack("<L", self.address)
+		payload = address + crc32(address).to_bytes(4, byteorder="little")
+		for offset in range(0, WriteSectorCommand.SECTOR_SIZE, WriteSectorCommand.PAGE_SIZE):
+			page = self.data[offset:offset + WriteSectorCommand.PAGE_SIZE]
+			payload += page + crc32(page).to_bytes(4, byteorder="little")
+		return payload
+
+	def get_timeout(self, baudrate):
+		base = super().get_timeout(baudrate)
+		return base + 0.5 + 2 * self.rx_buffer_size / (baudrate / 10)
+
+	def __repr__(self):
+		return f"WriteSector(0x{self.address:08x})"
+
 class RemoteFlashChecksumCommand(Command):
-	def __init__(self, start_address, length):
+	def __init__(self, start_address, length, block_size=None):
 		super().__init__(0x07)
 		self.start_address = start_address
 		self.length = length
+		self.block_size = block_size
 
 	def get_payload(self):
+		if self.block_size:
+			return struct.pack("<LLL", self.start_address, self.length, self.block_size)
 		return struct.pack("<LL", self.start_address, self.length)
 
 	def get_timeout(self, baudrate):
@@ -208,8 +428,27 @@ class RemoteFlashChecksumCommand(Command):
 		return base + self.length * 8 / 100000
 
 	def __repr__(self):
+		if self.block_size:
+			return f"RemoteFlashChecksum(0x{self.start_address:08x}, {self.length}, blocks of {self.block_size})"
 		return f"RemoteFlashChecksum(0x{self.start_address:08x}, {self.length})"
 
+class BlankMapCommand(Command):
+	def __init__(self, start_address, length, block_size):
+		super().__init__(0x0B)
+		self.start_address = start_address
+		self.length = length
+		self.block_size = block_size
+
+	def get_payload(self):
+		return struct.pack("<LLL", self.start_address, self.length, self.block_size)
+
+	def get_timeout(self, baudrate):
+		base = super().get_timeout(baudrate)
+		return base + self.length * 8 / 100000
+
+	def __repr__(self):
+		return f"BlankMap(0x{self.start_address:08x}, {self.length}, {self.block_size})"
+
 class FlashInfoCommand(Command):
 	def __init__(self):
 		super().__init__(0x02)
@@ -224,18 +463,77 @@ class ChipIdCommand(Command):
 	def __repr__(self):
 		return f"ChipId()"
 
+class StatsCommand(Command):
+	FLAG_RESET = 0x01
+
+	def __init__(self, reset=False):
+		super().__init__(0x12)
+		self.reset = reset
+
+	def get_payload(self):
+		if self.reset:
+			return bytes([ StatsCommand.FLAG_RESET ])
+		return None
+
+	def __repr__(self):
+		return f"Stats(reset={self.reset})"
+
+class ProfileCommand(Command):
+	FLAG_START = 0x01
+	FLAG_STOP = 0x02
+	FLAG_CLEAR = 0x04
+
+	def __init__(self, flags=0):
+		super().__init__(0x13)
+		self.flags = flags
+
+	def get_payload(self):
+		if self.flags:
+			return bytes([ self.flags ])
+		return None
+
+	def __repr__(self):
+		return f"Profile(0x{self.flags:02x})"
+
+class BenchCommand(Command):
+	QSPI_READ = 0x00
+	CRC32 = 0x01
+	MEMCPY = 0x02
+	UART_TX = 0x03
+	FLASH_WRITE = 0x04
+	# Argument of QSPI_READ, 1 + index of the SFDP fast read mode otherwise
+	READ_LEGACY = 0
+	NUM_FAST_READS = 4
+
+	def __init__(self, test, arg=0):
+		super().__init__(0x14)
+		self.test = test
+		self.arg = arg
+
+	def get_payload(self):
+		return struct.pack("<BL", self.test, self.arg)
+
+	def get_timeout(self, baudrate):
+		base = super().get_timeout(baudrate)
+		if self.test == BenchCommand.UART_TX:
+			return base + 2 * self.arg / (baudrate / 10)
+		if self.test == BenchCommand.FLASH_WRITE:
+			# Sector erase plus 16 page programs at their worst case
+			return base + 5
+		return base
+
+	def __repr__(self):
+		return f"Bench({self.test}, 0x{self.arg:08x})"
+
 class ResponseHeader():
 	LENGTH = 13
 
 	@staticmethod
-	def parse(data):
-		if len(data) != ResponseHeader.LENGTH:
-			return None
-		(response, id, length, checksum) = struct.unpack("<BLLL", data)
-		checksum_check = crc32(b'\xA5' + data[:-4])
-		if checksum != checksum_check:
-			print(data.hex())
-			print(f"Corrupted header, checksum incorrect (expected 0x{checksum_check:08x}, but got 0x{checksum:08x})")
+	def parse(data, offset=0):
+		"""Header of the frame whose sync byte is at data[offset], None if its checksum is wrong"""
+		(response, id, length, checksum) = struct.unpack_from("<BLLL", data, offset + 1)
+		# Covers the sync byte as well, a false sync byte fails this check
+		if checksum != crc32(data[offset:offset + ResponseHeader.LENGTH - 3]):
 			return None
 		return ResponseHeader(response, id, length)
 
@@ -254,19 +552,27 @@ class Response():
 			DebugResponse: DebugResponse.RESPONSE_CODES,
 			ChecksumResponse: ChecksumResponse.RESPONSE_CODES,
 			FlashInfoResponse: FlashInfoResponse.RESPONSE_CODES,
-			ChipIdResponse: ChipIdResponse.RESPONSE_CODES
+			ChipIdResponse: ChipIdResponse.RESPONSE_CODES,
+			FlashDataRleResponse: FlashDataRleResponse.RESPONSE_CODES,
+			BlankMapResponse: BlankMapResponse.RESPONSE_CODES,
+			ProgramResultResponse: ProgramResultResponse.RESPONSE_CODES,
+			PrbsResponse: PrbsResponse.RESPONSE_CODES,
+			StreamBlockResponse: StreamBlockResponse.RESPONSE_CODES,
+			StatsResponse: StatsResponse.RESPONSE_CODES,
+			ProfileResponse: ProfileResponse.RESPONSE_CODES,
+			BenchResponse: BenchResponse.RESPONSE_CODES
 		}
 		payload = b''
 		if data:
 			if len(data) != header.payload_length_with_crc:
 				return None
-			payload = data[:-4]
 			checksum = int.from_bytes(data[-4:], byteorder='little')
-			checksum_check = crc32(payload)
+			checksum_check = crc32(data[:-4])
 			if checksum != checksum_check:
-				print(f"Corrupted header, checksum incorrect (expected 0x{checksum_check:08x}, but got 0x{checksum:08x})")
-				print(payload)
+				print(f"Corrupted payload, checksum incorrect (expected 0x{checksum_check:08x}, but got 0x{checksum:08x})")
 				return None
+			# The only copy of the payload, data may be a view of the receive buffer
+			payload = bytes(data[:-4])
 
 		for (resp_type, response_codes) in RESPONSE_CODE_MAP.items():
 			if header.response in response_codes:
@@ -318,28 +624,66 @@ class ChecksumResponse(Response):
 
 	@classmethod
 	def validate(self, payload):
-		return len(payload) == 4
+		return len(payload) >= 4 and len(payload) % 4 == 0
 
 	def __init__(self, header, payload):
 		super().__init__(header, payload)
-		self.checksum = struct.unpack("<L", payload)[0]
+		# One checksum per block if a block size was requested
+		self.checksums = [ checksum for (checksum, ) in struct.iter_unpack("<L", payload) ]
+		self.checksum = self.checksums[0]
 
 	def __repr__(self):
+		if len(self.checksums) > 1:
+			return f"ChecksumResponse to 0x{self.header.id:04x}, {len(self.checksums)} block checksums"
 		return f"ChecksumResponse to 0x{self.header.id:04x}, checksum 0x{self.checksum:08x}"
 
+class EraseType():
+	# Rough typical erase times of common SPI NOR flash, used if SFDP does not specify them
+	DEFAULT_TYP_MS = { 12: 50, 15: 150, 16: 250 }
+
+	def __init__(self, index, size_exponent, opcode, typ_ms, max_ms):
+		self.index = index
+		self.size = 1 << size_exponent
+		self.size_exponent = size_exponent
+		self.opcode = opcode
+		self.typ_ms = typ_ms
+		self.max_ms = max_ms
+
+	def typ_seconds(self):
+		if self.typ_ms:
+			return self.typ_ms / 1000
+		return EraseType.DEFAULT_TYP_MS.get(self.size_exponent, self.size // 4096 * 50) / 1000
+
+	def max_seconds(self):
+		if self.max_ms:
+			return self.max_ms / 1000
+		return self.typ_seconds() * 4
+
+	def __repr__(self):
+		times = f", typ {self.typ_ms} ms, max {self.max_ms} ms" if self.typ_ms else ""
+		return f"{self.size // 1024} KiB (opcode 0x{self.opcode:02x}{times})"
+
 class FlashInfoResponse(Response):
 	RESPONSE_CODES = [ 0x0A ]
+	ERASE_TYPE_LENGTH = 6
 
 	@classmethod
 	def validate(self, payload):
-		return len(payload) == 4
+		# Older loaders only report the flash size
+		return len(payload) >= 4 and (len(payload) - 4) % FlashInfoResponse.ERASE_TYPE_LENGTH == 0
 
 	def __init__(self, header, payload):
 		super().__init__(header, payload)
-		self.flash_size_bytes = struct.unpack("<L", payload)[0]
+		self.flash_size_bytes = struct.unpack("<L", payload[:4])[0]
+		self.erase_types = [ ]
+		for (index, offset) in enumerate(range(4, len(payload), FlashInfoResponse.ERASE_TYPE_LENGTH)):
+			(size_exponent, opcode, typ_ms, max_ms) = struct.unpack("<BBHH", payload[offset:offset + FlashInfoResponse.ERASE_TYPE_LENGTH])
+			if size_exponent:
+				self.erase_types.append(EraseType(index, size_exponent, opcode, typ_ms, max_ms))
 
 	def __repr__(self):
-		return f"FlashInfoResponse to 0x{self.header.id:04x}, flash size {self.flash_size_bytes} bytes"
+		erase_types = "".join(f", erase {erase_type}" for erase_type in self.erase_types)
+		return f"FlashInfoResponse to 0x{self.header.id:04x}, flash size {self.flash_size_bytes} bytes{erase_types}"
 
 class ChipIdResponse(Response):
 	RESPONSE_CODES = [ 0x0B ]
@@ -363,15 +707,538 @@ class ChipIdResponse(Response):
 			f"chip id: '{chr(self.id1)}{chr(self.id2)}{chr(self.id3)}'(0x{self.id1:02x}{self.id2:02x}{self.id3:02x}), " + \
 			f"mem size: 0x{self.mem_size:02x}, revision: {revision_major}x{revision_minor}(0x{self.revision:02x})"
 
+def rle_encode(data):
+	"""Same encoding as the loader's rle_encode(), see device/rle.h for the format"""
+	out = bytearray()
+	literal = bytearray()
+
+	def flush_literal():
+		if literal:
+			out.append(len(literal) - 1)
+			out.extend(literal)
+			literal.clear()
+
+	pos = 0
+	while pos < len(data):
+		run = 1
+		while pos + run < len(data) and data[pos + run] == data[pos] and run < 0xFFFF:
+			run += 1
+		if run < 3:
+			for byt in data[pos:pos + run]:
+				literal.append(byt)
+				if len(literal) == 128:
+					flush_literal()
+		else:
+			flush_literal()
+			if run <= 129:
+				out += bytes([ 0x80 + run - 3, data[pos] ])
+			else:
+				out += bytes([ 0xFF, run & 0xff, run >> 8, data[pos] ])
+		pos += run
+	flush_literal()
+	return bytes(out)
+
+def rle_decode(data):
+	"""Inverse of the loader's rle_encode(), None if data is truncated"""
+	out = bytearray()
+	pos = 0
+	while pos < len(data):
+		ctrl = data[pos]
+		pos += 1
+		if ctrl < 0x80:
+			literal = data[pos:pos + ctrl + 1]
+			if len(literal) != ctrl + 1:
+				return None
+			out += literal
+			pos += ctrl + 1
+		elif ctrl < 0xFF:
+			if pos + 1 > len(data):
+				return None
+			out += data[pos:pos + 1] * (ctrl - 0x80 + 3)
+			pos += 1
+		else:
+			if pos + 3 > len(data):
+				return None
+			count = data[pos] | data[pos + 1] << 8
+			out += data[pos + 2:pos + 3] * count
+			pos += 3
+	return bytes(out)
+
+class FlashDataRleResponse(Response):
+	RESPONSE_CODES = [ 0x0C ]
+
+	def __init__(self, header, payload):
+		super().__init__(header, payload)
+		self.data = rle_decode(payload)
+
+	def __repr__(self):
+		decoded = "undecodable" if self.data is None else f"{len(self.data)} bytes decoded"
+		return f"FlashDataRleResponse to 0x{self.header.id:04x}, {len(self.payload)} bytes of data, {decoded}"
+
+class BlankMapResponse(Response):
+	RESPONSE_CODES = [ 0x0D ]
+
+	def __init__(self, header, payload):
+		super().__init__(header, payload)
+
+	def is_blank(self, block):
+		return bool(self.payload[block // 8] & (1 << (block % 8)))
+
+	def __repr__(self):
+		blank = sum(bin(byt).count("1") for byt in self.payload)
+		return f"BlankMapResponse to 0x{self.header.id:04x}, {blank} blank blocks"
+
+def plan_erase(start, end, erase_types):
+	"""
+	Cover the sector aligned range [start, end) with as few erases as possible.
+	Uses the largest erase type that is aligned at the current address and
+	fits the remaining range, returns a list of (address, EraseType).
+	"""
+	erase_types = sorted((erase_type for erase_type in erase_types if erase_type.size >= 0x1000),
+		key=lambda erase_type: erase_type.size, reverse=True)
+	plan = [ ]
+	address = start
+	while address < end:
+		for erase_type in erase_types:
+			if address % erase_type.size == 0 and address + erase_type.size <= end:
+				plan.append((address, erase_type))
+				address += erase_type.size
+				break
+		else:
+			return None
+	return plan
+
+def describe_erase_plan(plan):
+	counts = { }
+	for (address, erase_type) in plan:
+		counts[erase_type.size] = counts.get(erase_type.size, 0) + 1
+	ops = ", ".join(f"{count} x {size // 1024} KiB" for (size, count) in sorted(counts.items(), reverse=True))
+	seconds = sum(erase_type.typ_seconds() for (address, erase_type) in plan)
+	return f"{ops}, estimated {seconds:.1f} s"
+
+class ProgramResultResponse(Response):
+	RESPONSE_CODES = [ 0x0E ]
+	PROGRAMMED = 0x00
+	UNCHANGED = 0x01
+	NEEDS_ERASE = 0x02
+
+	@classmethod
+	def validate(self, payload):
+		return len(payload) == 1
+
+	def __init__(self, header, payload):
+		super().__init__(header, payload)
+		self.result = payload[0]
+
+	def __repr__(self):
+		result = { ProgramResultResponse.PROGRAMMED: "programmed", ProgramResultResponse.UNCHANGED: "unchanged",
+			ProgramResultResponse.NEEDS_ERASE: "needs erase" }.get(self.result, f"unknown result {self.result}")
+		return f"ProgramResultResponse to 0x{self.header.id:04x}, {result}"
+
+def prbs_bytes(seed, length):
+	"""xorshift32 sequence of the loader's PRBS command, four little endian bytes per step"""
+	state = seed
+	data = bytearray()
+	while len(data) < length:
+		state ^= (state << 13) & 0xffffffff
+		state ^= state >> 17
+		state ^= (state << 5) & 0xffffffff
+		data += struct.pack("<L", state)
+	return bytes(data[:length])
+
+class PrbsResponse(Response):
+	RESPONSE_CODES = [ 0x0F ]
+
+	def __init__(self, header, payload):
+		super().__init__(header, payload)
+
+	def __repr__(self):
+		return f"PrbsResponse to 0x{self.header.id:04x}, {len(self.payload)} bytes"
+
+class StreamBlockResponse(Response):
+	RESPONSE_CODES = [ 0x10 ]
+
+	@classmethod
+	def validate(self, payload):
+		return len(payload) >= 4
+
+	def __init__(self, header, payload):
+		super().__init__(header, payload)
+		self.seq = struct.unpack("<L", payload[:4])[0]
+		self.data = payload[4:]
+
+	def __repr__(self):
+		return f"StreamBlockResponse to 0x{self.header.id:04x}, block {self.seq}, {len(self.data)} bytes"
+
+class StatsResponse(Response):
+	RESPONSE_CODES = [ 0x11 ]
+	# Same order as stats_time_t in device/stats.h
+	TIMES = [ "QSPI busy", "UART TX stall", "Flash WIP wait" ]
+	COMMAND_NAMES = [ "PING", "SET_BAUDRATE", "FLASH_INFO", "ERASE_SECTOR", "PROGRAM_PAGE", "RESET",
+		"READ_FLASH", "CHECKSUM", "CHIPID", "READ_FLASH_RLE", "PROGRAM_PAGE_RLE", "BLANK_MAP",
+		"WRITE_SECTOR", "ERASE", "PROGRAM_PAGE_COND", "PRBS", "READ_STREAM", "STREAM_ACK", "STATS", "PROFILE", "BENCH",
+		"CONFIRM_BAUDRATE" ]
+
+	@classmethod
+	def validate(self, payload):
+		return len(payload) >= 4 * (3 + len(StatsResponse.TIMES)) and \
+			(len(payload) - 4 * (3 + len(StatsResponse.TIMES))) % 12 == 0
+
+	def __init__(self, header, payload):
+		super().__init__(header, payload)
+		# Uptime is counted in ticks, everything else in the finer timer clocks
+		(self.tick_hz, uptime_ticks, self.clock_hz) = struct.unpack_from("<LLL", payload)
+		self.uptime = uptime_ticks / self.tick_hz
+		offset = 12
+		self.times = { }
+		for name in StatsResponse.TIMES:
+			self.times[name] = struct.unpack_from("<L", payload, offset)[0] / self.clock_hz
+			offset += 4
+		# Newer loaders may know more commands, those get their code as name
+		self.commands = { }
+		for (code, (count, total, maximum)) in enumerate(struct.iter_unpack("<LLL", payload[offset:])):
+			if count:
+				name = StatsResponse.COMMAND_NAMES[code] if code < len(StatsResponse.COMMAND_NAMES) else f"0x{code:02x}"
+				self.commands[name] = (count, total / self.clock_hz, maximum / self.clock_hz)
+
+	def format(self):
+		resolution_us = 1e6 / self.clock_hz
+		lines = [ f"Uptime {self.uptime:.3f}s, timer resolution {resolution_us:.1f}us" ]
+		for (name, seconds) in self.times.items():
+			share = seconds / self.uptime * 100 if self.uptime else 0
+			lines.append(f"  {name:<16} {seconds:10.3f}s {share:5.1f}%")
+		lines.append(f"  {'Command':<18} {'count':>8} {'total':>10} {'avg':>10} {'max':>10}")
+		for (name, (count, total, maximum)) in sorted(self.commands.items(), key=lambda item: -item[1][1]):
+			lines.append(f"  {name:<18} {count:8} {total:9.3f}s {total / count * 1000:8.3f}ms {maximum * 1000:8.3f}ms")
+		return "\n".join(lines)
+
+	def __repr__(self):
+		return f"StatsResponse to 0x{self.header.id:04x}, uptime {self.uptime:.3f}s, {len(self.commands)} commands used"
+
+class ProfileResponse(Response):
+	RESPONSE_CODES = [ 0x12 ]
+	HEADER_LENGTH = 16
+
+	@classmethod
+	def validate(self, payload):
+		return len(payload) >= ProfileResponse.HEADER_LENGTH and (len(payload) - ProfileResponse.HEADER_LENGTH) % 2 == 0
+
+	def __init__(self, header, payload):
+		super().__init__(header, payload)
+		(self.text_start, self.samples, self.outside, self.bucket_shift, self.count_shift, running) = \
+			struct.unpack_from("<LLLBBB", payload)
+		self.running = bool(running)
+		self.bucket_size = 1 << self.bucket_shift
+		# Scaled back up, buckets are halved on the device instead of overflowing
+		self.buckets = [ count << self.count_shift for (count, ) in struct.iter_unpack("<H", payload[ProfileResponse.HEADER_LENGTH:]) ]
+
+	def hot_buckets(self):
+		"""(start address, samples) of every bucket with samples, hottest first"""
+		hot = [ (self.text_start + index * self.bucket_size, count) for (index, count) in enumerate(self.buckets) if count ]
+		return sorted(hot, key=lambda bucket: -bucket[1])
+
+	def __repr__(self):
+		return f"ProfileResponse to 0x{self.header.id:04x}, {self.samples} samples, {self.bucket_size} byte buckets"
+
+class BenchResponse(Response):
+	RESPONSE_CODES = [ 0x13 ]
+	HEADER_LENGTH = 8
+
+	@classmethod
+	def validate(self, payload):
+		return len(payload) >= BenchResponse.HEADER_LENGTH + 8
+
+	def __init__(self, header, payload):
+		super().__init__(header, payload)
+		(self.test, self.tick_hz) = struct.unpack_from("<BxxxL", payload)
+		# UART_TX puts the filler it timed in between
+		values_offset = BenchResponse.HEADER_LENGTH
+		if self.test == BenchCommand.UART_TX:
+			values_offset = len(payload) - 8
+		self.values = [ value for (value, ) in struct.iter_unpack("<L", payload[values_offset:]) ]
+
+	def throughput(self):
+		"""(bytes, seconds) of the throughput benchmarks"""
+		return (self.values[0], self.values[1] / self.tick_hz)
+
+	def __repr__(self):
+		return f"BenchResponse to 0x{self.header.id:04x}, test {self.test}, values {self.values}"
+
+class ElfSymbols():
+	"""Function symbols of an ELF file, just enough to symbolize profiler samples"""
+	SHT_SYMTAB = 2
+	STT_NOTYPE = 0
+	STT_FUNC = 2
+
+	def __init__(self, path):
+		with open(path, "rb") as f:
+			data = f.read()
+		if data[:4] != b"\x7fELF":
+			raise ValueError(f"{path} is not an ELF file")
+		is64 = data[4] == 2
+		endian = "<" if data[5] == 1 else ">"
+		if is64:
+			(shoff, ) = struct.unpack_from(endian + "Q", data, 0x28)
+			(shentsize, shnum) = struct.unpack_from(endian + "HH", data, 0x3A)
+			section_format = endian + "IIQQQQIIQQ"
+			symbol_format = endian + "IBBHQQ"
+		else:
+			(shoff, ) = struct.unpack_from(endian + "I", data, 0x20)
+			(shentsize, shnum) = struct.unpack_from(endian + "HH", data, 0x2E)
+			section_format = endian + "IIIIIIIIII"
+			symbol_format = endian + "IIIBBH"
+		sections = [ struct.unpack_from(section_format, data, shoff + index * shentsize) for index in range(shnum) ]
+
+		symbols = { }
+		for section in sections:
+			if section[1] != ElfSymbols.SHT_SYMTAB:
+				continue
+			(offset, size, link, entsize) = (section[4], section[5], section[6], section[9])
+			strtab_offset = sections[link][4]
+			for entry in range(offset, offset + size, entsize):
+				if is64:
+					(name, info, other, shndx, value, sym_size) = struct.unpack_from(symbol_format, data, entry)
+				else:
+					(name, value, sym_size, info, other, shndx) = struct.unpack_from(symbol_format, data, entry)
+				if info & 0xf not in (ElfSymbols.STT_NOTYPE, ElfSymbols.STT_FUNC) or not shndx or not name:
+					continue
+				end = data.index(b"\0", strtab_offset + name)
+				symbols.setdefault(value, data[strtab_offset + name:end].decode(errors="replace"))
+		self.addresses = sorted(symbols)
+		self.names = [ symbols[address] for address in self.addresses ]
+
+	def lookup(self, address):
+		"""(name, offset) of the symbol at or before address, None if there is none"""
+		index = bisect.bisect_right(self.addresses, address) - 1
+		if index < 0:
+			return None
+		return (self.names[index], address - self.addresses[index])
+
+	def describe(self, address):
+		symbol = self.lookup(address)
+		if not symbol:
+			return f"0x{address:06x}"
+		return f"{symbol[0]}+0x{symbol[1]:x}"
+
+def subtract_ranges(ranges, remove):
+	"""Parts of the (address, length) ranges not covered by any range in remove"""
+	result = [ ]
+	for (start, length) in ranges:
+		pieces = [ (start, start + length) ]
+		for (remove_start, remove_length) in remove:
+			remove_end = remove_start + remove_length
+			split = [ ]
+			for (piece_start, piece_end) in pieces:
+				if remove_end <= piece_start or remove_start >= piece_end:
+					split.append((piece_start, piece_end))
+					continue
+				if piece_start < remove_start:
+					split.append((piece_start, remove_start))
+				if remove_end < piece_end:
+					split.append((remove_end, piece_end))
+			pieces = split
+		result += [ (piece_start, piece_end - piece_start) for (piece_start, piece_end) in pieces ]
+	return result
+
+class DumpJournal():
+	"""
+	Sidecar file of a flash dump listing ranges already in the dump file with
+	their CRC32, one JSON object per line. Adjacent ranges are merged and
+	written out every FLUSH_LENGTH bytes, an interrupted dump loses at most
+	that much progress.
+	"""
+	FLUSH_LENGTH = 0x10000
+
+	def __init__(self, path, start, length):
+		self.path = path
+		self.start = start
+		self.length = length
+		self.file = None
+		self.run_address = None
+		self.run_length = 0
+		self.run_crc = 0
+
+	def load(self, image):
+		"""Ranges recorded by a previous dump of the same range whose data in image is intact"""
+		try:
+			with open(self.path) as f:
+				lines = [ json.loads(line) for line in f if line.strip() ]
+		except (OSError, ValueError):
+			return [ ]
+		if not lines or lines[0] != { "start": self.start, "length": self.length }:
+			return [ ]
+		done = [ ]
+		for entry in lines[1:]:
+			offset = entry["address"] - self.start
+			if offset < 0 or offset + entry["length"] > self.length:
+				continue
+			if crc32(image[offset:offset + entry["length"]]) == entry["crc"]:
+				done.append((entry["address"], entry["length"]))
+		return done
+
+	def open(self, done, image):
+		"""Start a new journal, keeping the done ranges of a resumed dump"""
+		self.file = open(self.path, "w")
+		self.write_entry({ "start": self.start, "length": self.length })
+		for (address, length) in done:
+			offset = address - self.start
+			self.write_entry({ "address": address, "length": length, "crc": crc32(image[offset:offset + length]) })
+		self.file.flush()
+
+	def write_entry(self, entry):
+		self.file.write(json.dumps(entry) + "\n")
+
+	def record(self, address, data):
+		if self.run_address is not None and self.run_address + self.run_length != address:
+			self.flush()
+		if self.run_address is None:
+			self.run_address = address
+		self.run_length += len(data)
+		self.run_crc = crc32(data, self.run_crc)
+		if self.run_length >= DumpJournal.FLUSH_LENGTH:
+			self.flush()
+
+	def flush(self):
+		if self.run_address is None:
+			return
+		self.write_entry({ "address": self.run_address, "length": self.run_length, "crc": self.run_crc })
+		self.file.flush()
+		self.run_address = None
+		self.run_length = 0
+		self.run_crc = 0
+
+	def close(self, complete):
+		self.flush()
+		self.file.close()
+		if complete:
+			os.remove(self.path)
+
+class SessionStats():
+	"""Wire level counters of a LoaderSession, reset per benchmark workload"""
+	def __init__(self):
+		self.reset()
+
+	def reset(self):
+		self.bytes_tx = 0
+		self.bytes_rx = 0
+		self.commands = 0
+		self.retries = 0
+		self.errors = 0
+		self.latencies = { }
+
+	def record_latency(self, cmd, latency):
+		self.latencies.setdefault(type(cmd).__name__, [ ]).append(latency)
+
+	@staticmethod
+	def percentile(values, percent):
+		values = sorted(values)
+		return values[min(len(values) - 1, round(percent / 100 * (len(values) - 1)))]
+
+	def latency_summary(self):
+		summary = { }
+		for (name, latencies) in self.latencies.items():
+			summary[name] = { "count": len(latencies) }
+			for percent in [ 50, 90, 99, 100 ]:
+				key = "max" if percent == 100 else f"p{percent}"
+				summary[name][key + "_ms"] = round(SessionStats.percentile(latencies, percent) * 1000, 3)
+		return summary
+
+class FrameDecoder():
+	"""
+	Splits the received byte stream into responses. Bytes outside of frames
+	are skipped by searching for the next sync byte. A frame with a corrupted
+	payload is skipped starting from its sync byte only, so a frame that was
+	cut short does not take the following one with it.
+	"""
+	SYNC = b'\xA5'
+	FRAME_OVERHEAD = 1 + ResponseHeader.LENGTH
+
+	def __init__(self):
+		self.buffer = bytearray()
+		# Header of the frame at the start of the buffer, waiting for its payload
+		self.header = None
+
+	def decode(self, data):
+		"""Add received data, returns the responses completed by it and None for each corrupted frame"""
+		self.buffer += data
+		responses = [ ]
+		pos = 0
+		with memoryview(self.buffer) as view:
+			while True:
+				if self.header is None:
+					pos = self.buffer.find(FrameDecoder.SYNC, pos)
+					if pos < 0:
+						pos = len(self.buffer)
+						break
+					if len(self.buffer) - pos < FrameDecoder.FRAME_OVERHEAD:
+						break
+					self.header = ResponseHeader.parse(view, pos)
+					if self.header is None:
+						pos += 1
+						continue
+
+				payload_start = pos + FrameDecoder.FRAME_OVERHEAD
+				frame_end = payload_start
+				if self.header.payload_length:
+					frame_end += self.header.payload_length_with_crc
+				if frame_end > len(self.buffer):
+					break
+				resp = Response.parse(self.header, view[payload_start:frame_end])
+				self.header = None
+				responses.append(resp)
+				pos = frame_end if resp else pos + 1
+		del self.buffer[:pos]
+		return responses
+
+	def skip_partial(self):
+		"""Drop an incomplete frame, called once no more data arrives for it"""
+		if self.buffer:
+			self.header = None
+			del self.buffer[:1]
+			return self.decode(b'')
+		return [ ]
+
 class LoaderSession():
 	SYNC_BYTE = 0xA5
-
-	def __init__(self, port, baudrate=Bootrom.BAUDRATE):
+	# Size of uart_rx_buf in the loader, bounds the amount of data in flight. Loaders report theirs in the PING response
+	RX_BUFFER_SIZE = 1024
+	COMPRESSED_CHUNK_SIZE = 0x10000
+	# Chunks that failed to read are read again in pieces of this size, a single corrupted bit costs less
+	RETRY_CHUNK_SIZE = 4096
+	# Flash scanned per BLANK_MAP command
+	BLANK_MAP_CHUNK_SIZE = 0x100000
+	# Erased ranges skipped by read_flash_into() are passed on in pieces of this size
+	BLANK_FILL_CHUNK_SIZE = 0x10000
+	# Flash checksummed per batched CHECKSUM command
+	CHECKSUM_CHUNK_SIZE = 0x100000
+	# Tried by negotiate_baudrate(), rates the loader can not attain are skipped
+	NEGOTIATE_BAUDRATES = [ 9600, 19200, 57600, 115200, 230400, 460800, 921600, 1000000, 1500000, 2000000, 3000000 ]
+	# Upper bound for the loader to revert an unconfirmed baudrate change
+	BAUDRATE_REVERT_TIMEOUT = 5
+	# Commands still accepting responses, older ones are dropped. The loader never has that many in flight.
+	MAX_PENDING_COMMANDS = 64
+
+	def __init__(self, port, baudrate=Bootrom.BAUDRATE, window=4):
 		self.port = port
 		self.baudrate = baudrate
+		# Stop-and-wait until the PING response shows a loader that keeps pipelined frames
+		self.max_window = window
+		self.window = 1
+		self.rx_buffer_size = LoaderSession.RX_BUFFER_SIZE
+		self.outdated_loader = None
 		self.next_id = 0
-		self.queued_responses = [ ]
-		self.response_available = threading.Condition()
+		# DispatchedCommand by id, responses are passed to the one they belong to
+		self.pending = { }
+		self.pending_lock = threading.Lock()
+		self.decoder = FrameDecoder()
+		self.stats = SessionStats()
+		self.compressed_read_supported = None
+		self.compressed_program_supported = None
+		self.write_sector_supported = None
+		self.conditional_program_supported = None
+		self.stream_read_supported = None
+		self.erase_types = None
+		self.verbose = True
 
 	def __enter__(self):
 		self.serial = serial.Serial(self.port, self.baudrate, timeout=1)
@@ -385,65 +1252,90 @@ class LoaderSession():
 	def send_command(self, cmd):
 		dispatch = DispatchedCommand(cmd, self.next_id)
 		self.next_id += 1
-		print(f"Dispatching command {dispatch}")
-		self.serial.write(dispatch.encode())
+		if self.verbose:
+			print(f"Dispatching command {dispatch}")
+		data = dispatch.encode()
+		self.register(dispatch)
+		dispatch.sent = monotonic()
+		self.serial.write(data)
+		self.stats.bytes_tx += len(data)
+		self.stats.commands += 1
 		return dispatch
 
+	def register(self, dispatch):
+		"""Route responses with the id of dispatch to it, before its frame is sent"""
+		with self.pending_lock:
+			self.pending[dispatch.id] = dispatch
+			if len(self.pending) > LoaderSession.MAX_PENDING_COMMANDS:
+				del self.pending[next(iter(self.pending))]
+
 	def listen(self):
 		while not self.exit:
-			resp = self.receive_packet()
-			if not resp:
-				continue
-
-			if resp.handle():
-				continue
-
-			self.response_available.acquire()
-			print(resp)
-			self.queued_responses.append(resp)
-			self.response_available.notify_all()
-			self.response_available.release()
-
-	def receive_packet(self):
-		sync = self.serial.read(1)
-		if len(sync) == 0:
-			return None
-		if sync[0] == LoaderSession.SYNC_BYTE:
-			self.serial.timeout = 1
-			header_data = self.serial.read(ResponseHeader.LENGTH)
-			header = ResponseHeader.parse(header_data)
-			if not header:
-				return None
-			payload_with_crc = None
-			if header.payload_length:
-				self.serial.timeout = 1 + header.payload_length_with_crc * 10 / self.serial.baudrate
-				payload_with_crc = self.serial.read(header.payload_length_with_crc)
-			return Response.parse(header, payload_with_crc)
-
-	def find_response(self, id):
-		for resp in self.queued_responses:
-			if resp.header.id == id:
-				return resp
-		return None
+			# Blocks for the first byte only, then takes everything already received
+			data = self.serial.read(self.serial.in_waiting or 1)
+			if data:
+				self.stats.bytes_rx += len(data)
+				responses = self.decoder.decode(data)
+			else:
+				responses = self.decoder.skip_partial()
+			received = monotonic()
+			for resp in responses:
+				if not resp or resp.handle():
+					continue
+				resp.received = received
+				if self.verbose:
+					print(resp)
+				with self.pending_lock:
+					dispatch = self.pending.get(resp.header.id)
+				if dispatch:
+					dispatch.responses.put(resp)
 
 	def await_response(self, dispatch, timeout=False):
 		if isinstance(timeout, bool) and timeout == False:
 			timeout = dispatch.cmd.get_timeout(self.serial.baudrate)
 
-		self.response_available.acquire()
-		resp = self.find_response(dispatch.id)
-		if resp:
-			self.queued_responses.remove(resp)
-			self.response_available.release()
-			return resp
-
-		while self.response_available.wait(timeout):
-			resp = self.find_response(dispatch.id)
-			if resp:
-				self.queued_responses.remove(resp)
-				return resp
-
-		return None
+		try:
+			resp = dispatch.responses.get(timeout=timeout)
+		except queue.Empty:
+			self.stats.errors += 1
+			return None
+		self.stats.record_latency(dispatch.cmd, resp.received - dispatch.sent)
+		return resp
+
+	def run_pipelined(self, cmds, window=None):
+		"""
+		Dispatch commands keeping up to window of them outstanding, yields
+		(cmd, response) in dispatch order. Bytes in flight are limited such
+		that the loader RX ring can still hold the frame currently executed.
+		Callers that stop early close the generator, e.g. with closing(),
+		which waits for the commands still in flight.
+		"""
+		if window is None:
+			window = self.window
+		cmds = iter(cmds)
+		in_flight = deque()
+		in_flight_bytes = 0
+		pending = next(cmds, None)
+		try:
+			while pending or in_flight:
+				while pending and len(in_flight) < window:
+					length = pending.encoded_length()
+					max_frame = max([ length ] + [ dispatch.length for dispatch in in_flight ])
+					if in_flight and in_flight_bytes + length + max_frame > self.rx_buffer_size - 1:
+						break
+					dispatch = self.send_command(pending)
+					dispatch.length = length
+					in_flight.append(dispatch)
+					in_flight_bytes += length
+					pending = next(cmds, None)
+
+				dispatch = in_flight.popleft()
+				in_flight_bytes -= dispatch.length
+				yield (dispatch.cmd, self.await_response(dispatch))
+		finally:
+			# The loader still executes them, the caller must not move on before they are done
+			for dispatch in in_flight:
+				self.await_response(dispatch)
 
 	def start(self):
 		self.exit = False
@@ -458,7 +1350,19 @@ class LoaderSession():
 		cmd = PingCommand()
 		dispatch = self.send_command(cmd)
 		resp = self.await_response(dispatch)
-		return resp and isinstance(resp, SyncResponse)
+		if not resp or not isinstance(resp, SyncResponse):
+			return False
+		if len(resp.payload) >= 4:
+			self.rx_buffer_size = struct.unpack_from("<L", resp.payload)[0]
+			self.window = self.max_window
+			self.outdated_loader = False
+		elif self.outdated_loader is None:
+			# Older loaders reset their RX DMA after every command and drop frames queued behind it
+			print("Loader does not report its RX buffer size, it is outdated. Rebuild device/test.bin, "
+				"sending one command at a time")
+			self.window = 1
+			self.outdated_loader = True
+		return True
 
 	def sync(self, tries=3):
 		for try_ in range(tries):
@@ -467,34 +1371,216 @@ class LoaderSession():
 				return True
 		return False
 
-	def read_flash_chunk(self, start, length):
-		cmd = ReadFlashCommand(start, length)
+	@staticmethod
+	def read_flash_data(cmd, resp):
+		"""Flash data carried by a response to a (compressed) read command, None if invalid"""
+		data = None
+		if isinstance(cmd, ReadFlashRleCommand):
+			if resp and isinstance(resp, FlashDataRleResponse):
+				data = resp.data
+		elif resp and isinstance(resp, SyncResponse):
+			data = resp.payload
+		if data is None or len(data) != cmd.length:
+			return None
+		return data
+
+	def read_flash_chunk(self, start, length, compress=False):
+		cmd = ReadFlashRleCommand(start, length) if compress else ReadFlashCommand(start, length)
 		dispatch = self.send_command(cmd)
 		resp = self.await_response(dispatch)
-		if resp and isinstance(resp, SyncResponse):
-			return resp.payload
-		return None
-
-	def read_flash(self, start, length, retry=5, chunk_size=4096):
-		address = start
-		data = b''
-		while length:
-			read_size = length
-			if read_size > chunk_size:
-				read_size = chunk_size
-			for try_ in range(retry):
-				chunk = self.read_flash_chunk(address, read_size)
-				if chunk:
-					data += chunk
+		return LoaderSession.read_flash_data(cmd, resp)
+
+	def read_flash_chunk_retry(self, start, length, retry=5, compress=False):
+		"""
+		Read a chunk again after its first read failed, in RETRY_CHUNK_SIZE
+		pieces. A piece is read compressed once, then uncompressed. None if
+		a piece could not be read within retry tries.
+		"""
+		data = bytearray()
+		for address in range(start, start + length, LoaderSession.RETRY_CHUNK_SIZE):
+			piece_length = min(LoaderSession.RETRY_CHUNK_SIZE, start + length - address)
+			for try_ in range(1, retry):
+				self.stats.retries += 1
+				piece = self.read_flash_chunk(address, piece_length, compress and try_ == 1)
+				if piece is not None:
 					break
 				print(f"Failed to read chunk at 0x{address:08x}, try {try_ + 1}/{retry}")
 			else:
 				return None
+			data += piece
+		return bytes(data)
+
+	def supports_compressed_read(self):
+		if self.compressed_read_supported is None:
+			cmd = ReadFlashRleCommand(0, 1)
+			dispatch = self.send_command(cmd)
+			resp = self.await_response(dispatch)
+			self.compressed_read_supported = resp is not None and isinstance(resp, FlashDataRleResponse)
+		return self.compressed_read_supported
+
+	def blank_map(self, start, length, block_size=4096):
+		"""One bool per block_size block from start, True if erased. None on failure."""
+		map_chunk = max(block_size, LoaderSession.BLANK_MAP_CHUNK_SIZE // block_size * block_size)
+		cmds = (BlankMapCommand(address, min(map_chunk, start + length - address), block_size)
+			for address in range(start, start + length, map_chunk))
+		blank = [ ]
+		with closing(self.run_pipelined(cmds)) as responses:
+			for (cmd, resp) in responses:
+				num_blocks = (cmd.length + block_size - 1) // block_size
+				if not resp or not isinstance(resp, BlankMapResponse) or len(resp.payload) != (num_blocks + 7) // 8:
+					return None
+				blank += [ resp.is_blank(block) for block in range(num_blocks) ]
+		return blank
+
+	def programmed_ranges(self, start, length, block_size=4096):
+		"""(address, length) of all not erased regions, None if the loader can not tell"""
+		blank = self.blank_map(start, length, block_size)
+		if blank is None:
+			return None
+		ranges = [ ]
+		for (block, is_blank) in enumerate(blank):
+			if is_blank:
+				continue
+			address = start + block * block_size
+			block_length = min(block_size, start + length - address)
+			if ranges and ranges[-1][0] + ranges[-1][1] == address:
+				ranges[-1] = (ranges[-1][0], ranges[-1][1] + block_length)
+			else:
+				ranges.append((address, block_length))
+		return ranges
+
+	def supports_stream_read(self):
+		if self.stream_read_supported is None:
+			# Loaders that know the command reject it without parameters as too short
+			dispatch = self.send_command(Command(0x10))
+			resp = self.await_response(dispatch)
+			self.stream_read_supported = resp is not None and isinstance(resp, ErrorResponse) and \
+				resp.header.response == 0x03
+		return self.stream_read_supported
+
+	def send_stream_ack(self, stream, ack, nak=StreamAckCommand.NAK_NONE):
+		# Carries the id of the stream, no response
+		dispatch = DispatchedCommand(StreamAckCommand(ack, nak), stream.id)
+		if self.verbose:
+			print(f"Dispatching command {dispatch}")
+		data = dispatch.encode()
+		self.serial.write(data)
+		self.stats.bytes_tx += len(data)
+
+	def read_flash_stream(self, sink, start, length, block_size=1024, credits=16, retry=5):
+		"""
+		Read a range with a single READ_STREAM command, passing blocks to
+		sink(address, data) in order. Blocks received in order return credits,
+		missing or corrupted blocks are NAKed one by one. No other command
+		may be sent before it returns, the loader rejects them with
+		CMD_INVALID while streaming.
+		"""
+		num_blocks = (length + block_size - 1) // block_size
+		# Blocks received ahead of a missing one
+		pending = { }
+		acked = 0
+		ack_sent = 0
+		naked = set()
+		stalls = 0
+		stream = self.send_command(ReadStreamCommand(start, length, block_size, credits))
+		while True:
+			resp = self.await_response(stream)
+			if resp is None:
+				stalls += 1
+				if stalls > retry:
+					print(f"Stream read at 0x{start + acked * block_size:08x} stalled")
+					self.send_stream_ack(stream, StreamAckCommand.ABORT)
+					return False
+				# Lost blocks, acknowledgements or NAKs, ask again for the first missing block
+				self.stats.retries += 1
+				self.send_stream_ack(stream, acked, acked if acked < num_blocks else StreamAckCommand.NAK_NONE)
+				continue
+			if not isinstance(resp, StreamBlockResponse):
+				if isinstance(resp, SyncResponse) and acked == num_blocks:
+					return True
+				print(f"Stream read failed: {resp}")
+				return False
 
-			length -= read_size
-			address += read_size
+			stalls = 0
+			seq = resp.seq
+			if acked <= seq < num_blocks and len(resp.data) == min(block_size, length - seq * block_size):
+				pending[seq] = resp.data
+			while acked in pending:
+				sink(start + acked * block_size, pending.pop(acked))
+				acked += 1
+			naks = [ missing for missing in range(acked, min(seq, num_blocks)) if missing not in pending and missing not in naked ]
+			for nak in naks:
+				self.stats.retries += 1
+				naked.add(nak)
+				self.send_stream_ack(stream, acked, nak)
+				ack_sent = acked
+			# Credits are returned in batches, the last block is acknowledged right away
+			if acked != ack_sent and (acked - ack_sent >= max(1, credits // 2) or acked == num_blocks):
+				self.send_stream_ack(stream, acked)
+				ack_sent = acked
+
+	def read_flash_into(self, sink, start, length, retry=5, chunk_size=4096, compress=False, skip_blank=False, stream=False, done=()):
+		"""
+		Read a range and pass it to sink(address, data) piece by piece, in
+		order. Ranges in done, (address, length) tuples, are not read again.
+		Returns False if a chunk could not be read.
+		"""
+		if compress and not self.supports_compressed_read():
+			print("Loader does not support compressed reads, reading uncompressed")
+			compress = False
+		if stream and not self.supports_stream_read():
+			print("Loader does not support stream reads, reading in chunks")
+			stream = False
+		read_cmd = ReadFlashRleCommand if compress else ReadFlashCommand
+
+		ranges = subtract_ranges([ (start, length) ], done)
+		if skip_blank:
+			programmed = [ ]
+			for (range_start, range_length) in ranges:
+				range_programmed = self.programmed_ranges(range_start, range_length)
+				if range_programmed is None:
+					print("Failed to get blank map from loader, reading all of flash")
+					programmed = ranges
+					break
+				programmed += range_programmed
+			else:
+				erased = subtract_ranges(ranges, programmed)
+				erased_length = sum(range_length for (_, range_length) in erased)
+				print(f"{erased_length} of {length} bytes are erased, skipping them")
+				for (range_start, range_length) in erased:
+					for address in range(range_start, range_start + range_length, LoaderSession.BLANK_FILL_CHUNK_SIZE):
+						sink(address, b'\xff' * min(LoaderSession.BLANK_FILL_CHUNK_SIZE, range_start + range_length - address))
+			ranges = programmed
+
+		if stream:
+			return all(self.read_flash_stream(sink, range_start, range_length, retry=retry) for (range_start, range_length) in ranges)
+
+		def read_cmds():
+			for (range_start, range_length) in ranges:
+				for address in range(range_start, range_start + range_length, chunk_size):
+					yield read_cmd(address, min(chunk_size, range_start + range_length - address))
+
+		with closing(self.run_pipelined(read_cmds())) as responses:
+			for (cmd, resp) in responses:
+				chunk = LoaderSession.read_flash_data(cmd, resp)
+				if chunk is None:
+					print(f"Failed to read chunk at 0x{cmd.start_address:08x}, try 1/{retry}")
+					chunk = self.read_flash_chunk_retry(cmd.start_address, cmd.length, retry, compress)
+					if chunk is None:
+						return False
+				sink(cmd.start_address, chunk)
 
-		return data
+		return True
+
+	def read_flash(self, start, length, retry=5, chunk_size=4096, compress=False, skip_blank=False, stream=False):
+		"""Read a range into memory, None on failure"""
+		data = bytearray(b'\xff' * length)
+		def sink(address, chunk):
+			data[address - start:address - start + len(chunk)] = chunk
+
+		if not self.read_flash_into(sink, start, length, retry, chunk_size, compress, skip_blank, stream):
+			return None
+		return bytes(data)
 
 	def set_baudrate(self, baudrate):
 		cmd = SetBaudrateCommand(baudrate)
@@ -502,12 +1588,79 @@ class LoaderSession():
 		resp = self.await_response(dispatch)
 		if resp and isinstance(resp, ErrorResponse):
 			return False
+		return self.set_host_baudrate(baudrate)
+
+	def confirm_baudrate(self, tries=3):
+		"""Keep the baudrate of the last change, the loader reverts it otherwise"""
+		for _ in range(tries):
+			dispatch = self.send_command(ConfirmBaudrateCommand())
+			resp = self.await_response(dispatch)
+			if resp and isinstance(resp, SyncResponse):
+				return True
+			if resp and isinstance(resp, ErrorResponse) and resp.header.response == 0x02:
+				# Older loaders confirm on any valid frame
+				return True
+		return False
+
+	def set_host_baudrate(self, baudrate):
 		self.stop()
-		self.serial.baudrate = baudrate
-		self.queued_responses.clear()
-		self.start()
+		try:
+			self.serial.baudrate = baudrate
+		except (ValueError, serial.SerialException) as e:
+			print(f"Serial port does not support {baudrate} baud: {e}")
+			return False
+		finally:
+			with self.pending_lock:
+				self.pending.clear()
+			self.decoder = FrameDecoder()
+			self.start()
 		return True
 
+	def link_test(self, length=4096, pattern_length=252, seed=None):
+		"""Send and receive a pseudo random burst, True if it arrived unchanged in both directions"""
+		if seed is None:
+			seed = random.randrange(1, 1 << 32)
+		cmd = PrbsCommand(seed, length, pattern_length)
+		dispatch = self.send_command(cmd)
+		resp = self.await_response(dispatch)
+		return resp is not None and isinstance(resp, PrbsResponse) and resp.payload == prbs_bytes(seed, length)
+
+	def negotiate_baudrate(self, candidates=None, bursts=2):
+		"""
+		Walk up the candidate baudrates, keep each one only if pings and PRBS
+		bursts get through. Only then is the change confirmed, the loader
+		reverts an unconfirmed one on its own.
+		"""
+		if candidates is None:
+			candidates = LoaderSession.NEGOTIATE_BAUDRATES
+		if self.outdated_loader:
+			# No PRBS command, and the sync ping would already confirm the change
+			print(f"Outdated loader can not test the link, keeping {self.serial.baudrate} baud")
+			return self.serial.baudrate
+		for baudrate in sorted(candidates):
+			current = self.serial.baudrate
+			if baudrate <= current:
+				continue
+			dispatch = self.send_command(SetBaudrateCommand(baudrate))
+			resp = self.await_response(dispatch)
+			if resp and isinstance(resp, ErrorResponse):
+				# Not attainable by the loader, a higher one might be
+				continue
+			if resp and self.set_host_baudrate(baudrate) and self.sync() and \
+				all(self.link_test() for _ in range(bursts)) and self.confirm_baudrate():
+				print(f"Link reliable at {baudrate} baud")
+				continue
+
+			print(f"Link unreliable at {baudrate} baud, reverting to {current}")
+			self.stats.errors += 1
+			self.set_host_baudrate(current)
+			deadline = monotonic() + LoaderSession.BAUDRATE_REVERT_TIMEOUT
+			while not self.sync():
+				if monotonic() > deadline:
+					return None
+			break
+		return self.serial.baudrate
+
 	def erase_flash_sector(self, address):
 		cmd = EraseFlashSectorCommand(address)
 		dispatch = self.send_command(cmd)
@@ -520,12 +1673,262 @@ class LoaderSession():
 		resp = self.await_response(dispatch)
 		return (resp and isinstance(resp, SyncResponse))
 
+	def erase_flash_sectors(self, addresses):
+		cmds = (EraseFlashSectorCommand(address) for address in addresses)
+		with closing(self.run_pipelined(cmds)) as responses:
+			for (cmd, resp) in responses:
+				if not resp or not isinstance(resp, SyncResponse):
+					print(f"Failed to erase sector @0x{cmd.address:08x}")
+					return False
+		return True
+
+	def supports_compressed_program(self):
+		if self.compressed_program_supported is None:
+			# A truncated run, rejected as invalid parameter by loaders that know the command
+			cmd = ProgramFlashPageRleCommand(0, b'', encoded=b'\x80')
+			dispatch = self.send_command(cmd)
+			resp = self.await_response(dispatch)
+			self.compressed_program_supported = resp is not None and isinstance(resp, ErrorResponse) and \
+				resp.header.response == 0x06
+		return self.compressed_program_supported
+
+	@staticmethod
+	def program_page_command(address, data, compress):
+		if compress:
+			encoded = rle_encode(data)
+			# Incompressible pages would not fit the loader's parameter buffer
+			if len(encoded) < len(data):
+				return ProgramFlashPageRleCommand(address, data, encoded)
+		return ProgramFlashPageCommand(address, data)
+
+	def program_flash_regions(self, regions, page_size=256, compress=False):
+		"""Program a list of (address, data) in one pipeline"""
+		if compress and not self.supports_compressed_program():
+			print("Loader does not support compressed programming, writing uncompressed")
+			compress = False
+
+		def program_cmds():
+			for (address, data) in regions:
+				for offset in range(0, len(data), page_size):
+					page = data[offset:offset + page_size]
+					# Programming erased bytes does not change flash
+					if page.count(0xff) == len(page):
+						continue
+					yield LoaderSession.program_page_command(address + offset, page, compress)
+
+		with closing(self.run_pipelined(program_cmds())) as responses:
+			for (cmd, resp) in responses:
+				if not resp or not isinstance(resp, SyncResponse):
+					print(f"Failed to write page @0x{cmd.start_address:08x}")
+					return False
+		return True
+
+	def program_flash(self, address, data, page_size=256, compress=False):
+		return self.program_flash_regions([ (address, data) ], page_size, compress)
+
+	def supports_write_sector(self):
+		if self.write_sector_supported is None:
+			# Loaders that know the command reject it without parameters as too short
+			dispatch = self.send_command(Command(0x0C))
+			resp = self.await_response(dispatch)
+			self.write_sector_supported = resp is not None and isinstance(resp, ErrorResponse) and \
+				resp.header.response == 0x03
+		return self.write_sector_supported
+
+	def write_sector(self, address, data):
+		"""
+		Erase and program one sector with a single streamed WRITE_SECTOR frame.
+		The loader acknowledges every page it took out of its RX ring with
+		CMD_OK, no more pages than fit the ring are sent ahead of that.
+		"""
+		cmd = WriteSectorCommand(address, data, self.rx_buffer_size)
+		dispatch = DispatchedCommand(cmd, self.next_id)
+		self.next_id += 1
+		if self.verbose:
+			print(f"Dispatching command {dispatch}")
+		frame = dispatch.encode()
+		pages = [ frame[offset:offset + WriteSectorCommand.PAGE_RECORD_LENGTH]
+			for offset in range(WriteSectorCommand.HEADER_LENGTH, len(frame) - 4, WriteSectorCommand.PAGE_RECORD_LENGTH) ]
+		pages[-1] += frame[-4:]
+		window = (self.rx_buffer_size - 1) // WriteSectorCommand.PAGE_RECORD_LENGTH
+
+		data = frame[:WriteSectorCommand.HEADER_LENGTH] + b''.join(pages[:window])
+		self.register(dispatch)
+		dispatch.sent = monotonic()
+		self.serial.write(data)
+		self.stats.bytes_tx += len(data)
+		self.stats.commands += 1
+		for page in range(len(pages)):
+			resp = self.await_response(dispatch)
+			if not resp or resp.header.response != 0x01:
+				print(f"Failed to write sector @0x{address:08x}, page {page}: {resp}")
+				return False
+			if page + window < len(pages):
+				self.serial.write(pages[page + window])
+				self.stats.bytes_tx += len(pages[page + window])
+
+		resp = self.await_response(dispatch)
+		if not resp or resp.header.response != 0x04:
+			print(f"Failed to write sector @0x{address:08x}: {resp}")
+			return False
+		return True
+
+	def supports_conditional_program(self):
+		if self.conditional_program_supported is None:
+			# Loaders that know the command reject it without parameters as too short
+			dispatch = self.send_command(Command(0x0E))
+			resp = self.await_response(dispatch)
+			self.conditional_program_supported = resp is not None and isinstance(resp, ErrorResponse) and \
+				resp.header.response == 0x03
+		return self.conditional_program_supported
+
+	def program_in_place(self, regions, sector_size=0x1000, page_size=256):
+		"""
+		Try to program sector aligned (address, data) regions without erasing.
+		Returns the regions of sectors that still need an erase, None on failure.
+		"""
+		sectors = [ (address + offset, data[offset:offset + sector_size])
+			for (address, data) in regions for offset in range(0, len(data), sector_size) ]
+		needs_erase = set()
+		results = { }
+
+		def program_pages(cmds):
+			with closing(self.run_pipelined(cmds)) as responses:
+				for (cmd, resp) in responses:
+					if not resp or not isinstance(resp, ProgramResultResponse):
+						print(f"Failed to write page @0x{cmd.start_address:08x}")
+						return False
+					results[resp.result] = results.get(resp.result, 0) + 1
+					if resp.result == ProgramResultResponse.NEEDS_ERASE:
+						needs_erase.add(cmd.start_address - cmd.start_address % sector_size)
+			return True
+
+		# The first page of each sector tells most sectors that need an erase apart
+		if not program_pages(ProgramFlashPageCondCommand(address, sector[:page_size]) for (address, sector) in sectors):
+			return None
+		# needs_erase is checked as pages are sent, pages of a sector stop after its first NEEDS_ERASE
+		if not program_pages(ProgramFlashPageCondCommand(address + offset, sector[offset:offset + page_size])
+			for (address, sector) in sectors for offset in range(page_size, len(sector), page_size)
+			if address not in needs_erase):
+			return None
+		print(f"{results.get(ProgramResultResponse.PROGRAMMED, 0)} pages programmed without erase, "
+			f"{results.get(ProgramResultResponse.UNCHANGED, 0)} unchanged, {len(needs_erase)} sectors need an erase")
+
+		erase_regions = [ ]
+		for (address, sector) in sectors:
+			if address not in needs_erase:
+				continue
+			if erase_regions and erase_regions[-1][0] + len(erase_regions[-1][1]) == address:
+				erase_regions[-1] = (erase_regions[-1][0], erase_regions[-1][1] + sector)
+			else:
+				erase_regions.append((address, sector))
+		return erase_regions
+
+	def flash_erase_types(self):
+		"""Erase types reported by the loader, empty for loaders without typed ERASE"""
+		if self.erase_types is None:
+			resp = self.flash_info()
+			self.erase_types = resp.erase_types if resp and isinstance(resp, FlashInfoResponse) else [ ]
+		return self.erase_types
+
+	def erase_flash_plan(self, plan):
+		def erase_cmds():
+			for (address, erase_type) in plan:
+				if erase_type.size == 0x1000:
+					yield EraseFlashSectorCommand(address)
+				else:
+					yield EraseCommand(address, erase_type)
+
+		with closing(self.run_pipelined(erase_cmds())) as responses:
+			for (cmd, resp) in responses:
+				if not resp or not isinstance(resp, SyncResponse):
+					print(f"Failed to erase @0x{cmd.address:08x}")
+					return False
+		return True
+
+	def write_flash_regions(self, regions, compress=False, retry=3):
+		"""
+		Erase and program sector aligned (address, data) regions. Regions that
+		contain whole erase blocks are erased with block erases and programmed
+		afterwards. Otherwise streamed WRITE_SECTOR commands are used if
+		available, erase then program if not.
+		"""
+		plans = [ plan_erase(address, address + len(data), self.flash_erase_types()) for (address, data) in regions ]
+		if None not in plans and any(erase_type.size > 0x1000 for plan in plans for (address, erase_type) in plan):
+			plan = [ erase for plan in plans for erase in plan ]
+			print(f"Erase plan: {describe_erase_plan(plan)}")
+			return self.erase_flash_plan(plan) and self.program_flash_regions(regions, compress=compress)
+
+		if compress or not self.supports_write_sector():
+			addresses = [ address + offset for (address, data) in regions for offset in range(0, len(data), WriteSectorCommand.SECTOR_SIZE) ]
+			return self.erase_flash_sectors(addresses) and self.program_flash_regions(regions, compress=compress)
+
+		for (address, data) in regions:
+			for offset in range(0, len(data), WriteSectorCommand.SECTOR_SIZE):
+				sector = data[offset:offset + WriteSectorCommand.SECTOR_SIZE]
+				for try_ in range(retry):
+					if self.write_sector(address + offset, sector):
+						break
+					self.stats.retries += 1
+				else:
+					return False
+		return True
+
 	def remote_flash_checksum(self, address, length):
 		cmd = RemoteFlashChecksumCommand(address, length)
 		dispatch = self.send_command(cmd)
 		resp = self.await_response(dispatch)
 		return (resp and isinstance(resp, ChecksumResponse))
 
+	def remote_flash_checksums(self, regions):
+		"""CRC32 of each (address, length) computed by the loader, None for failed regions"""
+		cmds = (RemoteFlashChecksumCommand(address, length) for (address, length) in regions)
+		checksums = [ ]
+		for (cmd, resp) in self.run_pipelined(cmds):
+			checksums.append(resp.checksum if resp and isinstance(resp, ChecksumResponse) else None)
+		return checksums
+
+	def block_checksums(self, start, length, block_size=0x1000):
+		"""
+		CRC32 of every block in the range, computed by the loader with batched
+		CHECKSUM commands. None if the loader does not support them.
+		"""
+		chunk_size = LoaderSession.CHECKSUM_CHUNK_SIZE // block_size * block_size
+		cmds = (RemoteFlashChecksumCommand(address, min(chunk_size, start + length - address), block_size)
+			for address in range(start, start + length, chunk_size))
+		checksums = [ ]
+		with closing(self.run_pipelined(cmds)) as responses:
+			for (cmd, resp) in responses:
+				if not resp or not isinstance(resp, ChecksumResponse):
+					print(f"Failed to checksum flash @0x{cmd.start_address:08x}")
+					return None
+				# Older loaders ignore the block size and checksum the whole range
+				if len(resp.checksums) != (cmd.length + block_size - 1) // block_size:
+					return None
+				checksums += resp.checksums
+		return checksums
+
+	def changed_regions(self, regions, block_size=0x1000):
+		"""
+		Split (address, data) regions into the runs of blocks whose flash
+		content differs. None if the loader can not checksum blocks.
+		"""
+		changed = [ ]
+		for (address, data) in regions:
+			checksums = self.block_checksums(address, len(data), block_size)
+			if checksums is None:
+				return None
+			run_start = None
+			for (block, checksum) in enumerate(checksums + [ None ]):
+				offset = block * block_size
+				differs = checksum is not None and checksum != crc32(data[offset:offset + block_size])
+				if differs and run_start is None:
+					run_start = offset
+				elif not differs and run_start is not None:
+					changed.append((address + run_start, data[run_start:offset]))
+					run_start = None
+		return changed
+
 	def flash_info(self):
 		cmd = FlashInfoCommand()
 		dispatch = self.send_command(cmd)
@@ -536,9 +1939,39 @@ class LoaderSession():
 		dispatch = self.send_command(cmd)
 		return self.await_response(dispatch)
 
+	def profile(self, flags=0):
+		"""Profiler histogram after applying flags, None if the loader does not support it"""
+		cmd = ProfileCommand(flags)
+		dispatch = self.send_command(cmd)
+		resp = self.await_response(dispatch)
+		if not isinstance(resp, ProfileResponse):
+			return None
+		return resp
+
+	def loader_stats(self, reset=False):
+		"""Timing statistics of the loader, None if it does not support them"""
+		cmd = StatsCommand(reset)
+		dispatch = self.send_command(cmd)
+		resp = self.await_response(dispatch)
+		if not isinstance(resp, StatsResponse):
+			return None
+		return resp
+
+	def microbench(self, test, arg=0):
+		"""Result of a device side benchmark, an ErrorResponse if the loader rejected it, None if it does not support them"""
+		cmd = BenchCommand(test, arg)
+		dispatch = self.send_command(cmd)
+		resp = self.await_response(dispatch)
+		if not isinstance(resp, (BenchResponse, ErrorResponse)):
+			return None
+		return resp
+
 def int_autobase(x):
 	return int(x, 0)
 
+def baudrate_or_auto(x):
+	return x if x == "auto" else int(x)
+
 class CliCommand():
 	def __init__(self):
 		self.args = None
@@ -547,19 +1980,39 @@ class CliCommand():
 		if not self.parse_args(parser):
 			sys.exit(1)
 
+		if args.stage0 and not os.path.exists(args.stage0):
+			print(f"Stage 0 stub {args.stage0} not found, build it with make in device/")
+			sys.exit(1)
+
+		loader_baudrate = args.initial_baudrate
 		if not args.skip_loader:
 			with Bootrom(args.port, args.initial_baudrate) as bootrom:
-				bootrom.uart_boot_file(args.loader)
-
-		with LoaderSession(args.port, args.initial_baudrate) as session:
+				if args.stage0:
+					stage0_baudrate = Stage0.baudrate_for(args.baudrate)
+					if bootrom.uart_boot_staged_file(args.stage0, args.loader, stage0_baudrate):
+						loader_baudrate = stage0_baudrate
+					else:
+						print("Two stage boot failed, uploading loader through the ROM")
+						bootrom.serial.baudrate = args.initial_baudrate
+						bootrom.uart_boot_file(args.loader)
+				else:
+					bootrom.uart_boot_file(args.loader)
+
+		with LoaderSession(args.port, loader_baudrate, window=args.window) as session:
 			if not session.sync():
 				print(f"Failed to synchronize with loader")
 				sys.exit(1)
 
-			if session.baudrate != args.baudrate:
+			if args.baudrate == "auto":
+				baudrate = session.negotiate_baudrate()
+				if baudrate is None:
+					print(f"Failed to synchronize with loader after baudrate negotiation")
+					sys.exit(1)
+				print(f"Using {baudrate} baud")
+			elif session.baudrate != args.baudrate:
 				print(f"Changing baudrate {session.baudrate} -> {args.baudrate}")
 				session.set_baudrate(args.baudrate)
-				if not session.sync():
+				if not session.sync() or not session.confirm_baudrate():
 					print(f"Failed to synchronize with loader after baudrate change")
 					sys.exit(1)
 
@@ -594,6 +2047,11 @@ class CliCommandReadFlash(CliCommand):
 		parser.add_argument("filename")
 		parser.add_argument("offset", type=int_autobase, nargs="?")
 		parser.add_argument("length", type=int_autobase, nargs="?")
+		transfer = parser.add_mutually_exclusive_group()
+		transfer.add_argument("-z", "--compress", action="store_true", help="Transfer run length encoded flash data")
+		transfer.add_argument("--stream", action="store_true", help="Stream the whole range with a single command")
+		parser.add_argument("--skip-blank", action="store_true", help="Only read blocks the loader reports as not erased")
+		parser.add_argument("--restart", action="store_true", help="Ignore the journal of an interrupted dump and read everything again")
 		self.args = parser.parse_args()
 		return True
 
@@ -609,8 +2067,34 @@ class CliCommandReadFlash(CliCommand):
 				return
 			length = flash_info.flash_size_bytes
 		print(f"Will read {length} bytes from 0x{offset:08x} - 0x{offset + length - 1:08x}")
-		with open(self.args.filename, 'wb') as f:
-			f.write(session.read_flash(offset, length))
+		# Blank regions compress to a few bytes, larger chunks keep per command overhead down
+		chunk_size = LoaderSession.COMPRESSED_CHUNK_SIZE if self.args.compress else 4096
+		journal = DumpJournal(self.args.filename + ".journal", offset, length)
+		# The dump is written in place, memory use does not depend on its size
+		mode = 'r+b' if os.path.exists(self.args.filename) else 'w+b'
+		with open(self.args.filename, mode) as f:
+			f.truncate(length)
+			with mmap.mmap(f.fileno(), length) as image:
+				done = [ ] if self.args.restart else journal.load(image)
+				if done:
+					done_length = sum(range_length for (_, range_length) in done)
+					print(f"Resuming dump, {done_length} bytes already read")
+				journal.open(done, image)
+
+				def sink(address, data):
+					image[address - offset:address - offset + len(data)] = data
+					journal.record(address, data)
+
+				success = False
+				try:
+					success = session.read_flash_into(sink, offset, length, chunk_size=chunk_size, compress=self.args.compress,
+									  skip_blank=self.args.skip_blank, stream=self.args.stream, done=done)
+				finally:
+					# Keeps the progress of an interrupted dump
+					image.flush()
+					journal.close(success)
+		if not success:
+			print(f"Dump incomplete, run again to resume from {journal.path}")
 
 class CliCommandWriteFlash(CliCommand):
 	def __init__(self):
@@ -622,6 +2106,8 @@ class CliCommandWriteFlash(CliCommand):
 		parser.add_argument("filename")
 		parser.add_argument("offset", type=int_autobase, nargs="?")
 		parser.add_argument("length", type=int_autobase, nargs="?")
+		parser.add_argument("-z", "--compress", action="store_true", help="Transfer run length encoded pages")
+		parser.add_argument("--full", action="store_true", help="Rewrite all sectors, not only those that differ from the image")
 		self.args = parser.parse_args()
 
 		offset = self.args.offset
@@ -653,18 +2139,384 @@ class CliCommandWriteFlash(CliCommand):
 			print(f"Failed to write to flash, input file shorter than (offset + length)")
 			return False
 
-		for sector_address in range(self.offset, self.offset + self.length, 0x1000):
-			if not session.erase_flash_sector(sector_address):
-				print(f"Failed to erase sector @0x{sector_address:08x}")
+		regions = [ (self.offset, flash_data[self.offset:self.offset + self.length]) ]
+		if not self.args.full:
+			changed = session.changed_regions(regions)
+			if changed is None:
+				print("Loader can not checksum sectors, rewriting all of them")
+			else:
+				changed_bytes = sum(len(data) for (address, data) in changed)
+				print(f"{changed_bytes // 0x1000} of {self.length // 0x1000} sectors differ")
+				regions = changed
+				# Pages that only clear bits are programmed in place, the rest is erased and written
+				if regions and session.supports_conditional_program():
+					regions = session.program_in_place(regions)
+					if regions is None:
+						return False
+
+		return session.write_flash_regions(regions, compress=self.args.compress)
+
+class CliCommandBench(CliCommand):
+	"""
+	Fixed workloads for comparing loader builds, link settings and framing.
+	The write workload overwrites flash and restores the original content
+	afterwards, it only runs with --allow-write.
+	"""
+	WORKLOADS = [ "dump", "write", "verify" ]
+	SECTOR_SIZE = 0x1000
+
+	def parse_args(self, parser):
+		parser.add_argument("--workloads", default="dump,write,verify", help="Comma separated list of " + ", ".join(CliCommandBench.WORKLOADS))
+		parser.add_argument("--length", type=int_autobase, help="Bytes to dump/verify, defaults to flash size")
+		parser.add_argument("--write-length", type=int_autobase, default=0x100000, help="Bytes written by the sparse write workload")
+		parser.add_argument("--chunk-size", type=int_autobase, help="Read chunk size")
+		parser.add_argument("-z", "--compress", action="store_true", help="Run length encoded reads and page programming")
+		parser.add_argument("--skip-blank", action="store_true", help="Skip erased blocks in the dump workload")
+		parser.add_argument("--stream", action="store_true", help="Stream the dump workload with a single command")
+		parser.add_argument("--verify-chunk-size", type=int_autobase, default=0x10000, help="Checksum chunk size")
+		parser.add_argument("--allow-write", action="store_true", help="Run the write workload, flash content is restored afterwards")
+		parser.add_argument("--seed", type=int, default=0, help="Seed for write workload data")
+		parser.add_argument("--json", help="Write results as JSON to this file, - for stdout")
+		self.args = parser.parse_args()
+
+		self.chunk_size = self.args.chunk_size
+		if self.chunk_size is None:
+			self.chunk_size = LoaderSession.COMPRESSED_CHUNK_SIZE if self.args.compress else 4096
+		self.workloads = self.args.workloads.split(",")
+		for workload in self.workloads:
+			if workload not in CliCommandBench.WORKLOADS:
+				print(f"Unknown workload {workload}")
 				return False
+		return True
+
+	def run_workload(self, session, name, payload_bytes, func):
+		session.stats.reset()
+		start = monotonic()
+		success = func()
+		seconds = monotonic() - start
+		stats = session.stats
+		wire_bytes = stats.bytes_tx + stats.bytes_rx
+		return {
+			"success": bool(success),
+			"payload_bytes": payload_bytes,
+			"seconds": round(seconds, 3),
+			"bytes_per_second": round(payload_bytes / seconds) if seconds else None,
+			"wire_tx_bytes": stats.bytes_tx,
+			"wire_rx_bytes": stats.bytes_rx,
+			"wire_efficiency": round(payload_bytes / wire_bytes, 4) if wire_bytes else None,
+			"commands": stats.commands,
+			"retries": stats.retries,
+			"errors": stats.errors,
+			"latency": stats.latency_summary(),
+		}
+
+	def sparse_sectors(self, flash_size):
+		num_sectors = max(1, self.args.write_length // CliCommandBench.SECTOR_SIZE)
+		stride = max(CliCommandBench.SECTOR_SIZE, flash_size // num_sectors // CliCommandBench.SECTOR_SIZE * CliCommandBench.SECTOR_SIZE)
+		return [ sector * stride for sector in range(num_sectors) if sector * stride < flash_size ]
+
+	def bench_write(self, session, flash_size):
+		sectors = self.sparse_sectors(flash_size)
+		rng = random.Random(self.args.seed)
+		regions = [ (address, rng.randbytes(CliCommandBench.SECTOR_SIZE)) for address in sectors ]
+
+		originals = [ ]
+		for address in sectors:
+			data = session.read_flash(address, CliCommandBench.SECTOR_SIZE, chunk_size=self.chunk_size, compress=self.args.compress)
+			if data is None:
+				print(f"Failed to back up sector @0x{address:08x}, not writing")
+				return None
+			originals.append((address, data))
 
-		for page_address in range(self.offset, self.offset + self.length, 256):
-			if not session.program_flash_page(page_address, flash_data[page_address:page_address + 256]):
-				print(f"Failed to write page @0x{sector_address:08x}")
+		def write():
+			if not session.write_flash_regions(regions, compress=self.args.compress):
 				return False
+			checksums = session.remote_flash_checksums((address, len(data)) for (address, data) in regions)
+			return all(checksum == crc32(data) for (checksum, (_, data)) in zip(checksums, regions))
 
+		result = self.run_workload(session, "write", len(sectors) * CliCommandBench.SECTOR_SIZE, write)
+
+		if not session.write_flash_regions(originals, compress=self.args.compress):
+			print("Failed to restore flash content after write benchmark!")
+			result["success"] = False
+		return result
+
+	def execute(self, session):
+		session.verbose = False
+		length = self.args.length
+		flash_size = length
+		flash_info = session.flash_info()
+		if flash_info and isinstance(flash_info, FlashInfoResponse):
+			flash_size = flash_info.flash_size_bytes
+		if flash_size is None:
+			flash_size = 0x800000
+		if length is None:
+			length = flash_size
+
+		results = {
+			"meta": {
+				"timestamp": datetime.now(timezone.utc).isoformat(),
+				"port": self.args.port,
+				"baudrate": session.serial.baudrate,
+				"window": session.window,
+				"chunk_size": self.chunk_size,
+				"compress": self.args.compress,
+				"skip_blank": self.args.skip_blank,
+				"stream": self.args.stream,
+				"verify_chunk_size": self.args.verify_chunk_size,
+				"flash_size": flash_size,
+				"loader": None if self.args.skip_loader else self.args.loader,
+				"loader_sha256": None,
+			},
+			"workloads": { },
+		}
+		if not self.args.skip_loader and os.path.exists(self.args.loader):
+			with open(self.args.loader, 'rb') as f:
+				results["meta"]["loader_sha256"] = hashlib.sha256(f.read()).hexdigest()
+
+		dump = None
+		for workload in self.workloads:
+			print(f"Running {workload} workload")
+			if workload == "dump":
+				def read():
+					nonlocal dump
+					dump = session.read_flash(0, length, chunk_size=self.chunk_size, compress=self.args.compress, skip_blank=self.args.skip_blank, stream=self.args.stream)
+					return dump is not None
+				results["workloads"]["dump"] = self.run_workload(session, "dump", length, read)
+			elif workload == "verify":
+				chunk = self.args.verify_chunk_size
+				regions = [ (address, min(chunk, length - address)) for address in range(0, length, chunk) ]
+				def verify():
+					checksums = session.remote_flash_checksums(regions)
+					if None in checksums:
+						return False
+					if dump is None:
+						return True
+					return all(checksum == crc32(dump[address:address + size]) for (checksum, (address, size)) in zip(checksums, regions))
+				results["workloads"]["verify"] = self.run_workload(session, "verify", length, verify)
+			elif workload == "write":
+				if not self.args.allow_write:
+					print("Skipping write workload, pass --allow-write to run it")
+					continue
+				result = self.bench_write(session, flash_size)
+				if result:
+					results["workloads"]["write"] = result
+
+		for (name, result) in results["workloads"].items():
+			print(f"{name:>6}: {'ok' if result['success'] else 'FAILED'}, {result['payload_bytes']} bytes in {result['seconds']}s, " +
+				f"{result['bytes_per_second']} bytes/s, wire efficiency {result['wire_efficiency']}, " +
+				f"{result['retries']} retries, {result['errors']} errors")
+			for (cmd, latency) in result["latency"].items():
+				print(f"\t{cmd}: {latency['count']} commands, p50 {latency['p50_ms']}ms, p90 {latency['p90_ms']}ms, " +
+					f"p99 {latency['p99_ms']}ms, max {latency['max_ms']}ms")
+
+		if self.args.json == "-":
+			json.dump(results, sys.stdout, indent=2)
+			print()
+		elif self.args.json:
+			with open(self.args.json, 'w') as f:
+				json.dump(results, f, indent=2)
+
+		return all(result["success"] for result in results["workloads"].values())
+
+class CliCommandStats(CliCommand):
+	def parse_args(self, parser):
+		parser.add_argument("--reset", action="store_true", help="Clear the statistics after reading them")
+		self.args = parser.parse_args()
+		return True
+
+	def execute(self, session):
+		stats = session.loader_stats(self.args.reset)
+		if not stats:
+			print("Loader does not support statistics")
+			sys.exit(1)
+		print(stats.format())
+
+class CliCommandProfile(CliCommand):
+	"""
+	Controls the loader's PC sampling profiler and symbolizes its histogram
+	against the loader ELF. Samples attributed to a function are those of
+	the buckets starting inside it, buckets are only as fine as the loader
+	can afford.
+	"""
+	ACTIONS = [ "start", "stop", "clear", "dump" ]
+
+	def parse_args(self, parser):
+		parser.add_argument("action", choices=CliCommandProfile.ACTIONS, nargs="?", default="dump")
+		parser.add_argument("--elf", default=f"{os.path.dirname(os.path.realpath(__file__))}/../device/test", help="Loader ELF for symbols, device/test-host when profiling the host build")
+		parser.add_argument("--top", type=int, default=20, help="Number of functions and buckets to list")
+		self.args = parser.parse_args()
+		return True
+
+	def execute(self, session):
+		flags = {
+			"start": ProfileCommand.FLAG_CLEAR | ProfileCommand.FLAG_START,
+			"stop": ProfileCommand.FLAG_STOP,
+			"clear": ProfileCommand.FLAG_CLEAR,
+			"dump": 0
+		}[self.args.action]
+		profile = session.profile(flags)
+		if not profile:
+			print("Loader does not support profiling")
+			sys.exit(1)
+		state = "running" if profile.running else "stopped"
+		print(f"Profiler {state}, {profile.samples} samples, {profile.outside} outside of the loader, {profile.bucket_size} byte buckets")
+		if not profile.samples or self.args.action in [ "start", "clear" ]:
+			return
+
+		symbols = None
+		if os.path.exists(self.args.elf):
+			symbols = ElfSymbols(self.args.elf)
+		else:
+			print(f"{self.args.elf} not found, showing raw addresses")
+
+		hot = profile.hot_buckets()
+		if symbols:
+			functions = { }
+			for (address, count) in hot:
+				symbol = symbols.lookup(address)
+				name = symbol[0] if symbol else "?"
+				functions[name] = functions.get(name, 0) + count
+			print("Functions:")
+			for (name, count) in sorted(functions.items(), key=lambda item: -item[1])[:self.args.top]:
+				print(f"  {count / profile.samples * 100:5.1f}% {count:8} {name}")
+		print("Buckets:")
+		for (address, count) in hot[:self.args.top]:
+			where = symbols.describe(address) if symbols else ""
+			print(f"  {count / profile.samples * 100:5.1f}% {count:8} 0x{address:06x} {where}")
+
+class CliCommandMicrobench(CliCommand):
+	"""
+	Runs the loader's own benchmarks, which time QSPI reads in every read
+	mode the flash supports, CRC32, memcpy and UART TX on the device, free
+	of host and wire overhead. The loader has no cycle counter, cycles are
+	derived from its timer and --cpu-mhz. The flash write test erases and
+	programs a scratch sector whose content is restored afterwards, it only
+	runs with --allow-write.
+	"""
+	TESTS = [ "qspi", "crc32", "memcpy", "uart", "flash" ]
+
+	def parse_args(self, parser):
+		parser.add_argument("--tests", default="qspi,crc32,memcpy,uart,flash", help="Comma separated list of " + ", ".join(CliCommandMicrobench.TESTS))
+		parser.add_argument("--uart-length", type=int_autobase, default=0x4000, help="Bytes sent by the UART test")
+		parser.add_argument("--scratch-sector", type=int_autobase, help="4 KiB sector used by the flash test, defaults to the last one")
+		parser.add_argument("--allow-write", action="store_true", help="Run the flash test, the scratch sector is restored afterwards")
+		parser.add_argument("--cpu-mhz", type=float, help="CPU clock, reports cycles per byte if given")
+		parser.add_argument("--json", help="Write results as JSON to this file, - for stdout")
+		self.args = parser.parse_args()
+
+		self.tests = self.args.tests.split(",")
+		for test in self.tests:
+			if test not in CliCommandMicrobench.TESTS:
+				print(f"Unknown test {test}")
+				return False
 		return True
 
+	def throughput_result(self, resp):
+		(nbytes, seconds) = resp.throughput()
+		result = {
+			"bytes": nbytes,
+			"seconds": round(seconds, 6),
+			"bytes_per_second": round(nbytes / seconds) if seconds else None,
+			"cycles_per_byte": None,
+		}
+		if self.args.cpu_mhz and nbytes:
+			result["cycles_per_byte"] = round(seconds * self.args.cpu_mhz * 1e6 / nbytes, 2)
+		return result
+
+	def bench_flash(self, session, flash_size):
+		address = self.args.scratch_sector
+		if address is None:
+			address = flash_size - CliCommandBench.SECTOR_SIZE
+		original = session.read_flash(address, CliCommandBench.SECTOR_SIZE)
+		if original is None:
+			print(f"Failed to back up sector @0x{address:08x}, not writing")
+			return None
+
+		resp = session.microbench(BenchCommand.FLASH_WRITE, address)
+		if not session.write_flash_regions([ (address, original) ]):
+			print("Failed to restore flash content after flash test!")
+			return None
+		if not isinstance(resp, BenchResponse):
+			print(f"Flash test failed: {resp}")
+			return None
+
+		(erase_ticks, pages, program_ticks, max_page_ticks) = resp.values
+		return {
+			"address": address,
+			"erase_ms": round(erase_ticks / resp.tick_hz * 1000, 3),
+			"pages": pages,
+			"page_program_avg_ms": round(program_ticks / pages / resp.tick_hz * 1000, 3) if pages else None,
+			"page_program_max_ms": round(max_page_ticks / resp.tick_hz * 1000, 3),
+		}
+
+	def execute(self, session):
+		session.verbose = False
+		chip_id = session.chip_id()
+		flash_info = session.flash_info()
+		flash_size = 0x800000
+		if isinstance(flash_info, FlashInfoResponse):
+			flash_size = flash_info.flash_size_bytes
+
+		results = {
+			"meta": {
+				"timestamp": datetime.now(timezone.utc).isoformat(),
+				"chip_id": repr(chip_id) if chip_id else None,
+				"baudrate": session.serial.baudrate,
+				"cpu_mhz": self.args.cpu_mhz,
+				"flash_size": flash_size,
+				"tick_hz": None,
+			},
+			"tests": { },
+		}
+
+		def run(name, test, arg=0):
+			resp = session.microbench(test, arg)
+			if resp is None:
+				print("Loader does not support benchmarks")
+				sys.exit(1)
+			if not isinstance(resp, BenchResponse):
+				return None
+			results["meta"]["tick_hz"] = resp.tick_hz
+			results["tests"][name] = self.throughput_result(resp)
+			return results["tests"][name]
+
+		for test in self.tests:
+			if test == "qspi":
+				run("qspi_read_legacy", BenchCommand.QSPI_READ, BenchCommand.READ_LEGACY)
+				# Unsupported read modes are rejected by the loader
+				for mode in range(BenchCommand.NUM_FAST_READS):
+					run(f"qspi_read_fast{mode}", BenchCommand.QSPI_READ, 1 + mode)
+			elif test == "crc32":
+				run("crc32", BenchCommand.CRC32)
+			elif test == "memcpy":
+				run("memcpy", BenchCommand.MEMCPY)
+			elif test == "uart":
+				run("uart_tx", BenchCommand.UART_TX, self.args.uart_length)
+			elif test == "flash":
+				if not self.args.allow_write:
+					print("Skipping flash test, pass --allow-write to run it")
+					continue
+				result = self.bench_flash(session, flash_size)
+				if result:
+					results["tests"]["flash_write"] = result
+
+		print(chip_id)
+		for (name, result) in results["tests"].items():
+			if name == "flash_write":
+				print(f"{name:>18}: erase {result['erase_ms']}ms, {result['pages']} pages, " +
+					f"program avg {result['page_program_avg_ms']}ms, max {result['page_program_max_ms']}ms")
+				continue
+			cycles = f", {result['cycles_per_byte']} cycles/byte" if result["cycles_per_byte"] is not None else ""
+			print(f"{name:>18}: {result['bytes']} bytes in {result['seconds']}s, {result['bytes_per_second']} bytes/s{cycles}")
+
+		if self.args.json == "-":
+			json.dump(results, sys.stdout, indent=2)
+			print()
+		elif self.args.json:
+			with open(self.args.json, 'w') as f:
+				json.dump(results, f, indent=2)
+
 class CliCommandReset(CliCommand):
 	def run(self, args, parser):
 		with Bootrom(args.port) as bootrom:
@@ -675,18 +2527,28 @@ CLI_COMMANDS = {
 	"flash_info": CliCommandFlashInfo,
 	"read_flash": CliCommandReadFlash,
 	"write_flash": CliCommandWriteFlash,
+	"bench": CliCommandBench,
+	"stats": CliCommandStats,
+	"profile": CliCommandProfile,
+	"microbench": CliCommandMicrobench,
 	"reset": CliCommandReset,
 }
 
-script_dir = os.path.dirname(os.path.realpath(__file__))
-parser = ArgumentParser(prog="dialogtool.py", description="Dialog UART bootloader tool")
-parser.add_argument("-p", "--port", default="/dev/ttyUSB0")
-parser.add_argument("-b", "--baudrate", type=int, default=230400)
-parser.add_argument("-l", "--loader", default=f"{script_dir}/../device/test.bin")
-parser.add_argument("--skip-loader", action="store_true", help="Skip loader upload")
-parser.add_argument("--initial-baudrate", type=int, default=Bootrom.BAUDRATE, help="Set baudrate used for intial communication")
-parser.add_argument("command", choices=CLI_COMMANDS.keys())
-(args, excess_args) = parser.parse_known_args()
-
-cmd = CLI_COMMANDS[args.command]()
-cmd.run(args, parser)
+def main():
+	script_dir = os.path.dirname(os.path.realpath(__file__))
+	parser = ArgumentParser(prog="dialogtool.py", description="Dialog UART bootloader tool")
+	parser.add_argument("-p", "--port", default="/dev/ttyUSB0")
+	parser.add_argument("-b", "--baudrate", type=baudrate_or_auto, default=230400, help="Baudrate or auto to negotiate the fastest reliable one")
+	parser.add_argument("-l", "--loader", default=f"{script_dir}/../device/test.bin")
+	parser.add_argument("--skip-loader", action="store_true", help="Skip loader upload")
+	parser.add_argument("--stage0", help="Stage 0 stub, e.g. device/stage0.bin, uploaded through the ROM to receive the loader faster")
+	parser.add_argument("-w", "--window", type=int, default=4, help="Maximum number of commands in flight")
+	parser.add_argument("--initial-baudrate", type=int, default=Bootrom.BAUDRATE, help="Set baudrate used for intial communication")
+	parser.add_argument("command", choices=CLI_COMMANDS.keys())
+	(args, excess_args) = parser.parse_known_args()
+
+	cmd = CLI_COMMANDS[args.command]()
+	cmd.run(args, parser)
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,853 @@
+#!/usr/bin/env python3
+
+"""
+Software stand-in for a phone in UART boot mode.
+
+Opens a pseudo-terminal and emulates both the SC14441 ROM bootloader and the
+flash loader protocol on it, backed by an emulated SPI NOR flash. Point
+dialogtool.py at the printed pty (or --link) instead of /dev/ttyUSB0.
+"""
+
+from argparse import ArgumentParser
+import fcntl
+import os
+import random
+import signal
+import struct
+import sys
+import termios
+import threading
+import time
+import tty
+from zlib import crc32
+
+from dialogtool import Bootrom, LoaderSession, Stage0, int_autobase, prbs_bytes, rle_decode, rle_encode
+
+UART_CMD_PING = 0x00
+UART_CMD_SET_BAUDRATE = 0x01
+UART_CMD_FLASH_INFO = 0x02
+UART_CMD_ERASE_SECTOR = 0x03
+UART_CMD_PROGRAM_PAGE = 0x04
+UART_CMD_RESET = 0x05
+UART_CMD_READ_FLASH = 0x06
+UART_CMD_CHECKSUM = 0x07
+UART_CMD_CHIPID = 0x08
+UART_CMD_READ_FLASH_RLE = 0x09
+UART_CMD_PROGRAM_PAGE_RLE = 0x0A
+UART_CMD_BLANK_MAP = 0x0B
+UART_CMD_WRITE_SECTOR = 0x0C
+UART_CMD_ERASE = 0x0D
+UART_CMD_PROGRAM_PAGE_COND = 0x0E
+UART_CMD_PRBS = 0x0F
+UART_CMD_READ_STREAM = 0x10
+UART_CMD_STREAM_ACK = 0x11
+UART_CMD_CONFIRM_BAUDRATE = 0x15
+
+RESPONSE_INVALID_CRC = 0x00
+RESPONSE_CMD_OK = 0x01
+RESPONSE_CMD_INVALID = 0x02
+RESPONSE_PARAM_SHORT = 0x03
+RESPONSE_OK = 0x04
+RESPONSE_DEBUG = 0x05
+RESPONSE_INVALID_PARAM = 0x06
+RESPONSE_ONLINE = 0x07
+RESPONSE_FLASH_TIMEOUT = 0x08
+RESPONSE_CHECKSUM = 0x09
+RESPONSE_FLASH_INFO = 0x0A
+RESPONSE_CHIPID = 0x0B
+RESPONSE_FLASH_DATA_RLE = 0x0C
+RESPONSE_BLANK_MAP = 0x0D
+RESPONSE_PROGRAM_RESULT = 0x0E
+RESPONSE_PRBS = 0x0F
+RESPONSE_STREAM_BLOCK = 0x10
+
+# Mirrors PROGRAM_RESULT_* in device/test.c
+PROGRAM_RESULT_PROGRAMMED = 0x00
+PROGRAM_RESULT_UNCHANGED = 0x01
+PROGRAM_RESULT_NEEDS_ERASE = 0x02
+
+# Mirrors supported_baudrates[] in device/uart.c
+SUPPORTED_BAUDRATES = [ 9600, 19200, 57600, 115200, 230400 ]
+
+# Mirrors READ_STREAM_* and STREAM_* in device/test.c
+READ_STREAM_PARAM_LEN = 16
+READ_STREAM_BLOCK_MAX = 0x1000
+STREAM_ACK_ABORT = 0xFFFFFFFF
+STREAM_NAK_NONE = 0xFFFFFFFF
+# Stands in for TIMEOUT_STREAM_MS in device/test.c
+STREAM_TIMEOUT = 1.0
+
+# Stands in for TIMEOUT_BAUDRATE_CONFIRM in device/test.c
+BAUDRATE_CONFIRM_TIMEOUT = 2.0
+
+# ROM payloads up to this size are taken for device/stage0.c, the loader is several KiB
+STAGE0_MAX_SIZE = 1024
+# Mirrors __loader_end - __loader_start in device/stage0.ld
+STAGE0_LOADER_MAX = 0x13800 - 0x10080
+
+# Mirrors CMD_PARAM_MAX_LEN in device/test.c
+CMD_PARAM_MAX_LEN = 4 + 256
+# Mirrors WRITE_SECTOR_PARAM_LEN in device/test.c
+WRITE_SECTOR_SIZE = 0x1000
+WRITE_SECTOR_PARAM_LEN = 4 + 4 + (WRITE_SECTOR_SIZE // 256) * (256 + 4)
+
+class FlashModel():
+	PAGE_SIZE = 256
+	ERASE_TIME_MULTIPLIER = 1
+	ERASE_TIME_UNITS_MS = [ 1, 16, 128, 1000 ]
+
+	def __init__(self, size, image=None, jedec_id=0xEF4017, latency_scale=1.0, qspi_rate=4000000):
+		self.size = size
+		self.data = bytearray(b'\xff' * size)
+		if image:
+			self.data[:len(image)] = image[:size]
+		self.jedec_id = jedec_id
+		self.latency_scale = latency_scale
+		self.qspi_rate = qspi_rate
+		# (size exponent, opcode, typical erase time in seconds), W25Q64 datasheet values
+		self.erase_types = [ (12, 0x20, 0.045), (15, 0x52, 0.120), (16, 0xD8, 0.150) ]
+		self.page_program_time = 0.0007
+
+	def sfdp(self):
+		"""SFDP header, one parameter header and a JESD216B basic flash parameter table"""
+		bfpt = bytearray(b'\xff' * 64)
+		# 4 KiB erase supported, 3 byte addressing, 1-1-2, 1-2-2, 1-4-4, 1-1-4 fast read
+		bfpt[0:4] = bytes([ 0xE5, 0x20, 0x71, 0xFF ])
+		bfpt[4:8] = struct.pack("<L", self.size * 8 - 1)
+		# 1-4-4: 4 wait + 2 mode clocks, 1-1-4: 8 wait clocks
+		bfpt[8:12] = bytes([ 0x44, 0xEB, 0x08, 0x6B ])
+		# 1-1-2: 8 wait clocks, 1-2-2: 0 wait + 4 mode clocks
+		bfpt[12:16] = bytes([ 0x08, 0x3B, 0x80, 0xBB ])
+		# No 2-2-2/4-4-4
+		bfpt[16:20] = bytes([ 0xEE, 0xFF, 0xFF, 0xFF ])
+		bfpt[20:28] = bytes([ 0xFF ] * 8)
+		erase_types = self.erase_types + [ (0, 0, 0) ] * (4 - len(self.erase_types))
+		for (i, (exponent, opcode, _)) in enumerate(erase_types):
+			bfpt[28 + i * 2:30 + i * 2] = bytes([ exponent, opcode ])
+		# Typical erase times, max = typ * 2 * (multiplier + 1)
+		erase_times = FlashModel.ERASE_TIME_MULTIPLIER
+		for (i, (_, _, seconds)) in enumerate(erase_types):
+			(count, units) = FlashModel.encode_erase_time(seconds)
+			erase_times |= (count | units << 5) << (4 + i * 7)
+		bfpt[36:40] = struct.pack("<L", erase_times)
+
+		header = b'SFDP' + bytes([ 0x06, 0x01, 0x00, 0xFF ])
+		parameter_header = bytes([ 0x00, 0x06, 0x01, len(bfpt) // 4, 0x80, 0x00, 0x00, 0xFF ])
+		sfdp = bytearray(b'\xff' * (0x80 + len(bfpt)))
+		sfdp[0:8] = header
+		sfdp[8:16] = parameter_header
+		sfdp[0x80:] = bfpt
+		return bytes(sfdp)
+
+	@staticmethod
+	def encode_erase_time(seconds):
+		if not seconds:
+			return (0, 0)
+		for (units, scale) in enumerate([ 0.001, 0.016, 0.128, 1.0 ]):
+			count = round(seconds / scale)
+			if count <= 32:
+				return (max(count, 1) - 1, units)
+		return (31, 3)
+
+	def erase_info(self):
+		"""(size exponent, opcode, typ ms, max ms) of each erase type as the loader reports them from SFDP"""
+		info = [ ]
+		for (exponent, opcode, seconds) in self.erase_types:
+			(count, units) = FlashModel.encode_erase_time(seconds)
+			typ_ms = (count + 1) * FlashModel.ERASE_TIME_UNITS_MS[units]
+			info.append((exponent, opcode, typ_ms, typ_ms * 2 * (FlashModel.ERASE_TIME_MULTIPLIER + 1)))
+		return info + [ (0, 0, 0, 0) ] * (4 - len(info))
+
+	def address(self, address):
+		return address % self.size
+
+	def read(self, address, length):
+		address = self.address(address)
+		data = self.data[address:address + length]
+		while len(data) < length:
+			data += self.data[:length - len(data)]
+		return bytes(data)
+
+	def read_time(self, length):
+		return length / self.qspi_rate
+
+	def erase(self, opcode, address):
+		for (exponent, erase_opcode, seconds) in self.erase_types:
+			if erase_opcode == opcode:
+				size = 1 << exponent
+				start = self.address(address) & ~(size - 1)
+				self.data[start:start + size] = b'\xff' * size
+				return seconds * self.latency_scale
+		return None
+
+	def program(self, address, data):
+		address = self.address(address)
+		page = address & ~(FlashModel.PAGE_SIZE - 1)
+		offset = address - page
+		# Data past the end of the page wraps around to its start
+		for byt in data[-FlashModel.PAGE_SIZE:]:
+			self.data[page + offset] &= byt
+			offset = (offset + 1) % FlashModel.PAGE_SIZE
+		return self.page_program_time * self.latency_scale
+
+class LinkStats():
+	def __init__(self):
+		self.bytes_rx = 0
+		self.bytes_tx = 0
+		self.frames = 0
+		self.crc_errors = 0
+		self.overflow_bytes = 0
+		self.corrupted = 0
+		self.dropped = 0
+
+	def __repr__(self):
+		return f"rx {self.bytes_rx} bytes, tx {self.bytes_tx} bytes, {self.frames} frames, " + \
+			f"{self.crc_errors} CRC errors, {self.overflow_bytes} bytes lost to RX overflow, " + \
+			f"{self.corrupted} bytes corrupted, {self.dropped} bytes dropped"
+
+class PtyLink():
+	# struct termios2, c_ospeed is the last field
+	TCGETS2 = 0x802C542A
+	TERMIOS2_LENGTH = 44
+
+	# Bit flip probability per byte above the reliable baudrate
+	UNRELIABLE_CORRUPT = 0.01
+
+	def __init__(self, pace=True, corrupt=0.0, drop=0.0, fault_direction="both", seed=None, reliable_baudrate=None):
+		(self.master, self.slave) = os.openpty()
+		# No echo or line editing before the host opened the port
+		tty.setraw(self.slave)
+		self.name = os.ttyname(self.slave)
+		self.baudrate = Bootrom.BAUDRATE
+		self.pace = pace
+		self.corrupt = corrupt
+		self.drop = drop
+		self.fault_direction = fault_direction
+		self.reliable_baudrate = reliable_baudrate
+		self.random = random.Random(seed)
+		self.stats = LinkStats()
+		self.tx_free = 0
+		self.rx_free = 0
+		self.rx = bytearray()
+		self.rx_capacity = None
+		self.rx_reserved = 0
+		self.rx_available = threading.Condition()
+		self.reader = threading.Thread(target=self.receive, daemon=True)
+		self.reader.start()
+
+	def host_baudrate(self):
+		termios2 = fcntl.ioctl(self.master, PtyLink.TCGETS2, bytes(PtyLink.TERMIOS2_LENGTH))
+		return struct.unpack("<L", termios2[-4:])[0]
+
+	def output_pending(self):
+		return struct.unpack("i", fcntl.ioctl(self.slave, termios.FIONREAD, bytes(4)))[0]
+
+	def byte_time(self):
+		return 10 / self.baudrate
+
+	def inject_faults(self, data, direction):
+		if self.host_baudrate() != self.baudrate:
+			# Framing errors all over the place, roughly one byte per byte
+			self.stats.corrupted += len(data)
+			return bytes(self.random.getrandbits(8) for _ in data)
+		corrupt = self.corrupt
+		if self.reliable_baudrate and self.baudrate > self.reliable_baudrate:
+			# Models an adapter or cable that can not keep up, in both directions
+			corrupt = max(corrupt, PtyLink.UNRELIABLE_CORRUPT)
+		elif self.fault_direction not in (direction, "both"):
+			return data
+		if not (corrupt or self.drop):
+			return data
+		out = bytearray()
+		for byt in data:
+			if self.drop and self.random.random() < self.drop:
+				self.stats.dropped += 1
+				continue
+			if corrupt and self.random.random() < corrupt:
+				byt ^= 1 << self.random.randrange(8)
+				self.stats.corrupted += 1
+			out.append(byt)
+		return bytes(out)
+
+	def pace_bytes(self, free, length):
+		if not self.pace:
+			return free
+		now = time.monotonic()
+		free = max(free, now) + length * self.byte_time()
+		if free > now:
+			time.sleep(free - now)
+		return free
+
+	def receive(self):
+		while True:
+			data = os.read(self.master, 64)
+			self.rx_free = self.pace_bytes(self.rx_free, len(data))
+			data = self.inject_faults(data, "rx")
+			self.stats.bytes_rx += len(data)
+			with self.rx_available:
+				self.rx += data
+				if self.rx_capacity is not None:
+					# The loader RX ring silently overwrites unread data
+					overflow = len(self.rx) + self.rx_reserved - self.rx_capacity
+					if overflow > 0:
+						del self.rx[-overflow:]
+						self.stats.overflow_bytes += overflow
+				self.rx_available.notify_all()
+
+	def write(self, data):
+		data = self.inject_faults(data, "tx")
+		for offset in range(0, len(data), 64):
+			chunk = data[offset:offset + 64]
+			while chunk:
+				written = os.write(self.master, chunk)
+				chunk = chunk[written:]
+			self.tx_free = self.pace_bytes(self.tx_free, len(data[offset:offset + 64]))
+		self.stats.bytes_tx += len(data)
+
+	def read(self, length, timeout=None):
+		deadline = None if timeout is None else time.monotonic() + timeout
+		with self.rx_available:
+			while len(self.rx) < length:
+				remaining = None if deadline is None else deadline - time.monotonic()
+				if remaining is not None and remaining <= 0:
+					break
+				self.rx_available.wait(remaining)
+			data = bytes(self.rx[:length])
+			del self.rx[:length]
+			return data
+
+	def peek(self, length, timeout=None):
+		deadline = None if timeout is None else time.monotonic() + timeout
+		with self.rx_available:
+			while len(self.rx) < length:
+				remaining = None if deadline is None else deadline - time.monotonic()
+				if remaining is not None and remaining <= 0:
+					return None
+				self.rx_available.wait(remaining)
+			return bytes(self.rx[:length])
+
+	def flush_input(self):
+		with self.rx_available:
+			self.rx.clear()
+
+class LoaderSim():
+	def __init__(self, link, flash, chipid=b'441\x00\x11', bootrom=True, idle_reset=None, verbose=False):
+		self.link = link
+		self.flash = flash
+		self.chipid = chipid
+		self.bootrom = bootrom
+		self.idle_reset = idle_reset
+		self.verbose = verbose
+		self.baudrate_fallback = None
+		self.baudrate_confirm_deadline = None
+		self.handlers = {
+			UART_CMD_PING: self.handle_ping,
+			UART_CMD_SET_BAUDRATE: self.handle_set_baudrate,
+			UART_CMD_FLASH_INFO: self.handle_flash_info,
+			UART_CMD_ERASE_SECTOR: self.handle_erase_sector,
+			UART_CMD_PROGRAM_PAGE: self.handle_program_page,
+			UART_CMD_RESET: self.handle_reset,
+			UART_CMD_READ_FLASH: self.handle_read_flash,
+			UART_CMD_CHECKSUM: self.handle_checksum,
+			UART_CMD_CHIPID: self.handle_chipid,
+			UART_CMD_READ_FLASH_RLE: self.handle_read_flash_rle,
+			UART_CMD_PROGRAM_PAGE_RLE: self.handle_program_page_rle,
+			UART_CMD_BLANK_MAP: self.handle_blank_map,
+			UART_CMD_WRITE_SECTOR: self.handle_write_sector,
+			UART_CMD_ERASE: self.handle_erase,
+			UART_CMD_PROGRAM_PAGE_COND: self.handle_program_page_cond,
+			UART_CMD_PRBS: self.handle_prbs,
+			UART_CMD_READ_STREAM: self.handle_read_stream,
+			UART_CMD_STREAM_ACK: self.handle_stream_ack,
+			UART_CMD_CONFIRM_BAUDRATE: self.handle_confirm_baudrate,
+		}
+		self.min_param_len = {
+			UART_CMD_SET_BAUDRATE: 4,
+			UART_CMD_ERASE_SECTOR: 4,
+			UART_CMD_PROGRAM_PAGE: 4 + 256,
+			UART_CMD_READ_FLASH: 8,
+			UART_CMD_CHECKSUM: 8,
+			UART_CMD_READ_FLASH_RLE: 8,
+			UART_CMD_PROGRAM_PAGE_RLE: 4 + 1,
+			UART_CMD_BLANK_MAP: 12,
+			UART_CMD_WRITE_SECTOR: WRITE_SECTOR_PARAM_LEN,
+			UART_CMD_ERASE: 5,
+			UART_CMD_PROGRAM_PAGE_COND: 4 + 256,
+			UART_CMD_PRBS: 8,
+			UART_CMD_READ_STREAM: READ_STREAM_PARAM_LEN,
+			UART_CMD_STREAM_ACK: 8,
+		}
+		# Handlers reading their parameters from the link as they arrive
+		self.streamed = [ UART_CMD_WRITE_SECTOR, UART_CMD_READ_STREAM ]
+
+	def log(self, msg):
+		if self.verbose:
+			print(msg, file=sys.stderr)
+
+	def run(self):
+		while True:
+			if self.bootrom:
+				payload = self.run_bootrom()
+				# A failed stage 0 waits for the host to reset the chip
+				if len(payload) <= STAGE0_MAX_SIZE and not self.run_stage0():
+					continue
+			self.run_loader()
+
+	def run_bootrom(self):
+		self.link.rx_capacity = None
+		self.link.baudrate = Bootrom.BAUDRATE
+		self.log("ROM: waiting for host")
+		while True:
+			# Like a real line, STX sent while nobody listens is lost
+			if not self.link.output_pending():
+				self.link.write(bytes([ Bootrom.STX ]))
+			soh = self.link.read(1, timeout=0.1)
+			if soh != bytes([ Bootrom.SOH ]):
+				continue
+			hdr = self.link.read(2, timeout=1)
+			if len(hdr) < 2:
+				continue
+			length = struct.unpack("<H", hdr)[0]
+			self.link.write(bytes([ Bootrom.ACK ]))
+			payload = self.link.read(length, timeout=1 + length * 10 / self.link.baudrate * 2)
+			if len(payload) < length:
+				self.log(f"ROM: payload truncated, {len(payload)}/{length} bytes")
+				continue
+			checksum = 0
+			for byt in payload:
+				checksum ^= byt
+			self.link.write(bytes([ checksum ]))
+			ack = self.link.read(2, timeout=1)
+			if ack[:1] == bytes([ Bootrom.ACK ]):
+				self.log(f"ROM: starting {length} byte payload")
+				return payload
+
+	def run_stage0(self):
+		self.link.write(bytes([ Stage0.READY ]))
+		hdr = self.link.read(12, timeout=2)
+		if len(hdr) < 12:
+			self.log("Stage 0: header truncated")
+			return False
+		(baudrate_code, flags, length, checksum, hdr_checksum) = struct.unpack("<BBHLL", hdr)
+		if hdr_checksum != crc32(hdr[:8]) or baudrate_code >= len(Stage0.BAUDRATES) or length > STAGE0_LOADER_MAX:
+			self.link.write(bytes([ Bootrom.NACK ]))
+			return False
+		self.link.write(bytes([ Bootrom.ACK ]))
+		self.link.baudrate = Stage0.BAUDRATES[baudrate_code]
+
+		if flags & Stage0.FLAG_RLE:
+			# Decoding as bytes arrive ends exactly at the end of the encoded data
+			encoded = bytearray()
+			loader = None
+			while loader is None or len(loader) < length:
+				data = self.link.read(1, timeout=1)
+				if not data:
+					self.log("Stage 0: loader truncated")
+					return False
+				encoded += data + self.link.read(STAGE0_LOADER_MAX, timeout=0)
+				loader = rle_decode(bytes(encoded))
+				if loader is not None and len(loader) > length:
+					break
+		else:
+			loader = self.link.read(length, timeout=1 + length * 10 / self.link.baudrate * 2)
+		if loader is None or len(loader) != length or crc32(loader) != checksum:
+			self.link.write(bytes([ Bootrom.NACK ]))
+			return False
+		self.link.write(bytes([ Bootrom.ACK ]))
+		self.log(f"Stage 0: starting {length} byte loader at {self.link.baudrate} baud")
+		return True
+
+	def send_response(self, response, id, payload=None):
+		hdr = struct.pack("<BBLL", LoaderSession.SYNC_BYTE, response, id, len(payload) if payload else 0)
+		data = hdr + crc32(hdr).to_bytes(4, byteorder="little")
+		if payload:
+			data += payload + crc32(payload).to_bytes(4, byteorder="little")
+		self.link.write(data)
+
+	def debug(self, msg):
+		self.send_response(RESPONSE_DEBUG, 0xFFFFFFFF, msg.encode())
+
+	def run_loader(self):
+		self.link.rx_capacity = LoaderSession.RX_BUFFER_SIZE - 1
+		self.link.flush_input()
+		self.debug("SVC call returned\r\n")
+		self.debug(f"Flash size {self.flash.size} bytes\r\n")
+		for _ in range(3):
+			self.send_response(RESPONSE_ONLINE, 0xFFFFFFFF)
+
+		while True:
+			frame = self.receive_frame()
+			if frame is None:
+				if self.idle_reset:
+					self.debug("Timeout elapsed, resetting\r\n")
+					return
+				continue
+			(cmd, id, params) = frame
+			handler = self.handlers.get(cmd)
+			self.log(f"Loader: cmd 0x{cmd:02x}, id {id}, {'streamed' if params is None else len(params)} bytes of parameters")
+			if not handler:
+				self.send_response(RESPONSE_CMD_INVALID, id)
+				continue
+			if handler(id, params) == "reset":
+				return
+			# Like the loader, the confirm window restarts after every command
+			if self.baudrate_confirm_deadline is not None:
+				self.baudrate_confirm_deadline = time.monotonic() + BAUDRATE_CONFIRM_TIMEOUT
+
+	def check_baudrate_confirm(self):
+		"""Revert an unconfirmed baudrate change once its deadline passed, True if it is still pending"""
+		if self.baudrate_confirm_deadline is None:
+			return False
+		if time.monotonic() < self.baudrate_confirm_deadline:
+			return True
+		self.debug("Baudrate not confirmed, reverting\r\n")
+		self.link.baudrate = self.baudrate_fallback
+		self.link.flush_input()
+		self.baudrate_confirm_deadline = None
+		return False
+
+	def receive_frame(self):
+		while True:
+			pending = self.check_baudrate_confirm()
+			timeout = self.idle_reset
+			if pending:
+				timeout = max(0, self.baudrate_confirm_deadline - time.monotonic())
+				if self.idle_reset:
+					timeout = min(timeout, self.idle_reset)
+			sync = self.link.read(1, timeout=timeout)
+			if not sync:
+				if pending:
+					continue
+				return None
+			if sync[0] != LoaderSession.SYNC_BYTE:
+				continue
+			hdr = self.link.peek(13, timeout=1)
+			if hdr is None:
+				continue
+			(cmd, id, parameter_len, crc) = struct.unpack("<BLLL", hdr)
+			if crc32(hdr[:9]) != crc:
+				self.link.stats.crc_errors += 1
+				self.debug("Invalid CRC32 on header\r\n")
+				self.send_response(RESPONSE_INVALID_CRC, id)
+				continue
+			self.link.read(13)
+			if cmd in self.handlers and parameter_len < self.min_param_len.get(cmd, 0):
+				self.send_response(RESPONSE_PARAM_SHORT, id)
+				continue
+			if cmd in self.streamed:
+				if parameter_len != self.min_param_len[cmd]:
+					self.send_response(RESPONSE_INVALID_PARAM, id)
+					continue
+				self.link.stats.frames += 1
+				return (cmd, id, None)
+			if parameter_len > CMD_PARAM_MAX_LEN:
+				self.send_response(RESPONSE_INVALID_PARAM, id)
+				continue
+			if not parameter_len:
+				self.link.stats.frames += 1
+				return (cmd, id, b'')
+			params = self.link.read(parameter_len + 4, timeout=1 + (parameter_len + 4) * self.link.byte_time())
+			if len(params) < parameter_len + 4:
+				self.link.stats.crc_errors += 1
+				continue
+			if crc32(params[:-4]) != int.from_bytes(params[-4:], byteorder="little"):
+				self.link.stats.crc_errors += 1
+				self.debug("Invalid CRC32 on params\r\n")
+				self.send_response(RESPONSE_INVALID_CRC, id)
+				continue
+			self.link.stats.frames += 1
+			return (cmd, id, params[:-4])
+
+	def handle_ping(self, id, params):
+		self.send_response(RESPONSE_OK, id, struct.pack("<L", LoaderSession.RX_BUFFER_SIZE))
+
+	def handle_set_baudrate(self, id, params):
+		baudrate = struct.unpack("<L", params[:4])[0]
+		if baudrate not in SUPPORTED_BAUDRATES:
+			self.send_response(RESPONSE_INVALID_PARAM, id)
+			return
+		self.send_response(RESPONSE_OK, id)
+		if baudrate != self.link.baudrate:
+			# Fall back to the last confirmed baudrate
+			if self.baudrate_confirm_deadline is None:
+				self.baudrate_fallback = self.link.baudrate
+			self.baudrate_confirm_deadline = time.monotonic() + BAUDRATE_CONFIRM_TIMEOUT
+		self.link.baudrate = baudrate
+
+	def handle_confirm_baudrate(self, id, params):
+		self.baudrate_confirm_deadline = None
+		self.send_response(RESPONSE_OK, id)
+
+	def handle_flash_info(self, id, params):
+		payload = struct.pack("<L", self.flash.size)
+		for (exponent, opcode, typ_ms, max_ms) in self.flash.erase_info():
+			payload += struct.pack("<BBHH", exponent, opcode, min(typ_ms, 0xffff), min(max_ms, 0xffff))
+		self.send_response(RESPONSE_FLASH_INFO, id, payload)
+
+	def handle_erase_sector(self, id, params):
+		address = struct.unpack("<L", params[:4])[0]
+		time.sleep(self.flash.erase(0x20, address))
+		self.send_response(RESPONSE_OK, id)
+
+	def handle_erase(self, id, params):
+		(address, erase_type) = struct.unpack("<LB", params[:5])
+		erase_info = self.flash.erase_info()
+		if erase_type >= len(erase_info):
+			self.send_response(RESPONSE_INVALID_PARAM, id)
+			return
+		(exponent, opcode, _, _) = erase_info[erase_type]
+		if exponent < 12 or address % (1 << exponent):
+			self.send_response(RESPONSE_INVALID_PARAM, id)
+			return
+		time.sleep(self.flash.erase(opcode, address))
+		self.send_response(RESPONSE_OK, id)
+
+	def handle_write_sector(self, id, params):
+		timeout = 1
+		address_buf = self.link.read(8, timeout=timeout)
+		if len(address_buf) < 8:
+			self.send_response(RESPONSE_PARAM_SHORT, id)
+			return
+		frame_crc = crc32(address_buf)
+		address = struct.unpack("<L", address_buf[:4])[0]
+		if crc32(address_buf[:4]) != struct.unpack("<L", address_buf[4:])[0]:
+			self.send_response(RESPONSE_INVALID_CRC, id)
+			return
+		if address % WRITE_SECTOR_SIZE:
+			self.send_response(RESPONSE_INVALID_PARAM, id)
+			return
+		# Pages keep arriving while the erase runs
+		time.sleep(self.flash.erase(0x20, address))
+
+		for offset in range(0, WRITE_SECTOR_SIZE, FlashModel.PAGE_SIZE):
+			record = self.link.read(FlashModel.PAGE_SIZE + 4, timeout=timeout)
+			if len(record) < FlashModel.PAGE_SIZE + 4:
+				self.send_response(RESPONSE_PARAM_SHORT, id)
+				return
+			frame_crc = crc32(record, frame_crc)
+			page = record[:FlashModel.PAGE_SIZE]
+			if crc32(page) != struct.unpack("<L", record[FlashModel.PAGE_SIZE:])[0]:
+				self.send_response(RESPONSE_INVALID_CRC, id)
+				return
+			if page.count(0xFF) != len(page):
+				time.sleep(self.flash.program(address + offset, page))
+			self.send_response(RESPONSE_CMD_OK, id)
+
+		crc = self.link.read(4, timeout=timeout)
+		if len(crc) < 4 or struct.unpack("<L", crc)[0] != frame_crc:
+			self.send_response(RESPONSE_INVALID_CRC, id)
+			return
+		self.send_response(RESPONSE_OK, id)
+
+	def handle_program_page(self, id, params):
+		address = struct.unpack("<L", params[:4])[0]
+		time.sleep(self.flash.program(address, params[4:4 + FlashModel.PAGE_SIZE]))
+		self.send_response(RESPONSE_OK, id)
+
+	def handle_program_page_cond(self, id, params):
+		address = struct.unpack("<L", params[:4])[0]
+		data = params[4:4 + FlashModel.PAGE_SIZE]
+		if address % FlashModel.PAGE_SIZE:
+			self.send_response(RESPONSE_INVALID_PARAM, id)
+			return
+		time.sleep(self.flash.read_time(FlashModel.PAGE_SIZE))
+		current = self.flash.read(address, FlashModel.PAGE_SIZE)
+		if current == data:
+			result = PROGRAM_RESULT_UNCHANGED
+		elif any(old & new != new for (old, new) in zip(current, data)):
+			result = PROGRAM_RESULT_NEEDS_ERASE
+		else:
+			result = PROGRAM_RESULT_PROGRAMMED
+			time.sleep(self.flash.program(address, data))
+		self.send_response(RESPONSE_PROGRAM_RESULT, id, bytes([ result ]))
+
+	def handle_program_page_rle(self, id, params):
+		address = struct.unpack("<L", params[:4])[0]
+		data = rle_decode(params[4:])
+		if not data or len(data) > FlashModel.PAGE_SIZE:
+			self.send_response(RESPONSE_INVALID_PARAM, id)
+			return
+		time.sleep(self.flash.program(address, data))
+		self.send_response(RESPONSE_OK, id)
+
+	def handle_reset(self, id, params):
+		self.send_response(RESPONSE_OK, id)
+		return "reset"
+
+	def handle_read_flash(self, id, params):
+		(address, length) = struct.unpack("<LL", params[:8])
+		data = self.flash.read(address, length)
+		self.send_response(RESPONSE_OK, id, data)
+
+	def handle_read_flash_rle(self, id, params):
+		(address, length) = struct.unpack("<LL", params[:8])
+		# The loader reads flash twice, once to size the response
+		time.sleep(self.flash.read_time(length))
+		self.send_response(RESPONSE_FLASH_DATA_RLE, id, rle_encode(self.flash.read(address, length)))
+
+	def handle_blank_map(self, id, params):
+		(address, length, block_size) = struct.unpack("<LLL", params[:12])
+		if not length or not block_size:
+			self.send_response(RESPONSE_INVALID_PARAM, id)
+			return
+		data = self.flash.read(address, length)
+		blank_map = bytearray((len(range(0, length, block_size)) + 7) // 8)
+		for (block, offset) in enumerate(range(0, length, block_size)):
+			block_data = data[offset:offset + block_size]
+			if block_data.count(0xFF) == len(block_data):
+				blank_map[block // 8] |= 1 << (block % 8)
+		# Worst case, the loader stops reading a block at its first programmed byte
+		time.sleep(self.flash.read_time(length))
+		self.send_response(RESPONSE_BLANK_MAP, id, bytes(blank_map))
+
+	def handle_checksum(self, id, params):
+		(address, length) = struct.unpack("<LL", params[:8])
+		block_size = struct.unpack("<L", params[8:12])[0] if len(params) >= 12 else 0
+		if block_size and not length:
+			self.send_response(RESPONSE_INVALID_PARAM, id)
+			return
+		time.sleep(self.flash.read_time(length))
+		data = self.flash.read(address, length)
+		if block_size:
+			blocks = [ data[offset:offset + block_size] for offset in range(0, length, block_size) ]
+		else:
+			blocks = [ data ]
+		checksums = b''.join(crc32(block).to_bytes(4, byteorder="little") for block in blocks)
+		self.send_response(RESPONSE_CHECKSUM, id, checksums)
+
+	def send_stream_block(self, id, start, length, block_size, seq):
+		offset = seq * block_size
+		block_length = min(block_size, length - offset)
+		time.sleep(self.flash.read_time(block_length))
+		self.send_response(RESPONSE_STREAM_BLOCK, id, struct.pack("<L", seq) + self.flash.read(start + offset, block_length))
+
+	def poll_stream_ack(self, id, timeout):
+		"""(ack, nak) of the next STREAM_ACK frame for the stream, None if none arrived in time"""
+		deadline = time.monotonic() + timeout
+		while True:
+			remaining = max(0, deadline - time.monotonic())
+			sync = self.link.peek(1, timeout=remaining)
+			if sync is None:
+				return None
+			if sync[0] != LoaderSession.SYNC_BYTE:
+				self.link.read(1)
+				continue
+			hdr = self.link.peek(14, timeout=max(remaining, 1))
+			if hdr is None:
+				return None
+			(cmd, frame_id, parameter_len, crc) = struct.unpack("<BLLL", hdr[1:])
+			if crc32(hdr[1:10]) != crc:
+				self.link.read(1)
+				continue
+			if cmd != UART_CMD_STREAM_ACK or frame_id != id or parameter_len != 8:
+				# Commands are rejected and skipped whole, stale acknowledgements need no response
+				if cmd != UART_CMD_STREAM_ACK:
+					self.send_response(RESPONSE_CMD_INVALID, frame_id)
+				self.link.read(14)
+				if parameter_len:
+					self.link.read(parameter_len + 4, timeout=1)
+				continue
+			frame = self.link.peek(14 + 8 + 4, timeout=1)
+			if frame is None:
+				return None
+			self.link.read(len(frame))
+			if crc32(frame[14:22]) != int.from_bytes(frame[22:], byteorder="little"):
+				continue
+			return struct.unpack("<LL", frame[14:22])
+
+	def handle_read_stream(self, id, params):
+		params = self.link.read(READ_STREAM_PARAM_LEN + 4, timeout=1)
+		if len(params) < READ_STREAM_PARAM_LEN + 4:
+			self.send_response(RESPONSE_PARAM_SHORT, id)
+			return
+		if crc32(params[:-4]) != int.from_bytes(params[-4:], byteorder="little"):
+			self.send_response(RESPONSE_INVALID_CRC, id)
+			return
+		(start, length, block_size, credits) = struct.unpack("<LLLL", params[:-4])
+		if not length or not block_size or block_size > READ_STREAM_BLOCK_MAX or not credits:
+			self.send_response(RESPONSE_INVALID_PARAM, id)
+			return
+
+		num_blocks = (length + block_size - 1) // block_size
+		next_seq = 0
+		acked = 0
+		while acked < num_blocks:
+			can_send = next_seq < num_blocks and next_seq - acked < credits
+			ack_nak = self.poll_stream_ack(id, 0 if can_send else STREAM_TIMEOUT)
+			if ack_nak:
+				(ack, nak) = ack_nak
+				if ack == STREAM_ACK_ABORT:
+					break
+				if acked < ack <= next_seq:
+					acked = ack
+				if nak != STREAM_NAK_NONE and nak < next_seq:
+					self.send_stream_block(id, start, length, block_size, nak)
+			elif can_send:
+				self.send_stream_block(id, start, length, block_size, next_seq)
+				next_seq += 1
+			else:
+				self.debug("Stream timed out\r\n")
+				return
+		self.send_response(RESPONSE_OK, id)
+
+	def handle_stream_ack(self, id, params):
+		# Acknowledgements that arrive after their stream ended are dropped silently
+		pass
+
+	def handle_prbs(self, id, params):
+		(seed, length) = struct.unpack("<LL", params[:8])
+		if not seed or params[8:] != prbs_bytes(seed, len(params) - 8):
+			self.send_response(RESPONSE_INVALID_PARAM, id)
+			return
+		self.send_response(RESPONSE_PRBS, id, prbs_bytes(seed, length))
+
+	def handle_chipid(self, id, params):
+		self.send_response(RESPONSE_CHIPID, id, self.chipid)
+
+def main():
+	parser = ArgumentParser(prog="loader_sim.py", description="Dialog UART boot and loader simulator")
+	parser.add_argument("-f", "--flash", help="Initial flash content")
+	parser.add_argument("-o", "--output", help="Write flash content to this file on exit")
+	parser.add_argument("-s", "--size", type=int_autobase, default=0x800000, help="Flash size in bytes")
+	parser.add_argument("--link", help="Create a symlink to the pty at this path")
+	parser.add_argument("--skip-bootrom", action="store_true", help="Start in loader mode, for dialogtool.py --skip-loader")
+	parser.add_argument("--no-pace", action="store_true", help="Do not limit throughput to the emulated baudrate")
+	parser.add_argument("--corrupt", type=float, default=0.0, help="Probability of flipping a bit in a byte")
+	parser.add_argument("--drop", type=float, default=0.0, help="Probability of dropping a byte")
+	parser.add_argument("--fault-direction", choices=[ "rx", "tx", "both" ], default="both", help="Apply faults to data received (rx) or sent (tx) by the device")
+	parser.add_argument("--seed", type=int, help="Random seed for reproducible faults")
+	parser.add_argument("--reliable-baudrate", type=int, help="Corrupt data at baudrates above this one")
+	parser.add_argument("--latency-scale", type=float, default=1.0, help="Scale flash erase/program latencies")
+	parser.add_argument("--idle-reset", type=float, help="Reset to ROM after this many seconds without a command")
+	parser.add_argument("-v", "--verbose", action="store_true")
+	args = parser.parse_args()
+
+	image = None
+	if args.flash:
+		with open(args.flash, 'rb') as f:
+			image = f.read()
+	flash = FlashModel(args.size, image, latency_scale=args.latency_scale)
+	link = PtyLink(not args.no_pace, args.corrupt, args.drop, args.fault_direction, args.seed, args.reliable_baudrate)
+	if args.link:
+		if os.path.islink(args.link):
+			os.unlink(args.link)
+		os.symlink(link.name, args.link)
+	print(f"Simulated device on {link.name}", flush=True)
+
+	# Save flash content when stopped by a test harness as well
+	signal.signal(signal.SIGTERM, lambda *_: sys.exit(0))
+	sim = LoaderSim(link, flash, bootrom=not args.skip_bootrom, idle_reset=args.idle_reset, verbose=args.verbose)
+	try:
+		sim.run()
+	except KeyboardInterrupt:
+		pass
+	finally:
+		print(f"Link statistics: {link.stats}")
+		if args.output:
+			with open(args.output, 'wb') as f:
+				f.write(flash.data)
+		if args.link and os.path.islink(args.link):
+			os.unlink(args.link)
+
+if __name__ == "__main__":
+	main()